@@ -0,0 +1,219 @@
+/*
+ * Mu benchmark driver
+ *
+ * Runs the bench function defined by each script with warmup and
+ * repetitions, and prints the timings as JSON.
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license in mu.h
+ */
+#define _POSIX_C_SOURCE 199309L
+#include "mu/mu.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#define BLOCK_SIZE 512
+#define MAX_REPS 1000
+
+
+// Global state
+static struct {
+    muint_t warmup;
+    muint_t reps;
+} opts = {3, 10};
+
+static bool first = true;
+
+
+// System functions
+static jmp_buf error_jmp;
+static char error_buf[256];
+
+mu_noreturn mu_sys_error(const char *m, muint_t len) {
+    snprintf(error_buf, sizeof error_buf, "%.*s", (unsigned)len, m);
+    longjmp(error_jmp, 1);
+}
+
+void mu_sys_print(const char *m, muint_t len) {
+    fprintf(stderr, "%.*s\n", (unsigned)len, m);
+}
+
+mu_t mu_sys_import(mu_t name) {
+    mu_dec(name);
+    return 0;
+}
+
+
+// Timing
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+static int cmp(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+// Output
+static void print_str(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((unsigned char)*s < ' ') {
+            printf("\\u%04x", *s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+static void print_name(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name+1 : path;
+    const char *ext = strrchr(name, '.');
+    muint_t len = ext ? (muint_t)(ext - name) : strlen(name);
+
+    char buf[256];
+    snprintf(buf, sizeof buf, "%.*s", (unsigned)len, name);
+    printf("%s\n    {\"name\": ", first ? "" : ",");
+    print_str(buf);
+    first = false;
+}
+
+
+// Benchmarking
+static mu_t load(const char *path, mu_t scope) {
+    FILE *file;
+    if (!(file = fopen(path, "r"))) {
+        mu_errorf("io error opening file (%d)", errno);
+    }
+
+    mu_t buffer = mu_buf_create(0);
+    muint_t n = 0;
+
+    while (true) {
+        mu_buf_push(&buffer, &n, BLOCK_SIZE);
+        size_t read = fread(
+                (mbyte_t*)mu_buf_getdata(buffer) + n - BLOCK_SIZE,
+                1, BLOCK_SIZE, file);
+
+        if (read < BLOCK_SIZE) {
+            n -= BLOCK_SIZE - read;
+            break;
+        }
+    }
+
+    if (ferror(file)) {
+        fclose(file);
+        mu_errorf("io error reading file (%d)", errno);
+    }
+
+    fclose(file);
+
+    mu_eval(mu_buf_getdata(buffer), n, scope, 0);
+    mu_dec(buffer);
+
+    mu_t fn = mu_tbl_lookup(scope, mu_str_format("bench"));
+    if (!fn || !mu_isfn(fn)) {
+        mu_errorf("no bench function defined");
+    }
+
+    return fn;
+}
+
+static void bench(const char *path) {
+    static double times[MAX_REPS];
+    print_name(path);
+
+    if (setjmp(error_jmp)) {
+        printf(", \"error\": ");
+        print_str(error_buf);
+        printf("}");
+        return;
+    }
+
+    // functions declared in the scope only weakly reference it,
+    // so the scope is kept until the benchmark is done
+    mu_t scope = mu_tbl_createtail(0, MU_BUILTINS);
+    mu_t fn = load(path, scope);
+
+    for (muint_t i = 0; i < opts.warmup; i++) {
+        mu_fn_call(mu_inc(fn), 0x00);
+    }
+
+    double total = 0;
+    for (muint_t i = 0; i < opts.reps; i++) {
+        double start = now();
+        mu_fn_call(mu_inc(fn), 0x00);
+        times[i] = now() - start;
+        total += times[i];
+    }
+
+    mu_dec(fn);
+    mu_dec(scope);
+    qsort(times, opts.reps, sizeof(double), cmp);
+
+    printf(", \"warmup\": %u, \"reps\": %u",
+            (unsigned)opts.warmup, (unsigned)opts.reps);
+    printf(", \"min_ms\": %.3f, \"median_ms\": %.3f, "
+           "\"mean_ms\": %.3f, \"max_ms\": %.3f}",
+            times[0], times[opts.reps/2],
+            total/opts.reps, times[opts.reps-1]);
+}
+
+
+// Entry point
+static mu_noreturn usage(const char *name) {
+    fprintf(stderr, "\n"
+           "usage: %s [options] [files]\n"
+           "options:\n"
+           "  -w count      warmup runs before timing (default 3)\n"
+           "  -r count      timed runs per benchmark (default 10)\n"
+           "files: scripts that define a bench function\n"
+           "\n", name);
+
+    exit(-1);
+}
+
+int main(int argc, const char **argv) {
+    const char *name = *argv++;
+
+    while (*argv && (*argv)[0] == '-') {
+        char opt = (*argv++)[1];
+        if (!*argv) {
+            usage(name);
+        }
+
+        long count = strtol(*argv++, 0, 10);
+        if (opt == 'w' && count >= 0) {
+            opts.warmup = count;
+        } else if (opt == 'r' && count > 0 && count <= MAX_REPS) {
+            opts.reps = count;
+        } else {
+            usage(name);
+        }
+    }
+
+    if (!*argv) {
+        usage(name);
+    }
+
+    printf("{\"benchmarks\": [");
+    while (*argv) {
+        bench(*argv++);
+    }
+    printf("\n]}\n");
+
+    return 0;
+}
@@ -21,14 +21,32 @@ static const char *const op_names[16] = {
     [MU_OP_LOOKDN] = "lookdn",
     [MU_OP_INSERT] = "insert",
     [MU_OP_ASSIGN] = "assign",
+    [MU_OP_ARITH]  = "arith",
     [MU_OP_JUMP]   = "jump",
-    [MU_OP_JTRUE]  = "jtrue",
     [MU_OP_JFALSE] = "jfalse",
     [MU_OP_CALL]   = "call",
     [MU_OP_TCALL]  = "tcall",
     [MU_OP_RET]    = "ret",
 };
 
+static const char *const arith_names[16] = {
+    [0xf & MU_OP_ADD]  = "add",
+    [0xf & MU_OP_SUB]  = "sub",
+    [0xf & MU_OP_MUL]  = "mul",
+    [0xf & MU_OP_DIV]  = "div",
+    [0xf & MU_OP_IDIV] = "idiv",
+    [0xf & MU_OP_MOD]  = "mod",
+    [0xf & MU_OP_POW]  = "pow",
+    [0xf & MU_OP_EQ]   = "eq",
+    [0xf & MU_OP_NEQ]  = "neq",
+    [0xf & MU_OP_LT]   = "lt",
+    [0xf & MU_OP_LTE]  = "lte",
+    [0xf & MU_OP_GT]   = "gt",
+    [0xf & MU_OP_GTE]  = "gte",
+    [0xf & MU_OP_NEG]  = "neg",
+    [0xf & MU_OP_NOT]  = "not",
+};
+
 static mu_t mu_dis_summu(mu_t m) {
     mu_t b = mu_buf_create(0);
     muint_t n = 0;
@@ -99,6 +117,25 @@ static void mu_dis_code(mu_t c) {
                     pc[0] >> 8, 0xff & pc[0], op_names[op],
                     0xf & (pc[0] >> 8), 0xf & (pc[0] >> 4), 0xf & pc[0]);
             pc += 1;
+        } else if (op == MU_OP_ARITH
+                && (0xf & (pc[0] >> 4)) == (0xf & MU_OP_WIDE)) {
+            mu_printf("%hx  %bx%bx      wide 0x%bx, 0x%bx", pc - start,
+                    pc[0] >> 8, 0xff & pc[0],
+                    0xf & (pc[0] >> 8), 0xf & pc[0]);
+            pc += 1;
+        } else if (op == MU_OP_ARITH
+                && (0xf & (pc[0] >> 4)) >= (0xf & MU_OP_NEG)) {
+            mu_printf("%hx  %bx%bx      %s r%d", pc - start,
+                    pc[0] >> 8, 0xff & pc[0],
+                    arith_names[0xf & (pc[0] >> 4)],
+                    0xf & (pc[0] >> 8));
+            pc += 1;
+        } else if (op == MU_OP_ARITH) {
+            mu_printf("%hx  %bx%bx      %s r%d, r%d", pc - start,
+                    pc[0] >> 8, 0xff & pc[0],
+                    arith_names[0xf & (pc[0] >> 4)],
+                    0xf & (pc[0] >> 8), 0xf & pc[0]);
+            pc += 1;
         } else if (op == MU_OP_IMM && (0xff & pc[0]) == 0xff) {
             mu_printf("%hx  %bx%bx%bx%bx  %s r%d, %u%m", pc - start,
                     pc[0] >> 8, 0xff & pc[0],
@@ -215,19 +252,20 @@ static void mu_dis_buf(mu_t m) {
 
 static void mu_dis_tbl(mu_t m) {
     struct mtbl *t = (struct mtbl *)((muint_t)m & ~7);
-    mu_printf("ref: %hu, len: %hu, nils: %hu",
-            t->ref, t->len, t->nils);
-    mu_printf("npw2: %qu, isize: %qu, ro: %d",
-            t->npw2, t->isize, mu_gettype(m) == MTRTBL);
+    mu_printf("ref: %hu, len: %hu, alen: %hu, hlen: %hu, nils: %hu",
+            t->ref, t->len, t->alen, t->hlen, t->nils);
+    mu_printf("aoff: %hu", t->aoff);
+    mu_printf("apw2: %qu, npw2: %qu, isize: %qu, ro: %d",
+            t->apw2, t->npw2, t->isize, mu_gettype(m) == MTRTBL);
     mu_printf("tail: %t", mu_inc(t->tail));
 
-    if (t->isize == 0) {
-        mu_printf("array:");
-        for (muint_t i = 0; i < t->len+t->nils; i++) {
-            mu_printf("%hx  %t%m", i, mu_inc(t->array[i]),
-                    mu_dis_summu(mu_inc(t->array[i])));
-        }
-    } else {
+    mu_printf("array:");
+    for (muint_t i = 0; i < t->alen; i++) {
+        mu_t v = t->array[(t->aoff + i) & ((1 << t->apw2)-1)];
+        mu_printf("%hx  %t%m", i, mu_inc(v), mu_dis_summu(mu_inc(v)));
+    }
+
+    if (t->pairs) {
         mu_printf("indices:");
         mu_t line = mu_buf_create(80);
         for (muint_t i = 0; i < (1 << t->npw2); i += 16) {
@@ -236,21 +274,21 @@ static void mu_dis_tbl(mu_t m) {
             for (muint_t j = 0; j < 16/t->isize && i+j < (1 << t->npw2); j++) {
 #ifdef MU64
                 if (t->isize == 1) {
-                    mu_buf_pushf(&line, &n, "%bx ", ((mbyte_t*)t->array)[i+j]);
+                    mu_buf_pushf(&line, &n, "%bx ", ((mbyte_t*)t->pairs)[i+j]);
                 } else if (t->isize == 2) {
-                    mu_buf_pushf(&line, &n, "%qx ", ((muintq_t*)t->array)[i+j]);
+                    mu_buf_pushf(&line, &n, "%qx ", ((muintq_t*)t->pairs)[i+j]);
                 } else if (t->isize == 4) {
-                    mu_buf_pushf(&line, &n, "%hx ", ((muinth_t*)t->array)[i+j]);
+                    mu_buf_pushf(&line, &n, "%hx ", ((muinth_t*)t->pairs)[i+j]);
                 } else if (t->isize == 8) {
-                    mu_buf_pushf(&line, &n, "%wx ", ((muint_t*)t->array)[i+j]);
+                    mu_buf_pushf(&line, &n, "%wx ", ((muint_t*)t->pairs)[i+j]);
                 }
 #else
                 if (t->isize == 1) {
-                    mu_buf_pushf(&line, &n, "%bx ", ((mbyte_t*)t->array)[i+j]);
+                    mu_buf_pushf(&line, &n, "%bx ", ((mbyte_t*)t->pairs)[i+j]);
                 } else if (t->isize == 2) {
-                    mu_buf_pushf(&line, &n, "%hx ", ((muinth_t*)t->array)[i+j]);
+                    mu_buf_pushf(&line, &n, "%hx ", ((muinth_t*)t->pairs)[i+j]);
                 } else if (t->isize == 4) {
-                    mu_buf_pushf(&line, &n, "%wx ", ((muint_t*)t->array)[i+j]);
+                    mu_buf_pushf(&line, &n, "%wx ", ((muint_t*)t->pairs)[i+j]);
                 }
 #endif
             }
@@ -259,17 +297,17 @@ static void mu_dis_tbl(mu_t m) {
         }
         mu_dec(line);
 
-        mu_printf("array:");
+        mu_printf("pairs:");
         muint_t off = (t->isize*(1 << t->npw2) +
                 (2*sizeof(mu_t))-1) / (2*sizeof(mu_t));
 
-        for (muint_t i = 0; i < t->len+t->nils; i++) {
+        for (muint_t i = 0; i < t->hlen; i++) {
             mu_printf("%hx  %t %t%m", i,
-                    mu_inc(t->array[2*(off+i)+0]),
-                    mu_inc(t->array[2*(off+i)+1]),
+                    mu_inc(t->pairs[2*(off+i)+0]),
+                    mu_inc(t->pairs[2*(off+i)+1]),
                     mu_dis_sumpair(
-                        mu_inc(t->array[2*(off+i)+0]),
-                        mu_inc(t->array[2*(off+i)+1])));
+                        mu_inc(t->pairs[2*(off+i)+0]),
+                        mu_inc(t->pairs[2*(off+i)+1])));
         }
     }
 }
@@ -14,11 +14,22 @@
 #define MU_DIS_ENTRY { NULL, NULL }
 #endif
 
+#ifdef MU_PROF
+#include "prof/prof.h"
+#define MU_PROF_ENTRY { mu_prof_key_def, mu_prof_module_def }
+#else
+#define MU_PROF_ENTRY { NULL, NULL }
+#endif
+
 #include <string.h>
 #include <stdio.h>
 #include <setjmp.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define BLOCK_SIZE 512
 #define HISTORY_LEN 256
@@ -31,6 +42,7 @@ static struct {
     bool execute;
     bool interpret;
     bool load;
+    const char *compile;
 } mode;
 
 // Mu state
@@ -65,6 +77,7 @@ void mu_sys_print(const char *m, muint_t len) {
 
 MU_DEF_TBL(mu_sys_imports_def, {
     MU_DIS_ENTRY,
+    MU_PROF_ENTRY,
 })
 
 mu_t mu_sys_import(mu_t name) {
@@ -80,7 +93,45 @@ static void execute(const char *input) {
     }
 }
 
-static void load_file(FILE *file) {
+static void compile(const void *data, muint_t n, const char *name) {
+    mu_t c = mu_code_isdump(data, n) ? mu_code_load(data, n)
+                                     : mu_compile(data, n, mu_inc(scope));
+    mu_t b = mu_code_dump(c);
+
+    FILE *file;
+    if (!(file = fopen(name, "wb"))) {
+        mu_errorf("io error opening file (%d)", errno);
+    }
+
+    // buffered writes may only fail once the file is closed
+    fwrite(mu_buf_getdata(b), 1, mu_buf_getlen(b), file);
+    bool failed = ferror(file);
+    if (fclose(file) != 0 || failed) {
+        mu_errorf("io error writing file (%d)", errno);
+    }
+
+    mu_dec(b);
+}
+
+// Runs either source or compiled code, marking the data as kept once
+// compiled code starts running, since any functions it creates refer
+// to the data for lazily loading their code
+static void load_data(const void *data, muint_t n, bool program,
+                      volatile bool *keep) {
+    if (program && mode.compile) {
+        compile(data, n, mode.compile);
+    } else if (mu_code_isdump(data, n)) {
+        mu_t frame[MU_FRAME];
+        mu_t code = mu_code_load(data, n);
+        *keep = true;
+        mcnt_t rets = mu_exec(code, mu_inc(scope), frame);
+        mu_frameconvert(rets, 0, frame);
+    } else {
+        mu_eval(data, n, scope, 0);
+    }
+}
+
+static void load_file(FILE *file, bool program) {
     if (!setjmp(error_jmp)) {
         mu_t buffer = mu_buf_create(0);
         muint_t n = 0;
@@ -92,6 +143,7 @@ static void load_file(FILE *file) {
                     1, BLOCK_SIZE, file);
 
             if (read < BLOCK_SIZE) {
+                n -= BLOCK_SIZE - read;
                 break;
             }
         }
@@ -100,21 +152,51 @@ static void load_file(FILE *file) {
             mu_errorf("io error reading file (%d)", errno);
         }
 
-        mu_eval(mu_buf_getdata(buffer), n, scope, 0);
-        mu_dec(buffer);
+        volatile bool keep = false;
+        load_data(mu_buf_getdata(buffer), n, program, &keep);
+        if (!keep) {
+            mu_dec(buffer);
+        }
     }
 }
 
-static void load(const char *name) {
+// Files are mapped directly, compiled code is left mapped
+// for the lifetime of the program since it is loaded lazily.
+// Otherwise the file is unmapped, even if loading fails.
+static void load(const char *name, bool program) {
+    void *volatile data = 0;
+    volatile off_t size = 0;
+    volatile bool keep = false;
+
     if (!setjmp(error_jmp)) {
-        FILE *file;
-        if (!(file = fopen(name, "r"))) {
+        int fd;
+        if ((fd = open(name, O_RDONLY)) < 0) {
             mu_errorf("io error opening file (%d)", errno);
         }
 
-        load_file(file);
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            mu_errorf("io error reading file (%d)", errno);
+        }
+
+        if (st.st_size > 0) {
+            void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                close(fd);
+                mu_errorf("io error reading file (%d)", errno);
+            }
+
+            data = map;
+            size = st.st_size;
+        }
+
+        close(fd);
+        load_data(size > 0 ? data : "", size, program, &keep);
+    }
 
-        fclose(file);
+    if (size > 0 && !keep) {
+        munmap(data, size);
     }
 }
 
@@ -147,6 +229,8 @@ static mu_noreturn usage(const char *name) {
            "  -e string     execute string before program\n"
            "  -l file       import and execute file before program\n"
            "  -i            run interactively after program\n"
+           "  -c file       compile program to file instead of running\n"
+           "  -O level      optimize compiled code at level 0-2 (default 2)\n"
            "  --            stop handling options\n"
            "program: file to execute and run or '-' for stdin\n"
            "args: arguments passed to running program\n"
@@ -179,9 +263,31 @@ static void options(void) {
                     usage(name);
                 }
 
-                load(*argv++);
+                load(*argv++, false);
+                break;
+
+            case 'c':
+                if (!*argv) {
+                    usage(name);
+                }
+
+                mode.compile = *argv++;
                 break;
 
+            case 'O': {
+                char *end;
+                if (!*argv || !(*argv)[0]) {
+                    usage(name);
+                }
+
+                unsigned long level = strtoul(*argv++, &end, 10);
+                if (*end || level > 2) {
+                    usage(name);
+                }
+
+                mu_setoptimize(level);
+            } break;
+
             case 'i':
                 mode.interpret = true;
                 break;
@@ -207,14 +313,18 @@ int main(int argc1, const char **argv1) {
 
     if (mode.load || *argv) {
         if (mode.load) {
-            load_file(stdin);
+            load_file(stdin, true);
         } else {
-            load(*argv++);
+            load(*argv++, true);
         }
 
         mode.load = true;
     }
 
+    if (mode.compile) {
+        return 0;
+    }
+
     init_args();
 
     if (mode.interpret || (!mode.load && !mode.execute)) {
@@ -17,35 +17,55 @@ mu_inline bool mu_isdbuf(mu_t b) {
     return (MTBUF^MTDBUF) & (muint_t)b;
 }
 
-
-// Functions for handling buffers
-mu_t mu_buf_create(muint_t n) {
-    return mu_buf_createtail(n, 0, 0);
+mu_inline mgcvisit_t *mu_buf_getvisit(mu_t b) {
+    if (mu_isdbuf(b)) {
+        return *(mgcvisit_t **)(mbuf(b)->data + mu_align(mbuf(b)->len) +
+                sizeof(mdtor_t *) + sizeof(mu_t));
+    } else {
+        return 0;
+    }
 }
 
-mu_t mu_buf_createdtor(muint_t n, mdtor_t *dtor) {
-    return mu_buf_createtail(n, dtor, 0);
-}
 
-mu_t mu_buf_createtail(muint_t n, mdtor_t *dtor, mu_t tail) {
+// Functions for handling buffers
+static mu_t mu_buf_createdbuf(muint_t n, mdtor_t *dtor, mu_t tail,
+                              mgcvisit_t *visit) {
     mu_checklen(n <= (mlen_t)-1, "buffer");
 
-    if (!dtor && !tail) {
+    if (!dtor && !tail && !visit) {
         struct mbuf *b = mu_alloc(mu_offsetof(struct mbuf, data) + n);
         b->ref = 1;
         b->len = n;
         return (mu_t)((muint_t)b + MTBUF);
     } else {
         struct mbuf *b = mu_alloc(mu_offsetof(struct mbuf, data) +
-                mu_align(n) + sizeof(dtor) + sizeof(tail));
+                mu_align(n) + sizeof(dtor) + sizeof(tail) + sizeof(visit));
         b->ref = 1;
         b->len = n;
         *(mdtor_t **)(b->data + mu_align(b->len)) = dtor;
         *(mu_t *)(b->data + mu_align(b->len) + sizeof(mdtor_t *)) = tail;
+        *(mgcvisit_t **)(b->data + mu_align(b->len) +
+                sizeof(mdtor_t *) + sizeof(mu_t)) = visit;
         return (mu_t)((muint_t)b + MTDBUF);
     }
 }
 
+mu_t mu_buf_create(muint_t n) {
+    return mu_buf_createtail(n, 0, 0);
+}
+
+mu_t mu_buf_createdtor(muint_t n, mdtor_t *dtor) {
+    return mu_buf_createtail(n, dtor, 0);
+}
+
+mu_t mu_buf_createtail(muint_t n, mdtor_t *dtor, mu_t tail) {
+    return mu_buf_createdbuf(n, dtor, tail, 0);
+}
+
+mu_t mu_buf_createvisit(muint_t n, mdtor_t *dtor, mgcvisit_t *visit) {
+    return mu_buf_createdbuf(n, dtor, 0, visit);
+}
+
 void mu_buf_destroy(mu_t b) {
     mu_dealloc(mbuf(b), mu_offsetof(struct mbuf, data) + mbuf(b)->len);
 }
@@ -60,13 +80,28 @@ void mu_buf_destroydtor(mu_t b) {
     mu_dealloc(mbuf(b),
             mu_offsetof(struct mbuf, data) +
             mu_align(mbuf(b)->len) +
-            sizeof(mdtor_t *) + sizeof(mu_t));
+            sizeof(mdtor_t *) + sizeof(mu_t) + sizeof(mgcvisit_t *));
+}
+
+// Called by cycle collector to visit references held by a buffer
+void mu_buf_gcvisit(mu_t b, void (*visit)(mu_t *)) {
+    if (!mu_isdbuf(b)) {
+        return;
+    }
+
+    visit((mu_t *)(mbuf(b)->data + mu_align(mbuf(b)->len) +
+            sizeof(mdtor_t *)));
+
+    if (mu_buf_getvisit(b)) {
+        mu_buf_getvisit(b)(b, visit);
+    }
 }
 
 void mu_buf_resize(mu_t *b, muint_t n) {
     mu_checklen(n <= (mlen_t)-1, "buffer");
 
-    mu_t nb = mu_buf_createtail(n, mu_buf_getdtor(*b), mu_buf_gettail(*b));
+    mu_t nb = mu_buf_createdbuf(n, mu_buf_getdtor(*b), mu_buf_gettail(*b),
+            mu_buf_getvisit(*b));
     memcpy(mu_buf_getdata(nb), mu_buf_getdata(*b),
             (n < mu_buf_getlen(*b)) ? n : mu_buf_getlen(*b));
 
@@ -84,7 +119,7 @@ void mu_buf_push(mu_t *b, muint_t *i, muint_t n) {
 
     muint_t overhead = mu_offsetof(struct mbuf, data);
     if (mu_isdbuf(*b)) {
-        overhead += sizeof(mdtor_t *) + sizeof(mu_t);
+        overhead += sizeof(mdtor_t *) + sizeof(mu_t) + sizeof(mgcvisit_t *);
     }
 
     muint_t size = overhead + mu_buf_getlen(*b);
@@ -145,7 +180,12 @@ mu_t mu_buf_frommu(mu_t m) {
         case MTNIL:
             return mu_buf_create(0);
 
-        case MTSTR:
+        case MTSTR: {
+            mu_t b = mu_buf_fromdata(mu_str_getdata(m), mu_str_getlen(m));
+            mu_dec(m);
+            return b;
+        } break;
+
         case MTBUF:
         case MTDBUF: {
             mu_t b = mu_buf_fromdata(mbuf(m)->data, mbuf(m)->len);
@@ -186,9 +226,13 @@ void mu_buf_pushdata(mu_t *b, muint_t *i, const void *c, muint_t n) {
 
 void mu_buf_pushmu(mu_t *b, muint_t *i, mu_t c) {
     mu_assert(mu_isstr(c) || mu_isbuf(c));
-    mu_t cbuf = (mu_t)(~(MTSTR^MTBUF) & (muint_t)c);
 
-    mu_buf_pushdata(b, i, mu_buf_getdata(cbuf), mu_buf_getlen(cbuf));
+    if (mu_isstr(c)) {
+        mu_buf_pushdata(b, i, mu_str_getdata(c), mu_str_getlen(c));
+    } else {
+        mu_buf_pushdata(b, i, mu_buf_getdata(c), mu_buf_getlen(c));
+    }
+
     mu_dec(c);
 }
 
@@ -284,6 +328,11 @@ void mu_buf_vpushf(mu_t *b, muint_t *i, const char *f, va_list args) {
 
             case 'r': {
                 mu_t m = va_arg(args, mu_t);
+                if (mu_isnum(m)) {
+                    mu_num_dump(b, i, m);
+                    break;
+                }
+
                 m = mu_fn_call(MU_REPR, 0x21, m, mu_num_fromuint(0));
                 mu_buf_pushmu(b, i, m);
             } break;
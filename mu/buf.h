@@ -19,17 +19,23 @@ struct mbuf {
     mref_t ref;     // reference count
     mlen_t len;     // length of allocated data
     mbyte_t data[]; // data follows
-    // optional destructor stored at end
+    // optional destructor, tail and visitor stored at end
 };
 
 // Destructor type for deallocating buffers
 typedef void mdtor_t(mu_t);
 
+// Visitor type for buffers holding tables or functions, passes each
+// reference to the cycle collector so cycles through the buffer are
+// still found
+typedef void mgcvisit_t(mu_t, void (*)(mu_t *));
+
 
 // Creates buffer with specified size
 mu_t mu_buf_create(muint_t n);
 mu_t mu_buf_createdtor(muint_t n, mdtor_t *dtor);
 mu_t mu_buf_createtail(muint_t n, mdtor_t *dtor, mu_t tail);
+mu_t mu_buf_createvisit(muint_t n, mdtor_t *dtor, mgcvisit_t *visit);
 
 mu_inline mu_t mu_buf_fromdata(const void *s, muint_t n);
 mu_inline mu_t mu_buf_fromcstr(const char *s);
@@ -152,7 +158,8 @@ mu_pure mu_t name(void) {                                                   \
         t data[sizeof((t[])__VA_ARGS__) / sizeof(t)];                       \
         mu_aligned(sizeof(muint_t)) mdtor_t *dtor;                          \
         mu_aligned(sizeof(muint_t)) mu_t tail;                              \
-    } inst = {0, sizeof((t[])__VA_ARGS__), __VA_ARGS__, dtor, 0};           \
+        mu_aligned(sizeof(muint_t)) mgcvisit_t *visit;                      \
+    } inst = {0, sizeof((t[])__VA_ARGS__), __VA_ARGS__, dtor, 0, 0};        \
                                                                             \
     return (mu_t)((muint_t)&inst + MTDBUF);                                 \
 }
@@ -167,7 +174,8 @@ mu_pure mu_t name(void) {                                                   \
         t data[sizeof((t[])__VA_ARGS__) / sizeof(t)];                       \
         mu_aligned(sizeof(muint_t)) mdtor_t *dtor;                          \
         mu_aligned(sizeof(muint_t)) mu_t tail;                              \
-    } inst = {0, sizeof((t[])__VA_ARGS__), __VA_ARGS__, dtor, 0};           \
+        mu_aligned(sizeof(muint_t)) mgcvisit_t *visit;                      \
+    } inst = {0, sizeof((t[])__VA_ARGS__), __VA_ARGS__, dtor, 0, 0};        \
                                                                             \
     if (!ref) {                                                             \
         mu_t (*taildef)(void) = tail;                                       \
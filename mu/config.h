@@ -29,6 +29,21 @@
 //#define MU_DEBUG
 #define MU_MALLOC
 //#define MU_COMPUTED_GOTO
+#ifndef MU_NO_SLAB
+#define MU_SLAB
+#endif
+
+// The JIT only targets x86-64 Linux, and is bypassed when profiling
+#if defined(MU_JIT) && \
+        (!defined(__x86_64__) || !defined(__linux__) || defined(MU_PROF))
+#undef MU_JIT
+#endif
+
+// Vectorized string search is selected at runtime on x86 with GCC or Clang
+#if !defined(MU_NO_SIMD) && defined(__GNUC__) && \
+        (defined(__x86_64__) || defined(__i386__))
+#define MU_SIMD
+#endif
 
 
 // Definition of macro-like inlined functions
@@ -56,6 +71,12 @@
 // Builtin for an unreachable point in code
 #define mu_unreachable __builtin_unreachable()
 
+// Builtin for branches that are rarely taken
+#define mu_unlikely(x) __builtin_expect(!!(x), 0)
+
+// Builtin for multiplication, returns true on overflow
+#define mu_mulo(a, b, r) __builtin_mul_overflow(a, b, r)
+
 // Builtin for the next power of two
 #ifdef MU32
 #define mu_npw2(x) (32 - __builtin_clz((x)-1))
@@ -66,6 +87,21 @@
 // Builtin for finding next alignment for pointers
 #define mu_align(x) (((x) + sizeof(uintptr_t)-1) & ~(sizeof(uintptr_t)-1))
 
+// Definition of thread-local variables and atomic accesses, used for
+// the current state, MU_NO_THREADS drops them for single-threaded systems
+#ifndef MU_NO_THREADS
+#define mu_thread __thread
+#define mu_atomic_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define mu_atomic_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define mu_atomic_cas(p, e, v) __atomic_compare_exchange_n( \
+        p, e, v, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+#else
+#define mu_thread
+#define mu_atomic_load(p) (*(p))
+#define mu_atomic_store(p, v) (void)(*(p) = (v))
+#define mu_atomic_cas(p, e, v) (*(p) == *(e) ? (*(p) = (v), true) : false)
+#endif
+
 // Definition of Mu specific assert function
 #ifdef MU_DEBUG
 #include <assert.h>
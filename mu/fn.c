@@ -16,6 +16,15 @@ mu_inline struct mfn *mfn(mu_t f) {
 
 // Creation functions
 mu_t mu_fn_fromcode(mu_t c, mu_t closure) {
+    extern void mu_code_destroylazy(mu_t);
+    mu_gc_poll();
+    if (mu_isdtor(c, mu_code_destroylazy)) {
+        extern mu_t mu_code_force(mu_t);
+        mu_t l = c;
+        c = mu_code_force(l);
+        mu_dec(l);
+    }
+
     if (mu_code_getflags(c) & MU_FN_WEAK) {
         mu_assert(mu_getref(closure) > 1);
         mu_dec(closure);
@@ -23,6 +32,7 @@ mu_t mu_fn_fromcode(mu_t c, mu_t closure) {
 
     struct mfn *f = mu_alloc(sizeof(struct mfn));
     f->ref = 1;
+    f->gc = MU_GC_BLACK;
     f->args = mu_code_getargs(c);
     f->flags = mu_code_getflags(c);
     f->closure = closure;
@@ -31,8 +41,10 @@ mu_t mu_fn_fromcode(mu_t c, mu_t closure) {
 }
 
 mu_t mu_fn_frombfn(mcnt_t args, mbfn_t *bfn) {
+    mu_gc_poll();
     struct mfn *f = mu_alloc(sizeof(struct mfn));
     f->ref = 1;
+    f->gc = MU_GC_BLACK;
     f->args = args;
     f->flags = MU_FN_BUILTIN;
     f->closure = 0;
@@ -41,8 +53,10 @@ mu_t mu_fn_frombfn(mcnt_t args, mbfn_t *bfn) {
 }
 
 mu_t mu_fn_fromsbfn(mcnt_t args, msbfn_t *sbfn, mu_t closure) {
+    mu_gc_poll();
     struct mfn *f = mu_alloc(sizeof(struct mfn));
     f->ref = 1;
+    f->gc = MU_GC_BLACK;
     f->args = args;
     f->flags = MU_FN_BUILTIN | MU_FN_SCOPED;
     f->closure = closure;
@@ -79,13 +93,453 @@ void mu_fn_destroy(mu_t f) {
         mu_dec(mfn(f)->closure);
     }
 
+    // buffered functions are freed by the cycle collector
+    if (mfn(f)->gc & MU_GC_BUFFERED) {
+        mfn(f)->gc |= MU_GC_DEAD;
+        return;
+    }
+
     mu_dealloc(mfn(f), sizeof(struct mfn));
 }
 
+// Called by cycle collector to visit references
+// Buffers only referenced by the function are traced as part of it,
+// since the collector only counts references to tables and functions
+void mu_fn_gcvisit(mu_t f, void (*visit)(mu_t *)) {
+    extern void mu_buf_gcvisit(mu_t, void (*)(mu_t *));
+
+    if (mfn(f)->flags & MU_FN_WEAK) {
+        return;
+    }
+
+    mu_t c = mfn(f)->closure;
+    if (mu_gettype(c) == MTDBUF && mu_getref(c) == 1) {
+        mu_buf_gcvisit(c, visit);
+    } else {
+        visit(&mfn(f)->closure);
+    }
+}
+
 void mu_code_destroy(mu_t c) {
     for (muint_t i = 0; i < mu_code_getimmslen(c); i++) {
         mu_dec(mu_code_getimms(c)[i]);
     }
+
+    for (muint_t i = 0; i < mu_code_getcacheslen(c); i++) {
+        mu_dec(mu_code_getcaches(c)[i].key);
+    }
+
+#ifdef MU_JIT
+    mu_jit_destroy(c);
+#endif
+}
+
+
+// Serialized code format
+//
+// Code objects are written in native byte order and word size after
+// a short header, and are only loaded by a matching build:
+//   magic    4 bytes "\x1bmu" followed by the format version
+//   width    1 byte sizeof(muint_t)
+//   order    1 byte, 1 if little endian
+//
+// Each code object is stored as its header fields followed by its
+// immediates and bytecode:
+//   args     u8     flags    u8
+//   regs     u16    locals   u16
+//   icount   u32    ccount   u32    bcount   u32
+//   imms     icount tagged immediates
+//   bcode    bcount bytes
+//
+// Immediates are prefixed by their type tag, MTNIL, MTNUM with the
+// raw word, MTSTR with a u32 length and data, or MTDBUF for nested
+// code with a u32 length and code object. Nested code is loaded
+// lazily the first time a function is created from it, so strings
+// are only interned for functions that are actually used.
+//
+// Loaded code is checked for anything that would index outside of the
+// code object, its registers or its bytecode, so truncated or corrupted
+// files raise an error instead of running. Reference counting is still
+// left to the compiler, so compiled files must come from a trusted
+// compiler and can not be treated as untrusted input.
+#define MU_CODE_MAGIC "\x1bmu\x03"
+#define MU_CODE_HEADER 6
+
+// Placeholder for nested code that has not been loaded yet
+struct mlazy {
+    const mbyte_t *pos;
+    const mbyte_t *end;
+    mu_t code;
+};
+
+void mu_code_destroylazy(mu_t l) {
+    mu_dec(((struct mlazy *)mu_buf_getdata(l))->code);
+}
+
+static bool mu_code_islittle(void) {
+    uint16_t order = 1;
+    return *(uint8_t *)&order;
+}
+
+static void mu_code_dump8(mu_t *b, muint_t *n, uint8_t v) {
+    mu_buf_pushdata(b, n, &v, sizeof v);
+}
+
+static void mu_code_dump16(mu_t *b, muint_t *n, uint16_t v) {
+    mu_buf_pushdata(b, n, &v, sizeof v);
+}
+
+static void mu_code_dump32(mu_t *b, muint_t *n, uint32_t v) {
+    mu_buf_pushdata(b, n, &v, sizeof v);
+}
+
+static void mu_code_dumpcode(mu_t *b, muint_t *n, mu_t c) {
+    mu_code_dump8(b, n, mu_code_getargs(c));
+    mu_code_dump8(b, n, mu_code_getflags(c));
+    mu_code_dump16(b, n, mu_code_getregs(c));
+    mu_code_dump16(b, n, mu_code_getlocals(c));
+    mu_code_dump32(b, n, mu_code_getimmslen(c));
+    mu_code_dump32(b, n, mu_code_getcacheslen(c));
+    mu_code_dump32(b, n, mu_code_getbcodelen(c));
+
+    mu_t *imms = mu_code_getimms(c);
+    for (muint_t i = 0; i < mu_code_getimmslen(c); i++) {
+        mu_t m = imms[i];
+
+        if (!m) {
+            mu_code_dump8(b, n, MTNIL);
+        } else if (mu_isnum(m)) {
+            mu_code_dump8(b, n, MTNUM);
+            mu_buf_pushdata(b, n, &m, sizeof m);
+        } else if (mu_isstr(m)) {
+            mu_code_dump8(b, n, MTSTR);
+            mu_code_dump32(b, n, mu_str_getlen(m));
+            mu_buf_pushdata(b, n, mu_str_getdata(m), mu_str_getlen(m));
+        } else if (mu_iscode(m)) {
+            mu_code_dump8(b, n, MTDBUF);
+            muint_t start = *n;
+            mu_code_dump32(b, n, 0);
+            mu_code_dumpcode(b, n, m);
+
+            uint32_t len = *n - (start + sizeof(uint32_t));
+            memcpy((mbyte_t *)mu_buf_getdata(*b) + start, &len, sizeof len);
+        } else if (mu_isdtor(m, mu_code_destroylazy)) {
+            struct mlazy *l = mu_buf_getdata(m);
+            mu_code_dump8(b, n, MTDBUF);
+            mu_code_dump32(b, n, l->end - l->pos);
+            mu_buf_pushdata(b, n, l->pos, l->end - l->pos);
+        } else {
+            mu_errorf("unable to dump immediate %r", mu_inc(m));
+        }
+    }
+
+    mu_buf_pushdata(b, n, mu_code_getbcode(c), mu_code_getbcodelen(c));
+}
+
+mu_t mu_code_dump(mu_t c) {
+    mu_assert(mu_iscode(c));
+    mu_t b = mu_buf_create(0);
+    muint_t n = 0;
+
+    mu_buf_pushdata(&b, &n, MU_CODE_MAGIC, 4);
+    mu_code_dump8(&b, &n, sizeof(muint_t));
+    mu_code_dump8(&b, &n, mu_code_islittle());
+    mu_code_dumpcode(&b, &n, c);
+
+    mu_buf_resize(&b, n);
+    mu_dec(c);
+    return b;
+}
+
+bool mu_code_isdump(const void *data, muint_t n) {
+    return n >= 4 && memcmp(data, MU_CODE_MAGIC, 4) == 0;
+}
+
+static const mbyte_t *mu_code_take(const mbyte_t **pos, const mbyte_t *end,
+                                   muint_t n) {
+    if ((muint_t)(end - *pos) < n) {
+        mu_errorf("unexpected end of code object");
+    }
+
+    const mbyte_t *p = *pos;
+    *pos += n;
+    return p;
+}
+
+static uint8_t mu_code_load8(const mbyte_t **pos, const mbyte_t *end) {
+    return *mu_code_take(pos, end, sizeof(uint8_t));
+}
+
+static uint16_t mu_code_load16(const mbyte_t **pos, const mbyte_t *end) {
+    uint16_t v;
+    memcpy(&v, mu_code_take(pos, end, sizeof v), sizeof v);
+    return v;
+}
+
+static uint32_t mu_code_load32(const mbyte_t **pos, const mbyte_t *end) {
+    uint32_t v;
+    memcpy(&v, mu_code_take(pos, end, sizeof v), sizeof v);
+    return v;
+}
+
+static bool mu_code_checkframe(mcnt_t fc, muint_t d, muint_t regs) {
+    return (fc <= MU_FRAME || fc == 0xf) && d + mu_framecount(fc) <= regs;
+}
+
+// Checks the operands of each instruction against the code object,
+// marking instruction starts and jump targets to check jumps land on
+// an instruction. Execution must end in a return, tail call or jump.
+static bool mu_code_checkbcode(mu_t c) {
+    extern void mu_code_destroylazy(mu_t);
+    muint_t regs = mu_code_getregs(c);
+    muint_t icount = mu_code_getimmslen(c);
+    mu_t *imms = mu_code_getimms(c);
+    const uint16_t *bcode = mu_code_getbcode(c);
+    muint_t count = mu_code_getbcodelen(c) / sizeof(uint16_t);
+
+    if ((mu_code_getflags(c) & ~MU_FN_WEAK) != MU_FN_SCOPED ||
+            regs > MU_REGS ||
+            !mu_code_checkframe(mu_code_getargs(c), 1, regs) ||
+            mu_code_getbcodelen(c) % sizeof(uint16_t) != 0) {
+        return false;
+    }
+
+    mu_t marks = mu_buf_create(count);
+    mbyte_t *mark = mu_buf_getdata(marks);
+    memset(mark, 0, count);
+
+    bool valid = true;
+    mop_t op = MU_OP_RET;
+    muint_t i = 0;
+    while (valid && i < count) {
+        // instructions are at most two prefixes and two words
+        uint16_t ins[4] = {0};
+        memcpy(ins, &bcode[i], sizeof(uint16_t) *
+                (count - i < 4 ? count - i : 4));
+
+        mint_t d, a, b;
+        muint_t size = mu_decode(ins, &op, &d, &a, &b);
+        mint_t target = i + size + a;
+        valid = size <= count - i && d < regs;
+        mark[i] |= 1;
+        i += size;
+
+        switch (op) {
+            case MU_OP_IMM:
+                valid = valid && a < icount &&
+                        !mu_isdtor(imms[a], mu_code_destroylazy);
+                break;
+            case MU_OP_FN:
+                valid = valid && a < icount &&
+                        mu_isdtor(imms[a], mu_code_destroylazy);
+                break;
+            case MU_OP_TBL:
+            case MU_OP_DROP:
+                break;
+            case MU_OP_MOVE:
+            case MU_OP_DUP:
+                valid = valid && a < regs;
+                break;
+            case MU_OP_LOOKUP:
+            case MU_OP_LOOKDN:
+                valid = valid && mu_code_getcacheslen(c) > 0;
+                // fallthrough
+            case MU_OP_INSERT:
+            case MU_OP_ASSIGN:
+                valid = valid && a < regs && b < regs;
+                break;
+            case MU_OP_JUMP:
+            case MU_OP_JFALSE:
+                valid = valid && target >= 0 && target < count;
+                if (valid) {
+                    mark[target] |= 2;
+                }
+                break;
+            case MU_OP_CALL:
+                valid = valid &&
+                        mu_code_checkframe(a >> 4, d+1, regs) &&
+                        mu_code_checkframe(0xf & a, d, regs);
+                break;
+            case MU_OP_TCALL:
+                valid = valid && mu_code_checkframe(a, d+1, regs);
+                break;
+            case MU_OP_RET:
+                valid = valid && mu_code_checkframe(a, d, regs);
+                break;
+            case MU_OP_WIDE:
+                valid = false;
+                break;
+            default:
+                valid = valid && a < regs && mu_code_getcacheslen(c) > 0;
+                break;
+        }
+    }
+
+    valid = valid && (op == MU_OP_RET || op == MU_OP_TCALL ||
+                      op == MU_OP_JUMP);
+    for (i = 0; valid && i < count; i++) {
+        valid = mark[i] != 2;
+    }
+
+    mu_dec(marks);
+    return valid;
+}
+
+static mu_t mu_code_loadcode(const mbyte_t *pos, const mbyte_t *end) {
+    extern void mu_code_destroy(mu_t);
+    mcnt_t args = mu_code_load8(&pos, end);
+    uint8_t flags = mu_code_load8(&pos, end);
+    muintq_t regs = mu_code_load16(&pos, end);
+    muintq_t locals = mu_code_load16(&pos, end);
+    mlen_t icount = mu_code_load32(&pos, end);
+    mlen_t ccount = mu_code_load32(&pos, end);
+    mlen_t bcount = mu_code_load32(&pos, end);
+
+    if (ccount & (ccount-1)) {
+        mu_errorf("invalid cache count in code object");
+    }
+
+    mu_t b = mu_buf_createdtor(
+            mu_offsetof(struct mcode, data) +
+            sizeof(mu_t)*icount +
+            sizeof(struct mcache)*ccount +
+            bcount,
+            mu_code_destroy);
+
+    struct mcode *code = mu_buf_getdata(b);
+    code->args = args;
+    code->flags = flags;
+    code->regs = regs;
+    code->locals = locals;
+    code->icount = icount;
+    code->ccount = ccount;
+    code->bcount = bcount;
+#ifdef MU_PROF
+    code->prof = 0;
+#endif
+#ifdef MU_JIT
+    code->hot = 0;
+    code->jit = 0;
+#endif
+
+    mu_t *imms = mu_code_getimms(b);
+    memset(imms, 0, sizeof(mu_t)*icount);
+
+    for (muint_t i = 0; i < icount; i++) {
+        uint8_t type = mu_code_load8(&pos, end);
+
+        if (type == MTNIL) {
+            imms[i] = 0;
+        } else if (type == MTNUM) {
+            memcpy(&imms[i], mu_code_take(&pos, end, sizeof(mu_t)),
+                    sizeof(mu_t));
+            if (!mu_isnum(imms[i])) {
+                imms[i] = 0;
+                mu_errorf("invalid number in code object");
+            }
+        } else if (type == MTSTR) {
+            uint32_t len = mu_code_load32(&pos, end);
+            imms[i] = mu_str_fromdata(mu_code_take(&pos, end, len), len);
+        } else if (type == MTDBUF) {
+            uint32_t len = mu_code_load32(&pos, end);
+            imms[i] = mu_buf_createdtor(sizeof(struct mlazy),
+                    mu_code_destroylazy);
+            struct mlazy *l = mu_buf_getdata(imms[i]);
+            l->pos = mu_code_take(&pos, end, len);
+            l->end = l->pos + len;
+            l->code = 0;
+        } else {
+            mu_errorf("invalid immediate in code object");
+        }
+    }
+
+    memset(mu_code_getcaches(b), 0, sizeof(struct mcache)*ccount);
+    memcpy(mu_code_getbcode(b), mu_code_take(&pos, end, bcount), bcount);
+
+    if (pos != end) {
+        mu_errorf("unexpected data after code object");
+    }
+
+    if (!mu_code_checkbcode(b)) {
+        mu_dec(b);
+        mu_errorf("invalid bytecode in code object");
+    }
+
+    return b;
+}
+
+mu_t mu_code_load(const void *data, muint_t n) {
+    const mbyte_t *pos = data;
+    const mbyte_t *end = pos + n;
+
+    if (!mu_code_isdump(data, n) || n < MU_CODE_HEADER ||
+            pos[4] != sizeof(muint_t) ||
+            pos[5] != mu_code_islittle()) {
+        mu_errorf("incompatible code object");
+    }
+
+    pos += MU_CODE_HEADER;
+
+    return mu_code_loadcode(pos, end);
+}
+
+// Loads nested code on first use, does not consume
+mu_t mu_code_force(mu_t l) {
+    struct mlazy *lazy = mu_buf_getdata(l);
+    if (!lazy->code) {
+        lazy->code = mu_code_loadcode(lazy->pos, lazy->end);
+    }
+
+    return mu_inc(lazy->code);
+}
+
+// Nested code is loaded eagerly, so the copy does not
+// refer to any data the original was loaded from
+mu_t mu_code_copy(mu_t c) {
+    extern void mu_code_destroy(mu_t);
+    if (mu_isdtor(c, mu_code_destroylazy)) {
+        struct mlazy *lazy = mu_buf_getdata(c);
+        if (lazy->code) {
+            return mu_code_copy(lazy->code);
+        }
+
+        mu_t l = mu_code_loadcode(lazy->pos, lazy->end);
+        mu_t b = mu_code_copy(l);
+        mu_dec(l);
+        return b;
+    }
+
+    mu_t b = mu_buf_createdtor(mu_buf_getlen(c), mu_code_destroy);
+    struct mcode *code = mu_buf_getdata(b);
+    memcpy(code, mu_buf_getdata(c), mu_offsetof(struct mcode, data));
+#ifdef MU_PROF
+    code->prof = 0;
+#endif
+#ifdef MU_JIT
+    code->hot = 0;
+    code->jit = 0;
+#endif
+
+    mu_t *imms = mu_code_getimms(b);
+    memset(imms, 0, sizeof(mu_t)*code->icount);
+
+    for (muint_t i = 0; i < code->icount; i++) {
+        mu_t m = mu_code_getimms(c)[i];
+
+        if (!m || mu_isnum(m)) {
+            imms[i] = m;
+        } else if (mu_isstr(m)) {
+            imms[i] = mu_str_fromdata(mu_str_getdata(m), mu_str_getlen(m));
+        } else if (mu_iscode(m) || mu_isdtor(m, mu_code_destroylazy)) {
+            imms[i] = mu_code_copy(m);
+        } else {
+            mu_errorf("unable to copy immediate in code object");
+        }
+    }
+
+    memset(mu_code_getcaches(b), 0, sizeof(struct mcache)*code->ccount);
+    memcpy(mu_code_getbcode(b), mu_code_getbcode(c), code->bcount);
+    return b;
 }
 
 
@@ -109,8 +563,13 @@ mcnt_t mu_fn_tcall(mu_t f, mcnt_t fc, mu_t *frame) {
 
         case MU_FN_SCOPED: {
             mu_t c = mu_inc(mfn(f)->fn.code);
-            mu_t scope = mu_tbl_create(mu_code_getlocals(c));
-            mu_tbl_settail(scope, mu_fn_getclosure(f));
+            mu_t scope;
+            if (mu_code_getlocals(c)) {
+                scope = mu_tbl_create(mu_code_getlocals(c));
+                mu_tbl_settail(scope, mu_fn_getclosure(f));
+            } else {
+                scope = mu_fn_getclosure(f);
+            }
             mu_dec(f);
             return mu_exec(c, scope, frame);
         }
@@ -9,6 +9,7 @@
 #include "config.h"
 #include "types.h"
 #include "buf.h"
+#include "tbl.h"
 
 
 // Definition of C Function types
@@ -29,6 +30,7 @@ enum mu_fn_flags {
 // function should be called.
 struct mfn {
     mref_t ref;     // reference count
+    uint8_t gc;     // cycle collection state
     mcnt_t args;    // argument count
     uint8_t flags;  // function flags
 
@@ -75,10 +77,19 @@ struct mcode {
     muintq_t locals; // size of scope
 
     mlen_t icount;  // number of immediate values
+    mlen_t ccount;  // number of lookup caches, power of 2
     mlen_t bcount;  // number of bytecode instructions
+#ifdef MU_PROF
+    muint_t prof;   // index into mu_prof_codes + 1 if profiled
+#endif
+#ifdef MU_JIT
+    muint_t hot;    // calls and backward jumps before compiling
+    void (*jit)(void); // compiled native code
+#endif
 
     mu_t data[];    // data that follows code header
                     // immediate values
+                    // lookup caches, indexed by bytecode offset
                     // bytecode
 };
 
@@ -88,10 +99,23 @@ mu_inline bool mu_iscode(mu_t m);
 
 // Code access functions
 mu_inline mlen_t mu_code_getimmslen(mu_t c);
+mu_inline mlen_t mu_code_getcacheslen(mu_t c);
 mu_inline mlen_t mu_code_getbcodelen(mu_t c);
 mu_inline mu_t *mu_code_getimms(mu_t c);
+mu_inline struct mcache *mu_code_getcaches(mu_t c);
 mu_inline void *mu_code_getbcode(mu_t c);
 
+// Code serialization
+// loaded code refers to the data directly for lazily loading
+// nested code, so the data must outlive any loaded functions
+mu_t mu_code_dump(mu_t c);
+mu_t mu_code_load(const void *data, muint_t n);
+bool mu_code_isdump(const void *data, muint_t n);
+
+// Copies code without referencing the original, for passing
+// code between states, does not consume
+mu_t mu_code_copy(mu_t c);
+
 
 // Code checking 
 mu_inline bool mu_iscode(mu_t m) {
@@ -120,6 +144,10 @@ mu_inline mlen_t mu_code_getimmslen(mu_t c) {
     return ((struct mcode *)mu_buf_getdata(c))->icount;
 }
 
+mu_inline mlen_t mu_code_getcacheslen(mu_t c) {
+    return ((struct mcode *)mu_buf_getdata(c))->ccount;
+}
+
 mu_inline mlen_t mu_code_getbcodelen(mu_t c) {
     return ((struct mcode *)mu_buf_getdata(c))->bcount;
 }
@@ -128,8 +156,12 @@ mu_inline mu_t *mu_code_getimms(mu_t c) {
     return ((struct mcode *)mu_buf_getdata(c))->data;
 }
 
+mu_inline struct mcache *mu_code_getcaches(mu_t c) {
+    return (struct mcache *)(mu_code_getimms(c) + mu_code_getimmslen(c));
+}
+
 mu_inline void *mu_code_getbcode(mu_t c) {
-    return mu_code_getimms(c) + mu_code_getimmslen(c);
+    return mu_code_getcaches(c) + mu_code_getcacheslen(c);
 }
 
 // Function access
@@ -150,7 +182,7 @@ mu_inline mu_t mu_fn_getclosure(mu_t m) {
 #define MU_DEF_BFN(name, args, bfn)                                         \
 mu_pure mu_t name(void) {                                                   \
     static const struct mfn inst = {                                        \
-            0, args, MU_FN_BUILTIN, 0, {bfn}};                              \
+            0, 0, args, MU_FN_BUILTIN, 0, {bfn}};                           \
     return (mu_t)((muint_t)&inst + MTFN);                                   \
 }
 
@@ -158,16 +190,11 @@ mu_pure mu_t name(void) {                                                   \
 mu_pure mu_t name(void) {                                                   \
     static mu_t ref = 0;                                                    \
     static struct mfn inst = {                                              \
-            0, args, MU_FN_BUILTIN | MU_FN_SCOPED, 0, {sbfn}};              \
-                                                                            \
-    if (!ref) {                                                             \
-        mu_t (*closuredef)(void) = closure;                                 \
-        if (closuredef) {                                                   \
-            inst.closure = closuredef();                                    \
-        }                                                                   \
+            0, 0, args, MU_FN_BUILTIN | MU_FN_SCOPED, 0, {sbfn}};           \
                                                                             \
-        ref = (mu_t)((muint_t)&inst + MTFN);                                \
-    }                                                                       \
+    mu_t (*closuredef)(void) = closure;                                     \
+    MU_DEF_INIT(ref, (inst.closure = closuredef ? closuredef() : 0,         \
+            (mu_t)((muint_t)&inst + MTFN)))                                 \
                                                                             \
     return ref;                                                             \
 }
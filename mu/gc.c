@@ -0,0 +1,279 @@
+/*
+ * Cycle collection for Mu
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license in mu.h
+ */
+#include "mu.h"
+
+
+// Cycle collection uses the synchronous algorithm from Bacon and
+// Rajan's "Concurrent Cycle Collection in Reference Counted Systems".
+//
+// Tables and functions that are decremented without reaching zero
+// are buffered as possible roots of garbage cycles. When the buffer
+// passes the threshold, the subgraphs reachable from the roots are
+// trial-decremented to find cycles kept alive only by themselves.
+//
+// Collection state is owned by the current state.
+
+
+// Access to collection state
+mu_inline struct mgcstate *mu_gc(void) {
+    return &mu_state->gc;
+}
+
+mu_inline struct mgc *mgc(mu_t m) {
+    return (struct mgc *)(~7 & (muint_t)m);
+}
+
+mu_inline muint_t mu_gc_color(mu_t m) {
+    return mgc(m)->gc & MU_GC_COLOR;
+}
+
+mu_inline void mu_gc_setcolor(mu_t m, muint_t color) {
+    mgc(m)->gc = (mgc(m)->gc & ~MU_GC_COLOR) | color;
+}
+
+// Children that take part in collection, constants are skipped
+// but references may be trial-decremented to zero while gray
+static bool mu_gc_istracked(mu_t m) {
+    return mu_iscyclic(m) && (mgc(m)->ref != 0 ||
+            mu_gc_color(m) == MU_GC_GRAY ||
+            mu_gc_color(m) == MU_GC_WHITE);
+}
+
+static void mu_gc_visit(mu_t m, void (*visit)(mu_t *)) {
+    extern void mu_tbl_gcvisit(mu_t, void (*)(mu_t *));
+    extern void mu_fn_gcvisit(mu_t, void (*)(mu_t *));
+
+    if (mu_isfn(m)) {
+        mu_fn_gcvisit(m, visit);
+    } else {
+        mu_tbl_gcvisit(m, visit);
+    }
+}
+
+static void mu_gc_free(mu_t m) {
+    if (mu_isfn(m)) {
+        mu_dealloc(mgc(m), sizeof(struct mfn));
+    } else {
+        mu_dealloc(mgc(m), sizeof(struct mtbl));
+    }
+}
+
+// Growable arrays used for the roots, the work stack, and garbage
+static void mu_gc_append(mu_t **list, muint_t *len, muint_t *size, mu_t m) {
+    if (*len >= *size) {
+        muint_t nsize = *size ? 2 * *size : MU_MINALLOC / sizeof(mu_t);
+        mu_t *nlist = mu_alloc(nsize * sizeof(mu_t));
+        if (*len) {
+            memcpy(nlist, *list, *len * sizeof(mu_t));
+        }
+        mu_dealloc(*list, *size * sizeof(mu_t));
+        *list = nlist;
+        *size = nsize;
+    }
+
+    (*list)[(*len)++] = m;
+}
+
+mu_inline void mu_gc_push(mu_t m) {
+    mu_gc_append(&mu_gc()->stack,
+            &mu_gc()->stacklen, &mu_gc()->stacksize, m);
+}
+
+mu_inline mu_t mu_gc_pop(void) {
+    return mu_gc()->stack[--mu_gc()->stacklen];
+}
+
+
+// Buffering of possible roots, called by mu_dec
+void mu_gc_buffer(mu_t m) {
+    if (mgc(m)->gc == (MU_GC_PURPLE | MU_GC_BUFFERED)) {
+        return;
+    }
+
+    mu_gc_setcolor(m, MU_GC_PURPLE);
+
+    if (!(mgc(m)->gc & MU_GC_BUFFERED)) {
+        mgc(m)->gc |= MU_GC_BUFFERED;
+        mu_gc_append(&mu_gc()->roots,
+                &mu_gc()->count, &mu_gc()->rootsize, m);
+    }
+}
+
+
+// Marks the subgraph reachable from a root gray,
+// removing references internal to the subgraph
+static void mu_gc_markgray_visit(mu_t *p) {
+    mu_t m = *p;
+    if (!mu_gc_istracked(m)) {
+        return;
+    }
+
+    mgc(m)->ref--;
+    if (mu_gc_color(m) != MU_GC_GRAY) {
+        mu_gc_setcolor(m, MU_GC_GRAY);
+        mu_gc_push(m);
+    }
+}
+
+static void mu_gc_markgray(mu_t m) {
+    mu_gc_setcolor(m, MU_GC_GRAY);
+    mu_gc_push(m);
+
+    while (mu_gc()->stacklen > 0) {
+        mu_gc_visit(mu_gc_pop(), mu_gc_markgray_visit);
+    }
+}
+
+// Restores references of anything reachable from an external reference
+static void mu_gc_scanblack_visit(mu_t *p) {
+    mu_t m = *p;
+    if (!mu_gc_istracked(m)) {
+        return;
+    }
+
+    mgc(m)->ref++;
+    if (mu_gc_color(m) != MU_GC_BLACK) {
+        mu_gc_setcolor(m, MU_GC_BLACK);
+        mu_gc_push(m);
+    }
+}
+
+static void mu_gc_scanblack(mu_t m) {
+    muint_t base = mu_gc()->stacklen;
+    mu_gc_setcolor(m, MU_GC_BLACK);
+    mu_gc_push(m);
+
+    while (mu_gc()->stacklen > base) {
+        mu_gc_visit(mu_gc_pop(), mu_gc_scanblack_visit);
+    }
+}
+
+// Anything still gray without references is only referenced
+// by the subgraph itself and marked white
+static void mu_gc_scan_visit(mu_t *p) {
+    if (mu_gc_istracked(*p)) {
+        mu_gc_push(*p);
+    }
+}
+
+static void mu_gc_scan(mu_t m) {
+    mu_gc_push(m);
+
+    while (mu_gc()->stacklen > 0) {
+        m = mu_gc_pop();
+        if (mu_gc_color(m) != MU_GC_GRAY) {
+            continue;
+        }
+
+        if (mgc(m)->ref > 0) {
+            mu_gc_scanblack(m);
+        } else {
+            mu_gc_setcolor(m, MU_GC_WHITE);
+            mu_gc_visit(m, mu_gc_scan_visit);
+        }
+    }
+}
+
+// Gathers white objects for release
+static void mu_gc_collectwhite_visit(mu_t *p) {
+    mu_t m = *p;
+    if (mu_gc_istracked(m) && mu_gc_color(m) == MU_GC_WHITE &&
+            !(mgc(m)->gc & MU_GC_BUFFERED)) {
+        mu_gc_setcolor(m, MU_GC_BLACK);
+        mu_gc_append(&mu_gc()->white,
+                &mu_gc()->whitelen, &mu_gc()->whitesize, m);
+        mu_gc_push(m);
+    }
+}
+
+static void mu_gc_collectwhite(mu_t m) {
+    mu_t root = m;
+    mu_gc_collectwhite_visit(&root);
+
+    while (mu_gc()->stacklen > 0) {
+        mu_gc_visit(mu_gc_pop(), mu_gc_collectwhite_visit);
+    }
+}
+
+// Garbage is released with the normal destructors, so references
+// between garbage are cleared and references to live objects
+// that were trial-decremented are restored first
+static void mu_gc_release_visit(mu_t *p) {
+    mu_t m = *p;
+    if (!mu_gc_istracked(m)) {
+        return;
+    }
+
+    if (mu_gc_color(m) == MU_GC_WHITE) {
+        *p = 0;
+    } else {
+        mgc(m)->ref++;
+    }
+}
+
+static void mu_gc_release(void) {
+    extern void mu_destroy(mu_t m);
+
+    for (muint_t i = 0; i < mu_gc()->whitelen; i++) {
+        mu_gc_setcolor(mu_gc()->white[i], MU_GC_WHITE);
+    }
+
+    for (muint_t i = 0; i < mu_gc()->whitelen; i++) {
+        mu_gc_visit(mu_gc()->white[i], mu_gc_release_visit);
+    }
+
+    for (muint_t i = 0; i < mu_gc()->whitelen; i++) {
+        mgc(mu_gc()->white[i])->gc = MU_GC_BLACK;
+        mu_destroy(mu_gc()->white[i]);
+    }
+
+    mu_gc()->whitelen = 0;
+}
+
+
+// Collects any garbage cycles among the buffered roots
+void mu_collect(void) {
+    if (mu_gc()->collecting) {
+        return;
+    }
+
+    mu_gc()->collecting = true;
+
+    // mark roots, freeing any that were destroyed while buffered
+    muint_t count = 0;
+    for (muint_t i = 0; i < mu_gc()->count; i++) {
+        mu_t m = mu_gc()->roots[i];
+
+        if (mgc(m)->gc & MU_GC_DEAD) {
+            mu_gc_free(m);
+        } else if (mu_gc_color(m) == MU_GC_PURPLE && mgc(m)->ref > 0) {
+            mu_gc_markgray(m);
+            mu_gc()->roots[count++] = m;
+        } else {
+            mgc(m)->gc &= ~MU_GC_BUFFERED;
+        }
+    }
+
+    for (muint_t i = 0; i < count; i++) {
+        mu_gc_scan(mu_gc()->roots[i]);
+    }
+
+    for (muint_t i = 0; i < count; i++) {
+        mgc(mu_gc()->roots[i])->gc &= ~MU_GC_BUFFERED;
+        mu_gc_collectwhite(mu_gc()->roots[i]);
+    }
+
+    // releasing garbage may buffer new roots
+    mu_gc()->count = 0;
+    mu_gc_release();
+
+    mu_gc()->collecting = false;
+}
+
+void mu_setcollect(muint_t threshold) {
+    mu_gc()->threshold = threshold ? threshold : (muint_t)-1;
+}
@@ -0,0 +1,556 @@
+/*
+ * Template compiler from Mu bytecode to x86-64
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license in mu.h
+ */
+#define _DEFAULT_SOURCE
+#include "mu.h"
+
+#ifdef MU_JIT
+#include <sys/mman.h>
+#include <string.h>
+
+
+// Compiled code keeps the state pointer in rbx and the interpreter's
+// registers in r12. Values stay in the register array between
+// instructions, so helpers and compiled code share the same view.
+//
+// Each compiled code object is placed in its own mapping, with the
+// size of the mapping stored in front of the code.
+#define MU_JIT_HEADER 16
+
+enum mjitreg {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSI = 6,
+    RDI = 7,
+};
+
+// Helpers implemented by the interpreter, called through
+// a generic function pointer
+typedef void mjitfn_t(void);
+
+extern mu_t mu_jit_inc(mu_t m);
+extern void mu_jit_dec(mu_t m);
+extern void mu_jit_fn(struct mjitstate *s, unsigned d, muint_t i);
+extern void mu_jit_tbl(struct mjitstate *s, unsigned d, muint_t i);
+extern void mu_jit_lookup(struct mjitstate *s, unsigned d, unsigned a,
+                          unsigned b, struct mcache *cache);
+extern void mu_jit_lookdn(struct mjitstate *s, unsigned d, unsigned a,
+                          unsigned b, struct mcache *cache);
+extern void mu_jit_insert(struct mjitstate *s,
+                          unsigned d, unsigned a, unsigned b);
+extern void mu_jit_assign(struct mjitstate *s,
+                          unsigned d, unsigned a, unsigned b);
+extern bool mu_jit_builtin(struct mjitstate *s,
+                           unsigned o, struct mcache *cache);
+extern void mu_jit_arith(struct mjitstate *s, unsigned d, unsigned o,
+                         unsigned a, struct mcache *cache);
+extern void mu_jit_call(struct mjitstate *s, unsigned d, unsigned a);
+extern int mu_jit_ret(struct mjitstate *s, unsigned d, unsigned a);
+extern int mu_jit_tcall(struct mjitstate *s, unsigned d, unsigned a);
+
+
+// Emitting machine code
+struct mjit {
+    mbyte_t *data;
+    muint_t len;
+    muint_t size;
+
+    // native offsets of bytecode instructions, by word
+    muint_t *labels;
+    muint_t count;
+
+    // forward jumps to resolve after emitting
+    muint_t *fixups;
+    muint_t fixlen;
+    muint_t fixsize;
+};
+
+static void mu_jit_reserve(struct mjit *j, muint_t n) {
+    if (j->len + n > j->size) {
+        muint_t nsize = j->size;
+        while (j->len + n > nsize) {
+            nsize *= 2;
+        }
+
+        mbyte_t *ndata = mu_alloc(nsize);
+        memcpy(ndata, j->data, j->len);
+        mu_dealloc(j->data, j->size);
+        j->data = ndata;
+        j->size = nsize;
+    }
+}
+
+static void mu_jit_bytes(struct mjit *j, const mbyte_t *b, muint_t n) {
+    mu_jit_reserve(j, n);
+    memcpy(&j->data[j->len], b, n);
+    j->len += n;
+}
+
+#define mu_jit_emit(j, ...) \
+    mu_jit_bytes(j, (const mbyte_t[]){__VA_ARGS__}, \
+            sizeof((const mbyte_t[]){__VA_ARGS__}))
+
+static void mu_jit_emit32(struct mjit *j, uint32_t x) {
+    mu_jit_emit(j, x, x >> 8, x >> 16, x >> 24);
+}
+
+static void mu_jit_emit64(struct mjit *j, uint64_t x) {
+    mu_jit_emit32(j, (uint32_t)x);
+    mu_jit_emit32(j, (uint32_t)(x >> 32));
+}
+
+static void mu_jit_patch(struct mjit *j, muint_t at, muint_t target) {
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    j->data[at+0] = rel;
+    j->data[at+1] = rel >> 8;
+    j->data[at+2] = rel >> 16;
+    j->data[at+3] = rel >> 24;
+}
+
+// Registers in the interpreter frame, addressed from r12 with a byte
+// displacement when 8*reg < 0x80 and a 32-bit displacement otherwise
+static void mu_jit_regop(struct mjit *j, mbyte_t op,
+                         enum mjitreg r, unsigned reg) {
+    if (8*reg < 0x80) {
+        mu_jit_emit(j, 0x49, op, 0x44 | r << 3, 0x24, 8*reg);
+    } else {
+        mu_jit_emit(j, 0x49, op, 0x84 | r << 3, 0x24);
+        mu_jit_emit32(j, 8*reg);
+    }
+}
+
+static void mu_jit_load(struct mjit *j, enum mjitreg r, unsigned reg) {
+    mu_jit_regop(j, 0x8b, r, reg);
+}
+
+static void mu_jit_store(struct mjit *j, unsigned reg, enum mjitreg r) {
+    mu_jit_regop(j, 0x89, r, reg);
+}
+
+static void mu_jit_imm(struct mjit *j, enum mjitreg r, uint64_t x) {
+    if (x <= 0xffffffff) {
+        mu_jit_emit(j, 0xb8 + r);
+        mu_jit_emit32(j, (uint32_t)x);
+    } else {
+        mu_jit_emit(j, 0x48, 0xb8 + r);
+        mu_jit_emit64(j, x);
+    }
+}
+
+static void mu_jit_callfn(struct mjit *j, mjitfn_t *fn) {
+    mu_jit_emit(j, 0x48, 0xb8);
+    mu_jit_emit64(j, (uint64_t)fn);
+    mu_jit_emit(j, 0xff, 0xd0);
+}
+
+// Calls a helper with the state and up to three operands
+static void mu_jit_helper(struct mjit *j, mjitfn_t *fn,
+                          unsigned x, unsigned y, unsigned z) {
+    mu_jit_emit(j, 0x48, 0x89, 0xdf);
+    mu_jit_imm(j, RSI, x);
+    mu_jit_imm(j, RDX, y);
+    mu_jit_imm(j, RCX, z);
+    mu_jit_callfn(j, fn);
+}
+
+// Jumps with 32-bit offsets, returning the offset to patch
+static muint_t mu_jit_jcc(struct mjit *j, mbyte_t cc) {
+    mu_jit_emit(j, 0x0f, 0x80 | cc, 0, 0, 0, 0);
+    return j->len - 4;
+}
+
+static muint_t mu_jit_jmp(struct mjit *j) {
+    mu_jit_emit(j, 0xe9, 0, 0, 0, 0);
+    return j->len - 4;
+}
+
+static void mu_jit_fixup(struct mjit *j, muint_t at, muint_t target) {
+    if (j->fixlen + 2 > j->fixsize) {
+        muint_t nsize = 2*j->fixsize;
+        muint_t *nfixups = mu_alloc(nsize * sizeof(muint_t));
+        memcpy(nfixups, j->fixups, j->fixlen * sizeof(muint_t));
+        mu_dealloc(j->fixups, j->fixsize * sizeof(muint_t));
+        j->fixups = nfixups;
+        j->fixsize = nsize;
+    }
+
+    j->fixups[j->fixlen++] = at;
+    j->fixups[j->fixlen++] = target;
+}
+
+#define CC_O  0x0
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_P  0xa
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G  0xf
+
+
+// Instruction templates
+static void mu_jit_dup(struct mjit *j, unsigned d, unsigned a) {
+    mu_jit_load(j, RAX, a);
+    mu_jit_store(j, d, RAX);
+
+    // only references need to be counted
+    mu_jit_emit(j, 0xa8, 0x06);
+    muint_t skip = mu_jit_jcc(j, CC_E);
+    mu_jit_emit(j, 0x48, 0x89, 0xc7);
+    mu_jit_callfn(j, (mjitfn_t *)mu_jit_inc);
+    mu_jit_patch(j, skip, j->len);
+}
+
+static void mu_jit_drop(struct mjit *j, unsigned d) {
+    mu_jit_load(j, RDI, d);
+    mu_jit_emit(j, 0x40, 0xf6, 0xc7, 0x06);
+    muint_t skip = mu_jit_jcc(j, CC_E);
+    mu_jit_callfn(j, (mjitfn_t *)mu_jit_dec);
+    mu_jit_patch(j, skip, j->len);
+}
+
+static void mu_jit_constant(struct mjit *j, unsigned d, mu_t m) {
+    if (mu_isref(m)) {
+        mu_jit_emit(j, 0x48, 0xbf);
+        mu_jit_emit64(j, (uint64_t)m);
+        mu_jit_callfn(j, (mjitfn_t *)mu_jit_inc);
+    } else {
+        mu_jit_imm(j, RAX, (uint64_t)m);
+    }
+
+    mu_jit_store(j, d, RAX);
+}
+
+// Stores MU_TRUE in rd if the condition holds and nil otherwise,
+// leaving the flags untouched until the conditional move
+static void mu_jit_setcc(struct mjit *j, unsigned d, mbyte_t cc) {
+    mu_jit_emit(j, 0x48, 0xb9);
+    mu_jit_emit64(j, (uint64_t)MU_TRUE);
+    mu_jit_emit(j, 0xb8, 0, 0, 0, 0);
+    mu_jit_emit(j, 0x48, 0x0f, 0x40 | cc, 0xc1);
+    mu_jit_store(j, d, RAX);
+}
+
+// Calls the interpreter's implementation of an operator, which
+// takes the lookup cache of the operator in r8
+static void mu_jit_arithhelper(struct mjit *j, unsigned d, unsigned o,
+                               unsigned a, struct mcache *cache) {
+    mu_jit_emit(j, 0x49, 0xb8);
+    mu_jit_emit64(j, (uint64_t)cache);
+    mu_jit_helper(j, (mjitfn_t *)mu_jit_arith, d, o, a);
+}
+
+// Numbers are operated on directly if both operands are integers or
+// both are floats, anything else, including results that overflow or
+// would need to be stored as a different kind of number, is left to
+// the interpreter's implementation. The inlined operations are skipped
+// if the operator has been rebound since the code was compiled
+static void mu_jit_arithop(struct mjit *j, unsigned d, unsigned o,
+                           unsigned a, struct mcache *cache) {
+    mop_t op = MU_OP_ADD + o;
+    muint_t slow[5];
+    muint_t nslow = 0;
+    muint_t fast[2];
+    muint_t nfast = 0;
+
+    if (op == MU_OP_IDIV || op == MU_OP_MOD ||
+        op == MU_OP_POW  || op == MU_OP_NEG) {
+        mu_jit_arithhelper(j, d, o, a, cache);
+        return;
+    }
+
+    mu_jit_emit(j, 0x48, 0x89, 0xdf);
+    mu_jit_imm(j, RSI, o);
+    mu_jit_imm(j, RDX, (uint64_t)cache);
+    mu_jit_callfn(j, (mjitfn_t *)mu_jit_builtin);
+    mu_jit_emit(j, 0x84, 0xc0);
+    slow[nslow++] = mu_jit_jcc(j, CC_E);
+
+    if (op == MU_OP_ADD || op == MU_OP_SUB ||
+        op == MU_OP_MUL || op == MU_OP_DIV ||
+        op == MU_OP_LT  || op == MU_OP_LTE ||
+        op == MU_OP_GT  || op == MU_OP_GTE) {
+        mu_jit_load(j, RAX, d);
+        mu_jit_load(j, RCX, a);
+        mu_jit_emit(j, 0x89, 0xc2, 0x83, 0xe2, 0x0f,
+                0x83, 0xfa, MU_NUM_INT | MTNUM);
+        muint_t nint0 = mu_jit_jcc(j, CC_NE);
+        mu_jit_emit(j, 0x89, 0xca, 0x83, 0xe2, 0x0f,
+                0x83, 0xfa, MU_NUM_INT | MTNUM);
+        muint_t nint1 = mu_jit_jcc(j, CC_NE);
+
+        // integers are ordered by their representation, and
+        // operate on their representation with the tag adjusted
+        if (op == MU_OP_LT || op == MU_OP_LTE ||
+            op == MU_OP_GT || op == MU_OP_GTE) {
+            mu_jit_emit(j, 0x48, 0x39, 0xc8);
+            mu_jit_setcc(j, d,
+                    op == MU_OP_LT  ? CC_L  :
+                    op == MU_OP_LTE ? CC_LE :
+                    op == MU_OP_GT  ? CC_G  : CC_GE);
+        } else if (op == MU_OP_DIV) {
+            slow[nslow++] = mu_jit_jmp(j);
+        } else {
+            if (op == MU_OP_ADD) {
+                mu_jit_emit(j, 0x48, 0x83, 0xe8, MU_NUM_INT | MTNUM);
+                mu_jit_emit(j, 0x48, 0x01, 0xc8);
+            } else if (op == MU_OP_SUB) {
+                mu_jit_emit(j, 0x48, 0x29, 0xc8);
+            } else {
+                mu_jit_emit(j, 0x48, 0xc1, 0xf8, 0x04);
+                mu_jit_emit(j, 0x48, 0x83, 0xe9, MU_NUM_INT | MTNUM);
+                mu_jit_emit(j, 0x48, 0x0f, 0xaf, 0xc1);
+            }
+
+            slow[nslow++] = mu_jit_jcc(j, CC_O);
+            mu_jit_emit(j, 0x48, 0x83, 0xc8, MU_NUM_INT | MTNUM);
+            mu_jit_store(j, d, RAX);
+        }
+
+        fast[nfast++] = mu_jit_jmp(j);
+        mu_jit_patch(j, nint0, j->len);
+        mu_jit_patch(j, nint1, j->len);
+
+        mu_jit_emit(j, 0x89, 0xc2, 0x83, 0xe2, 0x0f, 0x83, 0xfa, MTNUM);
+        slow[nslow++] = mu_jit_jcc(j, CC_NE);
+        mu_jit_emit(j, 0x89, 0xca, 0x83, 0xe2, 0x0f, 0x83, 0xfa, MTNUM);
+        slow[nslow++] = mu_jit_jcc(j, CC_NE);
+
+        mu_jit_emit(j, 0x48, 0x83, 0xe0, 0xf0);
+        mu_jit_emit(j, 0x48, 0x83, 0xe1, 0xf0);
+        mu_jit_emit(j, 0x66, 0x48, 0x0f, 0x6e, 0xc0);
+        mu_jit_emit(j, 0x66, 0x48, 0x0f, 0x6e, 0xc9);
+
+        if (op == MU_OP_LT || op == MU_OP_LTE ||
+            op == MU_OP_GT || op == MU_OP_GTE) {
+            mu_jit_emit(j, 0x66, 0x0f, 0x2e, 0xc1);
+            mu_jit_setcc(j, d,
+                    op == MU_OP_LT  ? CC_B  :
+                    op == MU_OP_LTE ? CC_BE :
+                    op == MU_OP_GT  ? CC_A  : CC_AE);
+        } else {
+            mu_jit_emit(j, 0xf2, 0x0f,
+                    op == MU_OP_ADD ? 0x58 :
+                    op == MU_OP_SUB ? 0x5c :
+                    op == MU_OP_MUL ? 0x59 : 0x5e, 0xc1);
+
+            // results are truncated, and any that are integral or NaN
+            // are left to the interpreter to store as integers or report
+            mu_jit_emit(j, 0x66, 0x48, 0x0f, 0x7e, 0xc0);
+            mu_jit_emit(j, 0x48, 0x83, 0xe0, 0xf0);
+            mu_jit_emit(j, 0x66, 0x48, 0x0f, 0x6e, 0xc0);
+            mu_jit_emit(j, 0xf2, 0x48, 0x0f, 0x2c, 0xd0);
+            mu_jit_emit(j, 0xf2, 0x48, 0x0f, 0x2a, 0xca);
+            mu_jit_emit(j, 0x66, 0x0f, 0x2e, 0xc1);
+            slow[nslow++] = mu_jit_jcc(j, CC_E);
+            mu_jit_emit(j, 0x48, 0x83, 0xc8, MTNUM);
+            mu_jit_store(j, d, RAX);
+        }
+    } else if (op == MU_OP_EQ || op == MU_OP_NEQ) {
+        mu_jit_load(j, RAX, d);
+        mu_jit_load(j, RCX, a);
+        mu_jit_emit(j, 0x89, 0xc2, 0x09, 0xca, 0xf6, 0xc2, 0x06);
+        slow[nslow++] = mu_jit_jcc(j, CC_NE);
+        mu_jit_emit(j, 0x48, 0x39, 0xc8);
+        mu_jit_setcc(j, d, op == MU_OP_EQ ? CC_E : CC_NE);
+    } else {
+        mu_jit_load(j, RAX, d);
+        mu_jit_emit(j, 0xa8, 0x06);
+        slow[nslow++] = mu_jit_jcc(j, CC_NE);
+        mu_jit_emit(j, 0x48, 0x85, 0xc0);
+        mu_jit_setcc(j, d, CC_E);
+    }
+
+    fast[nfast++] = mu_jit_jmp(j);
+    for (muint_t i = 0; i < nslow; i++) {
+        mu_jit_patch(j, slow[i], j->len);
+    }
+
+    mu_jit_arithhelper(j, d, o, a, cache);
+    for (muint_t i = 0; i < nfast; i++) {
+        mu_jit_patch(j, fast[i], j->len);
+    }
+}
+
+
+// Translates bytecode into j, returning false if
+// the bytecode can not be compiled
+static bool mu_jit_translate(struct mjit *j, mu_t c) {
+    const uint16_t *bcode = mu_code_getbcode(c);
+    const mu_t *imms = mu_code_getimms(c);
+    struct mcache *caches = mu_code_getcaches(c);
+    muint_t cmask = mu_code_getcacheslen(c) - 1;
+    muint_t count = j->count;
+
+    // prologue
+    mu_jit_emit(j, 0x53, 0x41, 0x54, 0x41, 0x55);
+    mu_jit_emit(j, 0x48, 0x89, 0xfb);
+    mu_jit_emit(j, 0x4c, 0x8b, 0x23);
+
+    muint_t pc = 0;
+    while (pc < count) {
+        j->labels[pc] = j->len;
+        mop_t op;
+        mint_t d, a, b;
+        pc += mu_decode(&bcode[pc], &op, &d, &a, &b);
+        if (pc > count) {
+            return false;
+        }
+
+        switch (op) {
+            case MU_OP_IMM:
+            case MU_OP_FN:
+            case MU_OP_TBL: {
+                muint_t i = a;
+                if (op == MU_OP_IMM) {
+                    mu_jit_constant(j, d, imms[i]);
+                } else {
+                    mu_jit_helper(j, op == MU_OP_FN ?
+                            (mjitfn_t *)mu_jit_fn : (mjitfn_t *)mu_jit_tbl, d, i, 0);
+                }
+            } break;
+
+            case MU_OP_MOVE:
+                mu_jit_load(j, RAX, a);
+                mu_jit_store(j, d, RAX);
+                break;
+
+            case MU_OP_DUP:
+                mu_jit_dup(j, d, a);
+                break;
+
+            case MU_OP_DROP:
+                mu_jit_drop(j, d);
+                break;
+
+            case MU_OP_LOOKUP:
+            case MU_OP_LOOKDN:
+                mu_jit_emit(j, 0x49, 0xb8);
+                mu_jit_emit64(j, (uint64_t)&caches[pc & cmask]);
+                mu_jit_helper(j, op == MU_OP_LOOKUP ?
+                        (mjitfn_t *)mu_jit_lookup : (mjitfn_t *)mu_jit_lookdn,
+                        d, a, b);
+                break;
+
+            case MU_OP_INSERT:
+            case MU_OP_ASSIGN:
+                mu_jit_helper(j, op == MU_OP_INSERT ?
+                        (mjitfn_t *)mu_jit_insert : (mjitfn_t *)mu_jit_assign,
+                        d, a, b);
+                break;
+
+            case MU_OP_JUMP:
+            case MU_OP_JFALSE: {
+                mint_t target = (mint_t)pc + a;
+                if (target < 0 || target >= (mint_t)count) {
+                    return false;
+                }
+
+                if (op == MU_OP_JUMP) {
+                    mu_jit_fixup(j, mu_jit_jmp(j), target);
+                } else {
+                    mu_jit_load(j, RAX, d);
+                    mu_jit_emit(j, 0x48, 0x85, 0xc0);
+                    mu_jit_fixup(j, mu_jit_jcc(j, CC_E), target);
+                }
+            } break;
+
+            case MU_OP_CALL:
+                mu_jit_helper(j, (mjitfn_t *)mu_jit_call, d, a, 0);
+                break;
+
+            case MU_OP_RET:
+            case MU_OP_TCALL:
+                mu_jit_helper(j, op == MU_OP_RET ?
+                        (mjitfn_t *)mu_jit_ret : (mjitfn_t *)mu_jit_tcall,
+                        d, a, 0);
+                mu_jit_fixup(j, mu_jit_jmp(j), count);
+                break;
+
+            case MU_OP_WIDE:
+                return false;
+
+            default:
+                mu_jit_arithop(j, d, op - MU_OP_ADD, a, &caches[pc & cmask]);
+                break;
+        }
+    }
+
+    // epilogue
+    j->labels[count] = j->len;
+    mu_jit_emit(j, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+
+    // resolve jumps, any word inside an instruction has no label
+    for (muint_t i = 0; i < j->fixlen; i += 2) {
+        muint_t target = j->labels[j->fixups[i+1]];
+        if (target == (muint_t)-1) {
+            return false;
+        }
+
+        mu_jit_patch(j, j->fixups[i], target);
+    }
+
+    return true;
+}
+
+// Maps translated code as executable
+static mjit_t *mu_jit_map(struct mjit *j) {
+    muint_t size = MU_JIT_HEADER + j->len;
+    mbyte_t *mem = mmap(0, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return 0;
+    }
+
+    *(muint_t *)mem = size;
+    memcpy(mem + MU_JIT_HEADER, j->data, j->len);
+
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) < 0) {
+        munmap(mem, size);
+        return 0;
+    }
+
+    return (mjit_t *)(muint_t)(mem + MU_JIT_HEADER);
+}
+
+
+// Compilation of code objects, failures are left to the interpreter
+mjit_t *mu_jit_compile(mu_t c) {
+    struct mcode *code = mu_buf_getdata(c);
+    struct mjit j = {0};
+    j.count = mu_code_getbcodelen(c) / 2;
+    j.size = MU_MINALLOC;
+    j.data = mu_alloc(j.size);
+    j.labels = mu_alloc((j.count+1) * sizeof(muint_t));
+    memset(j.labels, 0xff, (j.count+1) * sizeof(muint_t));
+    j.fixsize = MU_MINALLOC / sizeof(muint_t);
+    j.fixups = mu_alloc(j.fixsize * sizeof(muint_t));
+
+    if (mu_jit_translate(&j, c)) {
+        code->jit = (void (*)(void))mu_jit_map(&j);
+    }
+
+    mu_dealloc(j.data, j.size);
+    mu_dealloc(j.labels, (j.count+1) * sizeof(muint_t));
+    mu_dealloc(j.fixups, j.fixsize * sizeof(muint_t));
+    return (mjit_t *)code->jit;
+}
+
+void mu_jit_destroy(mu_t c) {
+    struct mcode *code = mu_buf_getdata(c);
+    if (code->jit) {
+        mbyte_t *mem = (mbyte_t *)(muint_t)code->jit - MU_JIT_HEADER;
+        munmap(mem, *(muint_t *)mem);
+    }
+}
+
+#endif
@@ -22,8 +22,104 @@ extern void free(void *);
 #define mu_sys_dealloc(m, size) free(m)
 #endif
 
+// Small allocations are served from per size-class free lists
+// if MU_SLAB is defined. Since every deallocation passes the size
+// of the allocation, the size-class can be found without a header.
+//
+// Slabs are never returned to the system, but blocks are reused
+// by later allocations of the same size-class. Each state owns its
+// free lists, and destroyed states hand their blocks to a shared pool.
+#ifdef MU_SLAB
+static void *mu_slab_pool[MU_SLAB_MAX / sizeof(muint_t)];
+
+mu_inline muint_t mu_slab_class(muint_t size) {
+    return (size-1) / sizeof(muint_t);
+}
+
+static void *mu_slab_refill(muint_t class) {
+    void **list = &mu_state->slabs[class];
+
+    mu_state_lock();
+    *list = mu_slab_pool[class];
+    mu_slab_pool[class] = 0;
+    mu_state_unlock();
+
+    if (*list) {
+        void *m = *list;
+        *list = *(void **)m;
+        return m;
+    }
+
+    muint_t size = (class+1) * sizeof(muint_t);
+    muint_t count = MU_SLAB_CHUNK / size;
+    mbyte_t *chunk = mu_sys_alloc(count * size);
+    if (chunk == 0) {
+        return 0;
+    }
+
+    // thread all but the first block onto the free list
+    for (muint_t i = 1; i < count; i++) {
+        *(void **)&chunk[i*size] = (i+1 < count) ? &chunk[(i+1)*size] : 0;
+    }
+
+    *list = (count > 1) ? &chunk[size] : 0;
+    return chunk;
+}
+
+mu_inline void *mu_slab_alloc(muint_t size) {
+    if (size > MU_SLAB_MAX) {
+        return mu_sys_alloc(size);
+    }
+
+    muint_t class = mu_slab_class(size);
+    void *m = mu_state->slabs[class];
+    if (!m) {
+        return mu_slab_refill(class);
+    }
+
+    mu_state->slabs[class] = *(void **)m;
+    return m;
+}
+
+mu_inline void mu_slab_dealloc(void *m, muint_t size) {
+    if (size > MU_SLAB_MAX) {
+        mu_sys_dealloc(m, size);
+        return;
+    }
+
+    if (m) {
+        muint_t class = mu_slab_class(size);
+        *(void **)m = mu_state->slabs[class];
+        mu_state->slabs[class] = m;
+    }
+}
+
+static void mu_slab_release(struct mstate *s) {
+    mu_state_lock();
+    for (muint_t class = 0; class < MU_SLAB_MAX / sizeof(muint_t); class++) {
+        void *m = s->slabs[class];
+        if (!m) {
+            continue;
+        }
+
+        while (*(void **)m) {
+            m = *(void **)m;
+        }
+
+        *(void **)m = mu_slab_pool[class];
+        mu_slab_pool[class] = s->slabs[class];
+        s->slabs[class] = 0;
+    }
+    mu_state_unlock();
+}
+#else
+#define mu_slab_alloc(size) mu_sys_alloc(size)
+#define mu_slab_dealloc(m, size) mu_sys_dealloc(m, size)
+#define mu_slab_release(s) ((void)(s))
+#endif
+
 // Manual memory management
-// Currently just a wrapper over malloc and free
+// Wraps the system allocator with the slab allocator if enabled
 // Garuntees 8 byte alignment
 void *mu_alloc(muint_t size) {
     if (size == 0) {
@@ -34,7 +130,7 @@ void *mu_alloc(muint_t size) {
     size += sizeof(muint_t);
 #endif
 
-    void *m = mu_sys_alloc(size);
+    void *m = mu_slab_alloc(size);
 
     if (m == 0) {
         const char *message = "out of memory";
@@ -55,14 +151,98 @@ void *mu_alloc(muint_t size) {
 void mu_dealloc(void *m, muint_t size) {
 #ifdef MU_DEBUG
     mu_assert(!m || *(muint_t*)&((char*)m)[size] == size);
+    size += sizeof(muint_t);
 #endif
 
-    mu_sys_dealloc(m, size);
+    mu_slab_dealloc(m, size);
+}
+
+
+// Interpreter states
+//
+// The lock is a spinlock owned by a thread, identified by the
+// address of a thread-local variable, and may be taken recursively.
+static struct mstate mu_state_default = {
+    .gc.threshold = MU_GC_THRESHOLD ? MU_GC_THRESHOLD : (muint_t)-1,
+};
+
+mu_thread struct mstate *mu_state = &mu_state_default;
+
+static mu_thread char mu_state_self;
+static char *mu_state_owner = 0;
+static muint_t mu_state_depth = 0;
+
+void mu_state_lock(void) {
+    if (mu_atomic_load(&mu_state_owner) == &mu_state_self) {
+        mu_state_depth += 1;
+        return;
+    }
+
+    char *expected = 0;
+    while (!mu_atomic_cas(&mu_state_owner, &expected, &mu_state_self)) {
+        expected = 0;
+    }
+
+    mu_state_depth = 1;
+}
+
+void mu_state_unlock(void) {
+    mu_state_depth -= 1;
+    if (mu_state_depth == 0) {
+        mu_atomic_store(&mu_state_owner, (char *)0);
+    }
+}
+
+struct mstate *mu_state_create(void) {
+    struct mstate *s = mu_sys_alloc(sizeof(struct mstate));
+    if (s == 0) {
+        const char *message = "out of memory";
+        mu_error(message, strlen(message));
+    }
+
+    memset(s, 0, sizeof(struct mstate));
+    s->gc.threshold = mu_state_default.gc.threshold;
+    return s;
+}
+
+void mu_state_destroy(struct mstate *s) {
+    extern void mu_str_release(struct mstrset *set);
+    struct mstate *prev = mu_setstate(s);
+
+    mu_dec(s->imports);
+    s->imports = 0;
+    mu_collect();
+
+    mu_dealloc(s->gc.roots, s->gc.rootsize * sizeof(mu_t));
+    mu_dealloc(s->gc.stack, s->gc.stacksize * sizeof(mu_t));
+    mu_dealloc(s->gc.white, s->gc.whitesize * sizeof(mu_t));
+    mu_str_release(&s->strs);
+    mu_slab_release(s);
+
+    if (s == &mu_state_default) {
+        muint_t threshold = s->gc.threshold;
+        memset(s, 0, sizeof(struct mstate));
+        s->gc.threshold = threshold;
+        mu_setstate(prev);
+    } else {
+        mu_setstate(prev == s ? &mu_state_default : prev);
+        mu_sys_dealloc(s, sizeof(struct mstate));
+    }
+}
+
+struct mstate *mu_setstate(struct mstate *s) {
+    struct mstate *prev = mu_state;
+    mu_state = s;
+    return prev;
 }
 
 
 // System operations
 mu_noreturn mu_error(const char *s, muint_t n) {
+    if (mu_state->error) {
+        mu_state->error(s, n);
+    }
+
     mu_sys_error(s, n);
     mu_unreachable;
 }
@@ -136,12 +316,11 @@ static mcnt_t mu_import_bfn(mu_t *frame) {
     mu_t name = frame[0];
     mu_checkargs(mu_isstr(name), MU_IMPORT_KEY, 0x1, frame);
 
-    static mu_t import_history = 0;
-    if (!import_history) {
-        import_history = mu_tbl_create(0);
+    if (!mu_state->imports) {
+        mu_state->imports = mu_tbl_create(0);
     }
 
-    mu_t module = mu_tbl_lookup(import_history, mu_inc(name));
+    mu_t module = mu_tbl_lookup(mu_state->imports, mu_inc(name));
     if (module) {
         mu_dec(name);
         frame[0] = module;
@@ -149,7 +328,7 @@ static mcnt_t mu_import_bfn(mu_t *frame) {
     }
 
     module = mu_sys_import(mu_inc(name));
-    mu_tbl_insert(import_history, name, mu_inc(module));
+    mu_tbl_insert(mu_state->imports, name, mu_inc(module));
     frame[0] = module;
     return 1;
 }
@@ -238,9 +417,10 @@ MU_DEF_STR(mu_not_key_def, "!")
 MU_DEF_BFN(mu_not_def, 0x1, mu_not_bfn)
 
 static mcnt_t mu_eq_bfn(mu_t *frame) {
+    bool eq = mu_str_equals(frame[0], frame[1]);
     mu_dec(frame[0]);
     mu_dec(frame[1]);
-    frame[0] = (frame[0] == frame[1]) ? MU_TRUE : MU_FALSE;
+    frame[0] = eq ? MU_TRUE : MU_FALSE;
     return 1;
 }
 
@@ -248,9 +428,10 @@ MU_DEF_STR(mu_eq_key_def, "==")
 MU_DEF_BFN(mu_eq_def,  0x2, mu_eq_bfn)
 
 static mcnt_t mu_neq_bfn(mu_t *frame) {
+    bool eq = mu_str_equals(frame[0], frame[1]);
     mu_dec(frame[0]);
     mu_dec(frame[1]);
-    frame[0] = (frame[0] != frame[1]) ? MU_TRUE : MU_FALSE;
+    frame[0] = !eq ? MU_TRUE : MU_FALSE;
     return 1;
 }
 
@@ -753,28 +934,210 @@ MU_DEF_STR(mu_pairs_key_def, "pairs")
 MU_DEF_BFN(mu_pairs_def, 0x1, mu_pairs_bfn)
 
 
-// Functions over iterators
-static mcnt_t mu_map_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t f = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    mu_t i = mu_tbl_lookup(scope, mu_num_fromuint(1));
+// Fused iterator pipelines
+//
+// Map, filter, take and drop are stages of a single iterator, stored
+// in a flat buffer so one call drives every stage. An iterator passed
+// to a stage that is only referenced by the call, such as another
+// pipeline or a range, is fused into the new stage instead of being
+// wrapped by it.
+#define MU_PIPE_STAGES 8
+
+enum mpipekind {
+    MU_PIPE_MAP,
+    MU_PIPE_FILTER,
+    MU_PIPE_TAKE,
+    MU_PIPE_TAKEWHILE,
+    MU_PIPE_DROP,
+    MU_PIPE_DROPWHILE,
+};
 
-    while (mu_fn_next(i, 0xf, frame)) {
-        mu_fn_fcall(f, 0xff, frame);
+struct mpipe {
+    mu_t src;       // source iterator, or the state of a fused range
+    bool done;      // set once a take stage has ended
+    muint_t count;  // number of stages
+
+    struct mstage {
+        muint_t kind;
+        mu_t m;     // function, or remaining count
+    } stages[MU_PIPE_STAGES];
+};
+
+static mcnt_t mu_range_step_bfn(mu_t scope, mu_t *frame);
+
+static bool mu_isstep(mu_t m, msbfn_t *sbfn) {
+    struct mfn *f = (struct mfn *)((muint_t)m - MTFN);
+    return mu_isfn(m) && (f->flags & MU_FN_BUILTIN) &&
+            (f->flags & MU_FN_SCOPED) && f->fn.sbfn == sbfn;
+}
+
+static void mu_pipe_destroy(mu_t b) {
+    struct mpipe *p = mu_buf_getdata(b);
+    mu_dec(p->src);
+
+    for (muint_t i = 0; i < p->count; i++) {
+        mu_dec(p->stages[i].m);
+    }
+}
+
+static void mu_pipe_gcvisit(mu_t b, void (*visit)(mu_t *)) {
+    struct mpipe *p = mu_buf_getdata(b);
+    visit(&p->src);
+
+    for (muint_t i = 0; i < p->count; i++) {
+        visit(&p->stages[i].m);
+    }
+}
+
+// Checks for the end of iteration, releasing the frame if so
+static bool mu_pipe_isend(mcnt_t c, mu_t *frame) {
+    if (c == 0xf) {
         mu_t m = mu_tbl_lookup(frame[0], mu_num_fromuint(0));
         if (m) {
             mu_dec(m);
-            mu_dec(f);
-            mu_dec(i);
-            return 0xf;
+            return false;
         }
-        mu_dec(frame[0]);
+    } else if (c != 0 && frame[0]) {
+        return false;
     }
 
-    mu_dec(f);
-    mu_dec(i);
-    return 0;
+    mu_frameconvert(c, 0, frame);
+    return true;
+}
+
+// Tests an element against a predicate, releasing the element if false
+static bool mu_pipe_test(mu_t f, mcnt_t c, mu_t *frame) {
+    mu_t elem[MU_FRAME];
+    for (muint_t i = 0; i < mu_framecount(c); i++) {
+        elem[i] = mu_inc(frame[i]);
+    }
+
+    mu_fn_fcall(f, (c << 4) | 1, frame);
+    bool pass = frame[0];
+    mu_dec(frame[0]);
+    memcpy(frame, elem, mu_framecount(c)*sizeof(mu_t));
+
+    if (!pass) {
+        mu_frameconvert(c, 0, frame);
+    }
+
+    return pass;
+}
+
+static mcnt_t mu_pipe_step_bfn(mu_t b, mu_t *frame) {
+    struct mpipe *p = mu_buf_getdata(b);
+
+next:
+    if (p->done) {
+        return 0;
+    }
+
+    mcnt_t c;
+    if (mu_isfn(p->src)) {
+        c = mu_fn_tcall(mu_inc(p->src), 0x0, frame);
+    } else {
+        c = mu_range_step_bfn(p->src, frame);
+    }
+
+    if (mu_pipe_isend(c, frame)) {
+        return 0;
+    }
+
+    for (muint_t i = 0; i < p->count; i++) {
+        struct mstage *s = &p->stages[i];
+
+        switch (s->kind) {
+            case MU_PIPE_MAP:
+                c = mu_fn_tcall(mu_inc(s->m), c, frame);
+                if (mu_pipe_isend(c, frame)) {
+                    goto next;
+                }
+                break;
+
+            case MU_PIPE_FILTER:
+                if (!mu_pipe_test(s->m, c, frame)) {
+                    goto next;
+                }
+                break;
+
+            case MU_PIPE_TAKE:
+                s->m = mu_num_sub(s->m, mu_num_fromuint(1));
+                if (mu_num_cmp(s->m, mu_num_fromuint(0)) <= 0) {
+                    p->done = true;
+                }
+                break;
+
+            case MU_PIPE_TAKEWHILE:
+                if (!mu_pipe_test(s->m, c, frame)) {
+                    p->done = true;
+                    return 0;
+                }
+                break;
+
+            case MU_PIPE_DROP:
+                if (mu_num_cmp(s->m, mu_num_fromuint(0)) > 0) {
+                    s->m = mu_num_sub(s->m, mu_num_fromuint(1));
+                    mu_frameconvert(c, 0, frame);
+                    goto next;
+                }
+                break;
+
+            case MU_PIPE_DROPWHILE:
+                if (s->m) {
+                    if (mu_pipe_test(s->m, c, frame)) {
+                        goto next;
+                    }
+
+                    mu_dec(s->m);
+                    s->m = 0;
+                }
+                break;
+        }
+    }
+
+    return c;
+}
+
+// Adds a stage to an iterator, consuming both
+static mu_t mu_pipe_stage(mu_t iter, enum mpipekind kind, mu_t m) {
+    struct mpipe *p = 0;
+
+    // pipelines that are not shared are extended in place
+    if (mu_getref(iter) == 1 && mu_isstep(iter, mu_pipe_step_bfn)) {
+        mu_t b = mu_fn_getclosure(iter);
+        p = mu_buf_getdata(b);
+        mu_dec(b);
+    }
+
+    if (!p || p->count == MU_PIPE_STAGES) {
+        mu_t b = mu_buf_createvisit(sizeof(struct mpipe),
+                mu_pipe_destroy, mu_pipe_gcvisit);
+        p = mu_buf_getdata(b);
+        p->done = false;
+        p->count = 0;
+
+        if (mu_getref(iter) == 1 && mu_isstep(iter, mu_range_step_bfn)) {
+            p->src = mu_fn_getclosure(iter);
+            mu_dec(iter);
+        } else {
+            p->src = iter;
+        }
+
+        iter = mu_fn_fromsbfn(0x0, mu_pipe_step_bfn, b);
+    }
+
+    if (kind == MU_PIPE_TAKE && mu_num_cmp(m, mu_num_fromuint(0)) <= 0) {
+        p->done = true;
+    }
+
+    p->stages[p->count].kind = kind;
+    p->stages[p->count].m = m;
+    p->count += 1;
+    return iter;
 }
 
+
+// Functions over iterators
 static mcnt_t mu_map_bfn(mu_t *frame) {
     mu_t f    = frame[0];
     mu_t iter = frame[1];
@@ -785,36 +1148,13 @@ static mcnt_t mu_map_bfn(mu_t *frame) {
     mu_fn_fcall(MU_ITER, 0x11, frame);
     iter = frame[0];
 
-    frame[0] = mu_fn_fromsbfn(0, mu_map_step_bfn,
-            mu_tbl_fromlist((mu_t[]){f, iter}, 2));
+    frame[0] = mu_pipe_stage(iter, MU_PIPE_MAP, f);
     return 1;
 }
 
 MU_DEF_STR(mu_map_key_def, "map")
 MU_DEF_BFN(mu_map_def, 0x2, mu_map_bfn)
 
-static mcnt_t mu_filter_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t f = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    mu_t i = mu_tbl_lookup(scope, mu_num_fromuint(1));
-
-    while (mu_fn_next(i, 0xf, frame)) {
-        mu_t m = mu_inc(frame[0]);
-        mu_fn_fcall(f, 0xf1, frame);
-        if (frame[0]) {
-            mu_dec(frame[0]);
-            frame[0] = m;
-            mu_dec(f);
-            mu_dec(i);
-            return 0xf;
-        }
-        mu_dec(m);
-    }
-
-    mu_dec(f);
-    mu_dec(i);
-    return 0;
-}
-
 static mcnt_t mu_filter_bfn(mu_t *frame) {
     mu_t f    = frame[0];
     mu_t iter = frame[1];
@@ -824,8 +1164,7 @@ static mcnt_t mu_filter_bfn(mu_t *frame) {
     mu_fn_fcall(MU_ITER, 0x11, frame);
     iter = frame[0];
 
-    frame[0] = mu_fn_fromsbfn(0, mu_filter_step_bfn,
-            mu_tbl_fromlist((mu_t[]){f, iter}, 2));
+    frame[0] = mu_pipe_stage(iter, MU_PIPE_FILTER, f);
     return 1;
 }
 
@@ -963,15 +1302,27 @@ static mcnt_t mu_range_bfn(mu_t *frame) {
 MU_DEF_STR(mu_range_key_def, "range")
 MU_DEF_BFN(mu_range_def, 0x3, mu_range_bfn)
 
-static mcnt_t mu_repeat_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t i = mu_tbl_lookup(scope, mu_num_fromuint(1));
-    if (mu_num_cmp(i, mu_num_fromuint(0)) <= 0) {
+struct mrepeat {
+    mu_t m;
+    mu_t count;
+};
+
+static void mu_repeat_destroy(mu_t b) {
+    mu_dec(((struct mrepeat *)mu_buf_getdata(b))->m);
+}
+
+static void mu_repeat_gcvisit(mu_t b, void (*visit)(mu_t *)) {
+    visit(&((struct mrepeat *)mu_buf_getdata(b))->m);
+}
+
+static mcnt_t mu_repeat_step_bfn(mu_t b, mu_t *frame) {
+    struct mrepeat *r = mu_buf_getdata(b);
+    if (mu_num_cmp(r->count, mu_num_fromuint(0)) <= 0) {
         return 0;
     }
 
-    frame[0] = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    mu_tbl_insert(scope, mu_num_fromuint(1),
-            mu_num_sub(i, mu_num_fromuint(1)));
+    frame[0] = mu_inc(r->m);
+    r->count = mu_num_sub(r->count, mu_num_fromuint(1));
     return 1;
 }
 
@@ -980,8 +1331,13 @@ static mcnt_t mu_repeat_bfn(mu_t *frame) {
     mu_t count = frame[1] ? frame[1] : MU_INF;
     mu_checkargs(mu_isnum(count), MU_REPEAT_KEY, 0x2, frame);
 
-    frame[0] = mu_fn_fromsbfn(0x0, mu_repeat_step_bfn,
-            mu_tbl_fromlist((mu_t[]){m, count}, 2));
+    mu_t b = mu_buf_createvisit(sizeof(struct mrepeat),
+            mu_repeat_destroy, mu_repeat_gcvisit);
+    struct mrepeat *r = mu_buf_getdata(b);
+    r->m = m;
+    r->count = count;
+
+    frame[0] = mu_fn_fromsbfn(0x0, mu_repeat_step_bfn, b);
     return 1;
 }
 
@@ -990,34 +1346,60 @@ MU_DEF_BFN(mu_repeat_def, 0x2, mu_repeat_bfn)
 
 
 // Iterator manipulation
-static mcnt_t mu_zip_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t iters = mu_tbl_lookup(scope, mu_num_fromuint(1));
+// State of zip and chain, an iterator over iterables
+// and the iterators taken from it
+struct mzip {
+    mu_t src;
+    mu_t iter;
+};
+
+static void mu_zip_destroy(mu_t b) {
+    struct mzip *z = mu_buf_getdata(b);
+    mu_dec(z->src);
+    mu_dec(z->iter);
+}
 
-    if (!iters) {
-        mu_t iteriter = mu_tbl_lookup(scope, mu_num_fromuint(0));
-        iters = mu_tbl_create(0);
+static void mu_zip_gcvisit(mu_t b, void (*visit)(mu_t *)) {
+    struct mzip *z = mu_buf_getdata(b);
+    visit(&z->src);
+    visit(&z->iter);
+}
+
+static mu_t mu_zip_create(mu_t src) {
+    mu_t b = mu_buf_createvisit(sizeof(struct mzip),
+            mu_zip_destroy, mu_zip_gcvisit);
+    struct mzip *z = mu_buf_getdata(b);
+    z->src = src;
+    z->iter = 0;
+    return b;
+}
+
+static mcnt_t mu_zip_step_bfn(mu_t b, mu_t *frame) {
+    struct mzip *z = mu_buf_getdata(b);
 
-        while (mu_fn_next(iteriter, 0x1, frame)) {
+    if (!z->iter) {
+        mu_t iters = mu_tbl_create(0);
+
+        while (mu_fn_next(z->src, 0x1, frame)) {
             mu_tbl_insert(iters, mu_num_fromuint(mu_tbl_getlen(iters)),
                     mu_fn_call(MU_ITER, 0x11, frame[0]));
         }
 
-        mu_dec(iteriter);
-        mu_tbl_insert(scope, mu_num_fromuint(1), mu_inc(iters));
+        mu_dec(z->src);
+        z->src = 0;
+        z->iter = iters;
     }
 
-    mu_t acc = mu_tbl_create(mu_tbl_getlen(iters));
+    mu_t acc = mu_tbl_create(mu_tbl_getlen(z->iter));
     mu_t iter;
 
-    for (muint_t i = 0; mu_tbl_next(iters, &i, 0, &iter);) {
+    for (muint_t i = 0; mu_tbl_peek(z->iter, &i, 0, &iter);) {
         mu_fn_fcall(iter, 0x0f, frame);
-        mu_dec(iter);
 
         mu_t m = mu_tbl_lookup(frame[0], mu_num_fromuint(0));
         if (!m) {
             mu_dec(acc);
             mu_dec(frame[0]);
-            mu_dec(iters);
             return 0;
         }
         mu_dec(m);
@@ -1025,7 +1407,6 @@ static mcnt_t mu_zip_step_bfn(mu_t scope, mu_t *frame) {
         acc = mu_tbl_concat(acc, frame[0], 0);
     }
 
-    mu_dec(iters);
     frame[0] = acc;
     return 0xf;
 }
@@ -1042,19 +1423,18 @@ static mcnt_t mu_zip_bfn(mu_t *frame) {
     }
 
     frame[0] = mu_fn_fromsbfn(0x0, mu_zip_step_bfn,
-            mu_tbl_fromlist((mu_t[]){mu_fn_call(MU_ITER, 0x11, iter)}, 1));
+            mu_zip_create(mu_fn_call(MU_ITER, 0x11, iter)));
     return 1;
 }
 
 MU_DEF_STR(mu_zip_key_def, "zip")
 MU_DEF_BFN(mu_zip_def, 0xf, mu_zip_bfn)
 
-static mcnt_t mu_chain_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t iter = mu_tbl_lookup(scope, mu_num_fromuint(1));
+static mcnt_t mu_chain_step_bfn(mu_t b, mu_t *frame) {
+    struct mzip *z = mu_buf_getdata(b);
 
-    if (iter) {
-        mu_fn_fcall(iter, 0x0f, frame);
-        mu_dec(iter);
+    if (z->iter) {
+        mu_fn_fcall(z->iter, 0x0f, frame);
 
         mu_t m = mu_tbl_lookup(frame[0], mu_num_fromuint(0));
         if (m) {
@@ -1064,13 +1444,14 @@ static mcnt_t mu_chain_step_bfn(mu_t scope, mu_t *frame) {
         mu_dec(frame[0]);
     }
 
-    mu_t iters = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    mu_fn_fcall(iters, 0x01, frame);
-    mu_dec(iters);
+    mu_fn_fcall(z->src, 0x01, frame);
     if (frame[0]) {
-        mu_tbl_insert(scope, mu_num_fromuint(1),
-                mu_fn_call(MU_ITER, 0x11, frame[0]));
-        return mu_chain_step_bfn(scope, frame);
+        // the old iterator is kept until replaced, since the cycle
+        // collector may visit the state while the new one is created
+        mu_t iter = mu_fn_call(MU_ITER, 0x11, frame[0]);
+        mu_dec(z->iter);
+        z->iter = iter;
+        return mu_chain_step_bfn(b, frame);
     }
 
     return 0;
@@ -1088,50 +1469,13 @@ static mcnt_t mu_chain_bfn(mu_t *frame) {
     }
 
     frame[0] = mu_fn_fromsbfn(0x0, mu_chain_step_bfn,
-            mu_tbl_fromlist((mu_t[]){mu_fn_call(MU_ITER, 0x11, iter)}, 1));
+            mu_zip_create(mu_fn_call(MU_ITER, 0x11, iter)));
     return 1;
 }
 
 MU_DEF_STR(mu_chain_key_def, "chain")
 MU_DEF_BFN(mu_chain_def, 0xf, mu_chain_bfn)
 
-static mcnt_t mu_take_count_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t i = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    if (mu_num_cmp(i, mu_num_fromuint(0)) <= 0) {
-        return 0;
-    }
-
-    mu_tbl_insert(scope, mu_num_fromuint(0),
-            mu_num_sub(i, mu_num_fromuint(1)));
-    mu_t iter = mu_tbl_lookup(scope, mu_num_fromuint(1));
-    return mu_fn_tcall(iter, 0x0, frame);
-}
-
-static mcnt_t mu_take_while_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t iter = mu_tbl_lookup(scope, mu_num_fromuint(1));
-    mu_fn_fcall(iter, 0x0f, frame);
-    mu_dec(iter);
-
-    mu_t m = mu_tbl_lookup(frame[0], mu_num_fromuint(0));
-    if (!m) {
-        mu_dec(frame[0]);
-        return 0;
-    }
-    mu_dec(m);
-
-    m = mu_inc(frame[0]);
-    mu_t cond = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    mu_fn_fcall(cond, 0xf1, frame);
-    mu_dec(cond);
-    if (!frame[0]) {
-        mu_dec(m);
-        return 0;
-    }
-    mu_dec(frame[0]);
-    frame[0] = m;
-    return 0xf;
-}
-
 static mcnt_t mu_take_bfn(mu_t *frame) {
     mu_t m    = frame[0];
     mu_t iter = frame[1];
@@ -1142,68 +1486,14 @@ static mcnt_t mu_take_bfn(mu_t *frame) {
     mu_fn_fcall(MU_ITER, 0x11, frame);
     iter = frame[0];
 
-    mcnt_t (*mu_take_step_bfn)(mu_t scope, mu_t *frame);
-    if (mu_isnum(m)) {
-        mu_take_step_bfn = mu_take_count_step_bfn;
-    } else {
-        mu_take_step_bfn = mu_take_while_step_bfn;
-    }
-
-    frame[0] = mu_fn_fromsbfn(0x0, mu_take_step_bfn,
-            mu_tbl_fromlist((mu_t[]){m, iter}, 2));
+    frame[0] = mu_pipe_stage(iter,
+            mu_isnum(m) ? MU_PIPE_TAKE : MU_PIPE_TAKEWHILE, m);
     return 1;
 }
 
 MU_DEF_STR(mu_take_key_def, "take")
 MU_DEF_BFN(mu_take_def, 0x2, mu_take_bfn)
 
-static mcnt_t mu_drop_count_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t iter = mu_tbl_lookup(scope, mu_num_fromuint(1));
-    mu_t i = mu_tbl_lookup(scope, mu_num_fromuint(0));
-
-    if (i) {
-        while (mu_num_cmp(i, mu_num_fromuint(0)) > 0) {
-            mu_fn_fcall(iter, 0x01, frame);
-            if (!frame[0]) {
-                mu_dec(iter);
-                return 0;
-            }
-            mu_dec(frame[0]);
-            i = mu_num_sub(i, mu_num_fromuint(1));
-        }
-
-        mu_tbl_insert(scope, mu_num_fromuint(0), 0);
-    }
-
-    return mu_fn_tcall(iter, 0x0, frame);
-}
-
-static mcnt_t mu_drop_while_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t iter = mu_tbl_lookup(scope, mu_num_fromuint(1));
-    mu_t cond = mu_tbl_lookup(scope, mu_num_fromuint(0));
-
-    if (cond) {
-        while (mu_fn_next(iter, 0xf, frame)) {
-            mu_t m = mu_inc(frame[0]);
-            mu_fn_fcall(cond, 0xf1, frame);
-            if (!frame[0]) {
-                mu_dec(iter);
-                mu_dec(cond);
-                frame[0] = m;
-                mu_tbl_insert(scope, mu_num_fromuint(0), 0);
-                return 0xf;
-            }
-            mu_dec(m);
-        }
-
-        mu_dec(iter);
-        mu_dec(cond);
-        return 0;
-    }
-
-    return mu_fn_tcall(iter, 0x0, frame);
-}
-
 static mcnt_t mu_drop_bfn(mu_t *frame) {
     mu_t m    = frame[0];
     mu_t iter = frame[1];
@@ -1214,15 +1504,8 @@ static mcnt_t mu_drop_bfn(mu_t *frame) {
     mu_fn_fcall(MU_ITER, 0x11, frame);
     iter = frame[0];
 
-    mcnt_t (*mu_drop_step_bfn)(mu_t scope, mu_t *frame);
-    if (mu_isnum(m)) {
-        mu_drop_step_bfn = mu_drop_count_step_bfn;
-    } else {
-        mu_drop_step_bfn = mu_drop_while_step_bfn;
-    }
-
-    frame[0] = mu_fn_fromsbfn(0x0, mu_drop_step_bfn,
-            mu_tbl_fromlist((mu_t[]){m, iter}, 2));
+    frame[0] = mu_pipe_stage(iter,
+            mu_isnum(m) ? MU_PIPE_DROP : MU_PIPE_DROPWHILE, m);
     return 1;
 }
 
@@ -1329,18 +1612,37 @@ static mcnt_t mu_max_bfn(mu_t *frame) {
 MU_DEF_STR(mu_max_key_def, "max")
 MU_DEF_BFN(mu_max_def, 0xf, mu_max_bfn)
 
-static mcnt_t mu_reverse_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t i = mu_tbl_lookup(scope, mu_num_fromuint(1));
-    if (mu_num_cmp(i, mu_num_fromuint(0)) < 0) {
+// State of reverse and sort, a table of elements and a position
+struct mstore {
+    mu_t store;
+    muint_t i;
+};
+
+static void mu_store_destroy(mu_t b) {
+    mu_dec(((struct mstore *)mu_buf_getdata(b))->store);
+}
+
+static void mu_store_gcvisit(mu_t b, void (*visit)(mu_t *)) {
+    visit(&((struct mstore *)mu_buf_getdata(b))->store);
+}
+
+static mu_t mu_store_create(mu_t store, muint_t i) {
+    mu_t b = mu_buf_createvisit(sizeof(struct mstore),
+            mu_store_destroy, mu_store_gcvisit);
+    struct mstore *s = mu_buf_getdata(b);
+    s->store = store;
+    s->i = i;
+    return b;
+}
+
+static mcnt_t mu_reverse_step_bfn(mu_t b, mu_t *frame) {
+    struct mstore *s = mu_buf_getdata(b);
+    if (s->i == 0) {
         return 0;
     }
 
-    mu_t store = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    frame[0] = mu_tbl_lookup(store, i);
-    mu_dec(store);
-
-    mu_tbl_insert(scope, mu_num_fromuint(1),
-            mu_num_sub(i, mu_num_fromuint(1)));
+    s->i -= 1;
+    frame[0] = mu_tbl_lookup(s->store, mu_num_fromuint(s->i));
     return 0xf;
 }
 
@@ -1356,9 +1658,7 @@ static mcnt_t mu_reverse_bfn(mu_t *frame) {
     mu_dec(iter);
 
     frame[0] = mu_fn_fromsbfn(0x0, mu_reverse_step_bfn,
-            mu_tbl_fromlist((mu_t[]){
-                store, mu_num_fromuint(mu_tbl_getlen(store)-1)
-            }, 2));
+            mu_store_create(store, mu_tbl_getlen(store)));
     return 1;
 }
 
@@ -1426,14 +1726,9 @@ static void mu_fn_merge_sort(mu_t elems) {
     mu_dealloc(b, len*sizeof(mu_t[2]));
 }
 
-static mcnt_t mu_sort_step_bfn(mu_t scope, mu_t *frame) {
-    mu_t store = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    muint_t i = mu_num_getuint(mu_tbl_lookup(scope, mu_num_fromuint(1)));
-
-    bool next = mu_tbl_next(store, &i, 0, &frame[0]);
-    mu_dec(store);
-    mu_tbl_insert(scope, mu_num_fromuint(1), mu_num_fromuint(i));
-    return next ? 0xf : 0;
+static mcnt_t mu_sort_step_bfn(mu_t b, mu_t *frame) {
+    struct mstore *s = mu_buf_getdata(b);
+    return mu_tbl_next(s->store, &s->i, 0, &frame[0]) ? 0xf : 0;
 }
 
 static mcnt_t mu_sort_bfn(mu_t *frame) {
@@ -1450,7 +1745,7 @@ static mcnt_t mu_sort_bfn(mu_t *frame) {
     mu_fn_merge_sort(store);
 
     frame[0] = mu_fn_fromsbfn(0x0, mu_sort_step_bfn,
-            mu_tbl_fromlist((mu_t[]){store, mu_num_fromuint(0)}, 2));
+            mu_store_create(store, 0));
     return 1;
 }
 
@@ -1547,6 +1842,8 @@ MU_DEF_TBL(mu_builtins_def, {
 
     { mu_map_key_def,       mu_map_def },
     { mu_filter_key_def,    mu_filter_def },
+    { mu_pmap_key_def,      mu_pmap_def },
+    { mu_pfilter_key_def,   mu_pfilter_def },
     { mu_reduce_key_def,    mu_reduce_def },
 
     { mu_any_key_def,       mu_any_def },
@@ -25,6 +25,7 @@
 #define MU_H
 #include "config.h"
 #include "types.h"
+#include "state.h"
 #include "sys.h"
 #include "num.h"
 #include "buf.h"
@@ -41,6 +42,13 @@
 void *mu_alloc(muint_t size);
 void mu_dealloc(void *, muint_t size);
 
+// Cycle collection
+// collects garbage cycles of tables and functions, this runs
+// automatically once threshold possible roots are buffered,
+// a threshold of zero disables automatic collection
+void mu_collect(void);
+void mu_setcollect(muint_t threshold);
+
 // System operations
 mu_noreturn mu_verrorf(const char *f, va_list args);
 mu_noreturn mu_errorf(const char *f, ...);
@@ -156,6 +164,8 @@ extern mu_pure mu_t name(void);
 #define MU_COMP         mu_comp_def()
 #define MU_MAP          mu_map_def()
 #define MU_FILTER       mu_filter_def()
+#define MU_PMAP         mu_pmap_def()
+#define MU_PFILTER      mu_pfilter_def()
 #define MU_REDUCE       mu_reduce_def()
 #define MU_ANY          mu_any_def()
 #define MU_ALL          mu_all_def()
@@ -254,6 +264,8 @@ extern mu_pure mu_t name(void);
 #define MU_COMP_KEY     mu_comp_key_def()
 #define MU_MAP_KEY      mu_map_key_def()
 #define MU_FILTER_KEY   mu_filter_key_def()
+#define MU_PMAP_KEY     mu_pmap_key_def()
+#define MU_PFILTER_KEY  mu_pfilter_key_def()
 #define MU_REDUCE_KEY   mu_reduce_key_def()
 #define MU_ANY_KEY      mu_any_key_def()
 #define MU_ALL_KEY      mu_all_key_def()
@@ -352,6 +364,8 @@ MU_DEF(mu_bind_def)
 MU_DEF(mu_comp_def)
 MU_DEF(mu_map_def)
 MU_DEF(mu_filter_def)
+MU_DEF(mu_pmap_def)
+MU_DEF(mu_pfilter_def)
 MU_DEF(mu_reduce_def)
 MU_DEF(mu_any_def)
 MU_DEF(mu_all_def)
@@ -449,6 +463,8 @@ MU_DEF(mu_bind_key_def)
 MU_DEF(mu_comp_key_def)
 MU_DEF(mu_map_key_def)
 MU_DEF(mu_filter_key_def)
+MU_DEF(mu_pmap_key_def)
+MU_DEF(mu_pfilter_key_def)
 MU_DEF(mu_reduce_key_def)
 MU_DEF(mu_any_key_def)
 MU_DEF(mu_all_key_def)
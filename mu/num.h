@@ -10,6 +10,21 @@
 #include "types.h"
 
 
+// Definition of Mu's number representation
+//
+// Numbers are stored inline with the MTNUM tag. Integers that fit in
+// the remaining bits are stored exactly, shifted past the tag with the
+// MU_NUM_INT bit set. Any other numbers are stored as floats with the
+// low bits truncated to make room for the tag.
+//
+// Integral floats in the range of integers are always stored as
+// integers, so each number has a single representation and numbers
+// can still be compared bitwise.
+#define MU_NUM_INT 0x8
+#define MU_INT_MIN (-((mint_t)1 << (8*sizeof(mint_t) - 5)))
+#define MU_INT_MAX (((mint_t)1 << (8*sizeof(mint_t) - 5)) - 1)
+
+
 // Conversion operations
 mu_t mu_num_fromfloat(mfloat_t);
 mu_inline mu_t mu_num_fromuint(muint_t n);
@@ -17,6 +32,7 @@ mu_inline mu_t mu_num_fromint(mint_t n);
 mu_t mu_num_frommu(mu_t m);
 
 // Number accessing functions
+mu_inline bool mu_num_isint(mu_t m);
 mu_inline mfloat_t mu_num_getfloat(mu_t m);
 mu_inline muint_t mu_num_getuint(mu_t m);
 mu_inline mint_t mu_num_getint(mu_t m);
@@ -62,6 +78,7 @@ mu_t mu_num_shr(mu_t, mu_t);
 mu_t mu_num_parsen(const mbyte_t **pos, const mbyte_t *end);
 mu_t mu_num_parse(const char *s, muint_t n);
 mu_t mu_num_repr(mu_t);
+void mu_num_dump(mu_t *b, muint_t *i, mu_t n);
 
 mu_t mu_num_bin(mu_t);
 mu_t mu_num_oct(mu_t);
@@ -69,39 +86,67 @@ mu_t mu_num_hex(mu_t);
 
 
 // Number creating functions
-mu_inline mu_t mu_num_fromuint(muint_t n) {
-    return (mu_t)(MTNUM + (~7 &
-        ((union { mfloat_t n; muint_t u; }){(mfloat_t)n}).u));
+mu_inline mu_t mu_num_fromint(mint_t n) {
+    if (n < MU_INT_MIN || n > MU_INT_MAX) {
+        return mu_num_fromfloat((mfloat_t)n);
+    }
+
+    return (mu_t)(((muint_t)n << 4) | MU_NUM_INT | MTNUM);
 }
 
-mu_inline mu_t mu_num_fromint(mint_t n) {
-    return (mu_t)(MTNUM + (~7 &
-        ((union { mfloat_t n; muint_t u; }){(mfloat_t)n}).u));
+mu_inline mu_t mu_num_fromuint(muint_t n) {
+    if (n > (muint_t)MU_INT_MAX) {
+        return mu_num_fromfloat((mfloat_t)n);
+    }
+
+    return (mu_t)((n << 4) | MU_NUM_INT | MTNUM);
 }
 
 // Number accessing functions
+mu_inline bool mu_num_isint(mu_t m) {
+    return (0xf & (muint_t)m) == (MU_NUM_INT | MTNUM);
+}
+
 mu_inline mfloat_t mu_num_getfloat(mu_t m) {
+    if (mu_num_isint(m)) {
+        return (mfloat_t)((mint_t)m >> 4);
+    }
+
     return ((union { muint_t u; mfloat_t n; }){(muint_t)m - MTNUM}).n;
 }
 
-mu_inline muint_t mu_num_getuint(mu_t m) {
-    return (muint_t)mu_num_getfloat(m);
-}
+mu_inline mint_t mu_num_getint(mu_t m) {
+    if (mu_num_isint(m)) {
+        return (mint_t)m >> 4;
+    }
 
-mu_inline mint_t  mu_num_getint(mu_t m)  {
     return (mint_t)mu_num_getfloat(m);
 }
 
+mu_inline muint_t mu_num_getuint(mu_t m) {
+    if (mu_num_isint(m)) {
+        return (muint_t)((mint_t)m >> 4);
+    }
+
+    return (muint_t)mu_num_getfloat(m);
+}
+
 
-// Number constant macro
+// Number constant macros
 #define MU_DEF_FLOAT(name, num)                                             \
 mu_pure mu_t name(void) {                                                   \
-    return (mu_t)(MTNUM + (~7 &                                             \
-        ((union { mfloat_t n; muint_t u; }){(mfloat_t)num}).u));            \
+    return mu_num_fromfloat((mfloat_t)num);                                 \
+}
+
+#define MU_DEF_UINT(name, num)                                              \
+mu_pure mu_t name(void) {                                                   \
+    return mu_num_fromuint((muint_t)num);                                   \
 }
 
-#define MU_DEF_UINT(name, num) MU_DEF_FLOAT(name, (muint_t)num)
-#define MU_DEF_INT(name, num)  MU_DEF_FLOAT(name, (mint_t)num)
+#define MU_DEF_INT(name, num)                                               \
+mu_pure mu_t name(void) {                                                   \
+    return mu_num_fromint((mint_t)num);                                     \
+}
 
 
 #endif
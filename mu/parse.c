@@ -7,6 +7,8 @@
 #include "parse.h"
 #include "mu.h"
 
+#include <math.h>
+
 
 //// Definitions ////
 
@@ -220,12 +222,13 @@ static const mclass_t class[256] = {
 
 // Parsing state
 typedef uint8_t mstate_t;
-enum mstate {
+enum mpstate {
     P_DIRECT,
     P_INDIRECT,
     P_SCOPED,
     P_CALLED,
-    P_NIL
+    P_NIL,
+    P_LOCAL,
 };
 
 
@@ -261,12 +264,20 @@ struct mparse {
     mu_t imms;
     mu_t bcode;
     mlen_t bcount;
+    mlen_t lookups;
 
     mlen_t bchain;
     mlen_t cchain;
 
+    mu_t locals;
+    mu_t captures;
+    mu_t alloc;
+    struct mparse *parent;
+    bool analysis;
+
     muintq_t args;
     muintq_t regs;
+    muintq_t base;
     muintq_t sp;
 
     muintq_t depth;
@@ -294,6 +305,7 @@ struct mframe {
 struct mexpr {
     muintq_t prec;
     muintq_t params;
+    muintq_t reg;
     mstate_t state;
     uint8_t insert : 1;
 };
@@ -574,10 +586,20 @@ static void encode(struct mparse *p, mop_t op,
                    mint_t sdiff) {
     p->sp += sdiff;
 
+    if (p->sp+1 > MU_REGS) {
+        mu_errorf("exceeded bytecode limits");
+    }
+
     if (p->sp+1 > p->regs) {
         p->regs = p->sp+1;
     }
 
+    // operators check their binding through a lookup cache
+    if (op == MU_OP_LOOKUP || op == MU_OP_LOOKDN ||
+        (op >= MU_OP_ADD && op <= MU_OP_NOT)) {
+        p->lookups += 1;
+    }
+
     mu_encode((void (*)(void *, mbyte_t))emit, p, op, d, a, b);
 }
 
@@ -586,13 +608,16 @@ static void patch(struct mparse *p, mlen_t offset, minth_t j) {
     mu_patch(&bcode[offset], j);
 }
 
+// Chains start at the last jump, each jump storing the distance back
+// to the previous one until a distance of zero
 static void patch_all(struct mparse *p, mlen_t chain, minth_t offset) {
-    muint_t current = 0;
     mbyte_t *bcode = mu_buf_getdata(p->bcode);
+    mint_t current = chain;
 
     while (chain) {
-        current += chain;
-        chain = mu_patch(&bcode[current], offset - current);
+        mint_t link = mu_patch(&bcode[current], offset - current);
+        current += link;
+        chain = link;
     }
 }
 
@@ -617,15 +642,58 @@ static muint_t imm(struct mparse *p, mu_t m) {
     return index;
 }
 
+// Scope resolution, returns the register a local is stored in or 0 if
+// the symbol must be looked up in the scope. Symbols found in an enclosing
+// function are marked as captured so they stay in that function's scope.
+// Does not consume.
+static muintq_t scoperesolve(struct mparse *p, mu_t m) {
+    mu_t reg = mu_tbl_lookup(p->locals, mu_inc(m));
+    if (reg) {
+        return mu_isnum(reg) ? mu_num_getuint(reg) : 0;
+    }
+
+    for (struct mparse *q = p->parent; q; q = q->parent) {
+        if (mu_tbl_lookup(q->locals, mu_inc(m))) {
+            mu_tbl_insert(q->captures, mu_inc(m), IMM_NIL);
+            break;
+        }
+    }
+
+    return 0;
+}
+
 // Scope checking, does not consume
-static void scopecheck(struct mparse *p, mu_t m, bool insert) {
+static muintq_t scopecheck(struct mparse *p, mu_t m, bool insert) {
     if (insert) {
+        if (!mu_tbl_lookup(p->locals, mu_inc(m))) {
+            mu_t reg = p->alloc ? mu_tbl_lookup(p->alloc, mu_inc(m)) : 0;
+            mu_tbl_insert(p->locals, mu_inc(m), reg ? reg : IMM_NIL);
+        }
+
         mu_tbl_insert(p->scope, mu_inc(m), IMM_NIL);
     } else {
         mu_t s = mu_tbl_lookup(p->scope, mu_inc(m));
         mu_checkscope(s, &p->l, m);
         mu_dec(s);
     }
+
+    return scoperesolve(p, m);
+}
+
+// Finds the dedicated opcode for an operator if it resolves to a builtin
+// and is not declared in any enclosing function, otherwise returns 0.
+// Does not consume
+static mop_t arith(struct mparse *p, mu_t m, mcnt_t args) {
+    for (struct mparse *q = p; q; q = q->parent) {
+        if (mu_tbl_lookup(q->locals, mu_inc(m))) {
+            return 0;
+        }
+    }
+
+    mu_t fn = mu_tbl_lookup(p->scope, mu_inc(m));
+    mop_t op = mu_arith(fn, args);
+    mu_dec(fn);
+    return op;
 }
 
 // More complicated encoding operations
@@ -639,8 +707,42 @@ static muint_t offset(struct mexpr *e) {
     }
 }
 
+static void encsym(struct mparse *p, struct mexpr *e, mu_t m) {
+    muintq_t reg = scopecheck(p, m, e->insert);
+
+    if (reg) {
+        e->state = P_LOCAL;
+        e->reg = reg;
+    } else {
+        encode(p, MU_OP_IMM, p->sp+1, imm(p, mu_inc(m)), 0, +1);
+        e->state = P_SCOPED;
+    }
+}
+
+static void encname(struct mparse *p, mint_t d, mu_t m, mint_t sdiff) {
+    muintq_t reg = scoperesolve(p, m);
+
+    if (reg) {
+        mu_dec(m);
+        encode(p, MU_OP_DUP, d, reg, 0, sdiff);
+    } else {
+        encode(p, MU_OP_IMM, d, imm(p, m), 0, sdiff);
+        encode(p, MU_OP_LOOKUP, d, 0, d, 0);
+    }
+}
+
+static void encdrop(struct mparse *p) {
+    mu_t k, v;
+    for (muint_t i = 0; p->alloc && mu_tbl_next(p->alloc, &i, &k, &v);) {
+        encode(p, MU_OP_DROP, mu_num_getuint(v), 0, 0, 0);
+        mu_dec(k);
+    }
+}
+
 static void encload(struct mparse *p, struct mexpr *e, mint_t offset) {
-    if (e->state == P_SCOPED) {
+    if (e->state == P_LOCAL) {
+        encode(p, MU_OP_DUP, p->sp+offset+1, e->reg, 0, +offset+1);
+    } else if (e->state == P_SCOPED) {
         encode(p, MU_OP_LOOKUP, p->sp+offset, 0, p->sp, +offset);
     } else if (e->state == P_INDIRECT) {
         encode(p, MU_OP_LOOKDN, p->sp+offset-1, p->sp-1, p->sp, +offset-1);
@@ -663,6 +765,9 @@ static void encstore(struct mparse *p, struct mexpr *e,
                          bool insert, mint_t offset) {
     if (e->state == P_NIL) {
         encode(p, MU_OP_DROP, p->sp-offset, 0, 0, 0);
+    } else if (e->state == P_LOCAL) {
+        encode(p, MU_OP_DROP, e->reg, 0, 0, 0);
+        encode(p, MU_OP_MOVE, e->reg, p->sp-offset, 0, 0);
     } else if (e->state == P_SCOPED) {
         encode(p, insert ? MU_OP_INSERT : MU_OP_ASSIGN,
                p->sp-offset-1, 0, p->sp, -1);
@@ -675,12 +780,535 @@ static void encstore(struct mparse *p, struct mexpr *e,
     }
 }
 
+//// Optimization ////
+
+// Bytecode is optimized after parsing, at a level set by mu_setoptimize
+//  0: no optimization
+//  1: removes redundant moves/drops and unreachable code, threads jumps
+//  2: also folds operators applied to literals and builtin constants,
+//     if the scope the code runs in is constant so neither can be rebound
+// Levels past 2 are the same as 2
+#ifndef MU_OPT_LEVEL
+#define MU_OPT_LEVEL 2
+#endif
+
+static muint_t mu_opt_level = MU_OPT_LEVEL;
+
+void mu_setoptimize(muint_t level) {
+    mu_opt_level = level;
+}
+
+// Decoded instructions, jump operands are instruction indices
+struct mins {
+    mop_t op;
+    uint8_t label : 1;
+    uint8_t dead  : 1;
+    muintq_t d;
+    muint_t a;
+    muint_t b;
+};
+
+// Optimization state
+struct mopt {
+    struct mins *ins;
+    muint_t n;
+    muint_t size;
+
+    // immediates by index
+    mu_t *imms;
+    muint_t icount;
+    muint_t isize;
+};
+
+static void opt_decode(struct mparse *p, struct mopt *o) {
+    const uint16_t *bcode = mu_buf_getdata(p->bcode);
+    muint_t words = p->bcount / 2;
+    muint_t *index = mu_alloc((words+1) * sizeof(muint_t));
+    o->size = words;
+    o->ins = mu_alloc(o->size * sizeof(struct mins));
+    o->n = 0;
+
+    for (muint_t pc = 0; pc < words; o->n++) {
+        index[pc] = o->n;
+        struct mins *i = &o->ins[o->n];
+        mop_t op;
+        mint_t d, a, b;
+        pc += mu_decode(&bcode[pc], &op, &d, &a, &b);
+        i->op = op;
+        i->d = d;
+        i->a = (op == MU_OP_JUMP || op == MU_OP_JFALSE) ? pc + a : a;
+        i->b = b;
+        i->label = false;
+        i->dead = false;
+    }
+
+    index[words] = o->n;
+    for (muint_t j = 0; j < o->n; j++) {
+        if (o->ins[j].op == MU_OP_JUMP || o->ins[j].op == MU_OP_JFALSE) {
+            o->ins[j].a = index[o->ins[j].a];
+        }
+    }
+
+    mu_dealloc(index, (words+1) * sizeof(muint_t));
+
+    o->icount = mu_tbl_getlen(p->imms);
+    o->isize = o->icount + 1;
+    o->imms = mu_alloc(o->isize * sizeof(mu_t));
+    mu_t k, v;
+    for (muint_t i = 0; mu_tbl_next(p->imms, &i, &k, &v);) {
+        o->imms[mu_num_getuint(v)] = (k == IMM_NIL) ? 0 : k;
+        mu_dec(k);
+    }
+}
+
+// Removes immediates that are no longer used
+static void opt_compact(struct mparse *p, struct mopt *o) {
+    muint_t *remap = mu_alloc(o->icount * sizeof(muint_t));
+    if (o->icount) {
+        memset(remap, 0xff, o->icount * sizeof(muint_t));
+    }
+    mu_t imms = mu_tbl_create(0);
+    muint_t count = 0;
+
+    for (muint_t j = 0; j < o->n; j++) {
+        struct mins *i = &o->ins[j];
+        if (i->dead || !(i->op == MU_OP_IMM || i->op == MU_OP_FN)) {
+            continue;
+        }
+
+        if (remap[i->a] == (muint_t)-1) {
+            mu_t m = o->imms[i->a];
+            mu_tbl_insert(imms, m ? mu_inc(m) : IMM_NIL,
+                    mu_num_fromuint(count));
+            remap[i->a] = count++;
+        }
+
+        i->a = remap[i->a];
+    }
+
+    mu_dealloc(remap, o->icount * sizeof(muint_t));
+    mu_dec(p->imms);
+    p->imms = imms;
+}
+
+static void opt_count(muint_t *off, mbyte_t byte) {
+    (void)byte;
+    *off += 1;
+}
+
+static void opt_encode(struct mparse *p, struct mopt *o) {
+    struct mins *ins = o->ins;
+    muint_t *pos = mu_alloc((o->n+1) * sizeof(muint_t));
+    muint_t off = 0;
+
+    for (muint_t j = 0; j < o->n; j++) {
+        pos[j] = off;
+        if (ins[j].dead) {
+            continue;
+        }
+
+        // size of jumps does not depend on their offset
+        bool jump = ins[j].op == MU_OP_JUMP || ins[j].op == MU_OP_JFALSE;
+        mu_encode((void (*)(void *, mbyte_t))opt_count, &off, ins[j].op,
+                ins[j].d, jump ? 0 : ins[j].a, ins[j].b);
+    }
+    pos[o->n] = off;
+
+    mu_dec(p->bcode);
+    p->bcode = mu_buf_create(off);
+    p->bcount = 0;
+
+    for (muint_t j = 0; j < o->n; j++) {
+        if (ins[j].dead) {
+            continue;
+        }
+
+        if (ins[j].op == MU_OP_JUMP || ins[j].op == MU_OP_JFALSE) {
+            mu_encode((void (*)(void *, mbyte_t))emit, p, ins[j].op,
+                    ins[j].d, pos[ins[j].a] - pos[j], 0);
+        } else {
+            mu_encode((void (*)(void *, mbyte_t))emit, p, ins[j].op,
+                    ins[j].d, ins[j].a, ins[j].b);
+        }
+    }
+
+    mu_dealloc(pos, (o->n+1) * sizeof(muint_t));
+    mu_dealloc(o->ins, o->size * sizeof(struct mins));
+    mu_dealloc(o->imms, o->isize * sizeof(mu_t));
+}
+
+// Navigation that skips removed instructions, instructions can only be
+// combined with their previous instruction if they are not jumped to
+static muint_t opt_next(struct mopt *o, muint_t j) {
+    while (j < o->n && o->ins[j].dead) {
+        j++;
+    }
+
+    return j;
+}
+
+static bool opt_prev(struct mopt *o, muint_t j, muint_t *prev) {
+    if (o->ins[j].label) {
+        return false;
+    }
+
+    while (j > 0) {
+        if (!o->ins[--j].dead) {
+            *prev = j;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void opt_kill(struct mopt *o, muint_t j) {
+    o->ins[j].dead = true;
+    if (o->ins[j].label) {
+        muint_t k = opt_next(o, j);
+        if (k < o->n) {
+            o->ins[k].label = true;
+        }
+    }
+}
+
+static bool opt_isjump(struct mins *i) {
+    return !i->dead && (i->op == MU_OP_JUMP || i->op == MU_OP_JFALSE);
+}
+
+static void opt_labels(struct mopt *o) {
+    for (muint_t j = 0; j < o->n; j++) {
+        o->ins[j].label = false;
+    }
+
+    for (muint_t j = 0; j < o->n; j++) {
+        if (opt_isjump(&o->ins[j])) {
+            o->ins[j].a = opt_next(o, o->ins[j].a);
+            if (o->ins[j].a < o->n) {
+                o->ins[o->ins[j].a].label = true;
+            }
+        }
+    }
+}
+
+// Immediate values, new immediates are added to the parse state
+static mu_t opt_getimm(struct mopt *o, muint_t index) {
+    return o->imms[index];
+}
+
+static muint_t opt_imm(struct mparse *p, struct mopt *o, mu_t m) {
+    muint_t index = imm(p, m);
+    if (index >= o->icount) {
+        if (index >= o->isize) {
+            muint_t nsize = 2*o->isize;
+            mu_t *nimms = mu_alloc(nsize * sizeof(mu_t));
+            memcpy(nimms, o->imms, o->icount * sizeof(mu_t));
+            mu_dealloc(o->imms, o->isize * sizeof(mu_t));
+            o->imms = nimms;
+            o->isize = nsize;
+        }
+
+        o->imms[index] = m;
+        o->icount = index + 1;
+    }
+
+    return index;
+}
+
+// Operators and builtins can be rebound at run time in any table of the
+// scope the code is compiled in, such as by a later let at the top level,
+// so they are only folded if every table in that scope is a constant
+static bool opt_fixed(struct mparse *p) {
+    while (p->parent) {
+        p = p->parent;
+    }
+
+    mu_t t = mu_tbl_gettail(p->scope);
+    bool fixed = true;
+    while (t) {
+        fixed = fixed && mu_getref(t) == 0;
+        mu_t tail = mu_tbl_gettail(t);
+        mu_dec(t);
+        t = tail;
+    }
+
+    return fixed;
+}
+
+// Symbols that resolve to constant numbers in the builtins. Like
+// operators, these are only resolved if they are not declared
+// in any enclosing function. Does not consume
+static bool opt_builtin(struct mparse *p, mu_t m, mu_t *r) {
+    if (!mu_isstr(m)) {
+        return false;
+    }
+
+    for (struct mparse *q = p; q; q = q->parent) {
+        if (mu_tbl_lookup(q->locals, mu_inc(m))) {
+            return false;
+        }
+    }
+
+    mu_t v = mu_tbl_lookup(p->scope, mu_inc(m));
+    mu_t b = mu_tbl_lookup(MU_BUILTINS, mu_inc(m));
+    mu_dec(v);
+    mu_dec(b);
+    if (!v || v != b || !mu_isnum(v)) {
+        return false;
+    }
+
+    *r = v;
+    return true;
+}
+
+// Applies an operator to constants, operations that would report
+// an error are left to run time
+static bool opt_fold(mop_t op, mu_t x, mu_t y, mu_t *r) {
+    if (op == MU_OP_NOT) {
+        *r = !x ? MU_TRUE : MU_FALSE;
+        return true;
+    } else if (op == MU_OP_EQ || op == MU_OP_NEQ) {
+        *r = ((x == y) == (op == MU_OP_EQ)) ? MU_TRUE : MU_FALSE;
+        return true;
+    } else if (!mu_isnum(x) || (op != MU_OP_NEG && !mu_isnum(y))) {
+        return false;
+    }
+
+    if (op == MU_OP_LT || op == MU_OP_LTE ||
+        op == MU_OP_GT || op == MU_OP_GTE) {
+        mint_t c = mu_num_cmp(x, y);
+        *r = (op == MU_OP_LT  ? c <  0 :
+              op == MU_OP_LTE ? c <= 0 :
+              op == MU_OP_GT  ? c >  0 : c >= 0) ? MU_TRUE : MU_FALSE;
+        return true;
+    }
+
+    mfloat_t xf = mu_num_getfloat(x);
+    mfloat_t yf = (op != MU_OP_NEG) ? mu_num_getfloat(y) : 0;
+    mfloat_t f;
+
+    switch (op) {
+        case MU_OP_ADD:  f = xf + yf;             break;
+        case MU_OP_SUB:  f = xf - yf;             break;
+        case MU_OP_MUL:  f = xf * yf;             break;
+        case MU_OP_DIV:  f = xf / yf;             break;
+        case MU_OP_IDIV: f = floor(xf / yf);      break;
+        case MU_OP_MOD:  f = fmod(xf, yf);        break;
+        case MU_OP_POW:  f = pow(xf, yf);         break;
+        case MU_OP_NEG:  *r = mu_num_neg(x);      return true;
+        default:         return false;
+    }
+
+    if (isnan(f)) {
+        return false;
+    }
+
+    // results are found by the number type, which keeps integers exact
+    switch (op) {
+        case MU_OP_ADD:  *r = mu_num_add(x, y);    break;
+        case MU_OP_SUB:  *r = mu_num_sub(x, y);    break;
+        case MU_OP_MUL:  *r = mu_num_mul(x, y);    break;
+        case MU_OP_DIV:  *r = mu_num_div(x, y);    break;
+        case MU_OP_IDIV: *r = mu_num_idiv(x, y);   break;
+        case MU_OP_MOD:  *r = mu_num_mod(x, y);    break;
+        case MU_OP_POW:  *r = mu_num_pow(x, y);    break;
+        default:         mu_unreachable;
+    }
+
+    return true;
+}
+
+// Constant folding, operators consume their operands so the
+// temporary registers are free to discard
+static bool opt_constants(struct mparse *p, struct mopt *o) {
+    struct mins *ins = o->ins;
+    bool fixed = opt_fixed(p);
+    bool changed = false;
+
+    for (muint_t j = 0; j < o->n; j++) {
+        struct mins *i = &ins[j];
+        muint_t x, y;
+        mu_t r;
+        if (i->dead || !opt_prev(o, j, &x) || ins[x].op != MU_OP_IMM) {
+            continue;
+        }
+
+        if (fixed && i->op == MU_OP_LOOKUP &&
+            i->a == 0 && i->b == ins[x].d &&
+            opt_builtin(p, opt_getimm(o, ins[x].a), &r)) {
+            // IMM rt, sym; LOOKUP rx, r0, rt
+            ins[x].d = i->d;
+            ins[x].a = opt_imm(p, o, r);
+            opt_kill(o, j);
+            changed = true;
+        } else if (i->op == MU_OP_JFALSE && ins[x].d == i->d) {
+            // IMM rx; JFALSE rx
+            if (opt_getimm(o, ins[x].a)) {
+                opt_kill(o, j);
+            } else {
+                i->op = MU_OP_JUMP;
+            }
+            changed = true;
+        } else if (fixed && (i->op == MU_OP_NEG || i->op == MU_OP_NOT) &&
+                   ins[x].d == i->d &&
+                   opt_fold(i->op, opt_getimm(o, ins[x].a), 0, &r)) {
+            // IMM rx; NEG rx
+            ins[x].a = opt_imm(p, o, r);
+            opt_kill(o, j);
+            changed = true;
+        } else if (fixed && i->op >= MU_OP_ADD && i->op <= MU_OP_GTE &&
+                   ins[x].d == i->a && ins[x].d != i->d &&
+                   opt_prev(o, x, &y) && ins[y].op == MU_OP_IMM &&
+                   ins[y].d == i->d &&
+                   opt_fold(i->op, opt_getimm(o, ins[y].a),
+                            opt_getimm(o, ins[x].a), &r)) {
+            // IMM rx; IMM ry; ADD rx, ry
+            ins[y].a = opt_imm(p, o, r);
+            opt_kill(o, x);
+            opt_kill(o, j);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// Peephole optimizations on moves and drops
+static bool opt_moves(struct mopt *o) {
+    struct mins *ins = o->ins;
+    bool changed = false;
+
+    for (muint_t j = 0; j < o->n; j++) {
+        struct mins *i = &ins[j];
+        muint_t x, y;
+        if (i->dead) {
+            continue;
+        }
+
+        if (i->op == MU_OP_MOVE && i->d == i->a) {
+            // MOVE rx, rx
+            opt_kill(o, j);
+            changed = true;
+        } else if (!opt_prev(o, j, &x)) {
+            continue;
+        } else if (i->op == MU_OP_DROP && ins[x].d == i->d &&
+                   (ins[x].op == MU_OP_DUP || ins[x].op == MU_OP_IMM)) {
+            // DUP rx, ry; DROP rx
+            opt_kill(o, x);
+            opt_kill(o, j);
+            changed = true;
+        } else if (i->op == MU_OP_MOVE && ins[x].op == MU_OP_MOVE &&
+                   ins[x].d == i->a && ins[x].a != i->a) {
+            // MOVE rt, ry; MOVE rx, rt
+            i->a = ins[x].a;
+            opt_kill(o, x);
+            changed = true;
+        } else if (i->op == MU_OP_MOVE && ins[x].op == MU_OP_DROP &&
+                   ins[x].d == i->d && i->d != i->a && i->d != 0 &&
+                   opt_prev(o, x, &y) && ins[y].d == i->a &&
+                   (((ins[y].op == MU_OP_DUP || ins[y].op == MU_OP_MOVE) &&
+                     ins[y].a != i->d) ||
+                    ins[y].op == MU_OP_IMM ||
+                    ins[y].op == MU_OP_FN ||
+                    ins[y].op == MU_OP_TBL)) {
+            // DUP rt, ry; DROP rx; MOVE rx, rt
+            ins[x] = ins[y];
+            ins[x].d = i->d;
+            ins[x].label = false;
+            ins[y].op = MU_OP_DROP;
+            ins[y].d = i->d;
+            ins[y].a = 0;
+            opt_kill(o, j);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// Jump threading and removal of unreachable code
+static bool opt_jumps(struct mopt *o) {
+    struct mins *ins = o->ins;
+    bool changed = false;
+
+    for (muint_t j = 0; j < o->n; j++) {
+        struct mins *i = &ins[j];
+        if (!opt_isjump(i)) {
+            continue;
+        }
+
+        for (muint_t hops = 0; hops < o->n; hops++) {
+            muint_t t = opt_next(o, i->a);
+            if (t == j || t >= o->n || ins[t].op != MU_OP_JUMP ||
+                ins[t].a == i->a) {
+                i->a = t;
+                break;
+            }
+
+            i->a = ins[t].a;
+            changed = true;
+        }
+
+        if (i->a == opt_next(o, j+1)) {
+            opt_kill(o, j);
+            changed = true;
+        }
+    }
+
+    opt_labels(o);
+
+    for (muint_t j = 0; j < o->n; j++) {
+        if (ins[j].dead || !(ins[j].op == MU_OP_JUMP ||
+                             ins[j].op == MU_OP_RET ||
+                             ins[j].op == MU_OP_TCALL)) {
+            continue;
+        }
+
+        for (muint_t k = j+1; k < o->n && !ins[k].label; k++) {
+            if (!ins[k].dead) {
+                ins[k].dead = true;
+                changed = true;
+            }
+        }
+    }
+
+    return changed;
+}
+
+// Code from the analysis pass is discarded, so is not optimized
+static void optimize(struct mparse *p) {
+    if (mu_opt_level == 0 || p->analysis || p->bcount == 0) {
+        return;
+    }
+
+    struct mopt o;
+    opt_decode(p, &o);
+
+    bool changed = true;
+    while (changed) {
+        opt_labels(&o);
+        changed = opt_jumps(&o);
+        changed |= opt_moves(&o);
+        if (mu_opt_level >= 2) {
+            changed |= opt_constants(p, &o);
+        }
+    }
+
+    opt_compact(p, &o);
+    opt_encode(p, &o);
+}
+
 // Completing a parse and deferating the final code object
 static mu_t compile(struct mparse *p, bool weak) {
     extern void mu_code_destroy(mu_t);
+    optimize(p);
+    // Lookup caches are indexed by bytecode offset, so we leave some
+    // extra space to avoid lookups sharing caches
+    mlen_t ccount = p->lookups ? 1 << mu_npw2(2*p->lookups) : 0;
     mu_t b = mu_buf_createdtor(
             mu_offsetof(struct mcode, data) +
             sizeof(mu_t)*mu_tbl_getlen(p->imms) +
+            sizeof(struct mcache)*ccount +
             p->bcount,
             mu_code_destroy);
 
@@ -688,9 +1316,18 @@ static mu_t compile(struct mparse *p, bool weak) {
     code->args = p->args;
     code->flags = MU_FN_SCOPED | (weak ? MU_FN_WEAK : 0);
     code->regs = p->regs;
-    code->locals = mu_tbl_getlen(p->scope);
+    code->locals = mu_tbl_getlen(p->locals) -
+            (p->alloc ? mu_tbl_getlen(p->alloc) : 0);
     code->icount = mu_tbl_getlen(p->imms);
+    code->ccount = ccount;
     code->bcount = p->bcount;
+#ifdef MU_PROF
+    code->prof = 0;
+#endif
+#ifdef MU_JIT
+    code->hot = 0;
+    code->jit = 0;
+#endif
 
     mu_t *imms = mu_code_getimms(b);
     mu_t k, v;
@@ -698,12 +1335,17 @@ static mu_t compile(struct mparse *p, bool weak) {
         imms[mu_num_getuint(v)] = (k == IMM_NIL) ? 0 : k;
     }
 
+    memset(mu_code_getcaches(b), 0, sizeof(struct mcache)*ccount);
+
     mbyte_t *bcode = mu_code_getbcode(b);
     memcpy(bcode, mu_buf_getdata(p->bcode), p->bcount);
 
     mu_dec(p->imms);
     mu_dec(p->bcode);
     mu_dec(p->scope);
+    mu_dec(p->locals);
+    mu_dec(p->captures);
+    mu_dec(p->alloc);
     mu_dec(p->m.val);
     return b;
 }
@@ -713,6 +1355,7 @@ static mu_t compile(struct mparse *p, bool weak) {
 static void s_block(struct mparse *p, struct mframe *f);
 static void s_expr(struct mparse *p, struct mframe *f, muintq_t prec);
 static void s_frame(struct mparse *p, struct mframe *f, bool update);
+static bool s_args(struct mparse *p);
 
 static void s_block(struct mparse *p, struct mframe *f) {
     muintq_t depth = p->l.paren;
@@ -728,9 +1371,18 @@ static void s_block(struct mparse *p, struct mframe *f) {
 }
 
 static void s_expr(struct mparse *p, struct mframe *f, muintq_t prec) {
-    while (match(p, T_LPAREN)) {}
+    bool operand = false;
+    // parenthesized operands are scanned on their own, so operators
+    // inside are not mistaken for the last operator applied
+    if (match(p, T_LPAREN)) {
+        muintq_t depth = p->l.depth; p->l.depth = p->l.paren;
+        s_expr(p, f, -1);
+        p->l.depth = depth;
+        match(p, T_RPAREN);
+        operand = true;
+    }
 
-    while (true) {
+    for (;; operand = true) {
         if (match(p, T_LPAREN)) {
             muintq_t depth = p->l.paren;
             while (p->l.paren >= depth && match(p, T_ANY)) {}
@@ -748,8 +1400,9 @@ static void s_expr(struct mparse *p, struct mframe *f, muintq_t prec) {
         } else if (match(p, T_SYM | T_NIL | T_IMM | T_DOT | T_ARROW)) {
             f->call = false;
 
-        } else if (prec > p->l.prec && match(p, T_ANY_OP)) {
-            bool call = next(p, T_EXPR);
+        } else if ((!operand || prec > p->l.prec) && match(p, T_ANY_OP)) {
+            mop_t op = arith(p, p->m.val, operand ? 2 : 1);
+            bool call = next(p, T_EXPR) && !op;
             s_expr(p, f, p->m.prec);
             f->call = call;
 
@@ -803,7 +1456,25 @@ static void s_frame(struct mparse *p, struct mframe *f, bool update) {
 }
 
 
+static bool s_args(struct mparse *p) {
+    struct mlex l = lex_inc(p->l);
+    muint_t count = 0;
+
+    bool simple = match(p, T_LPAREN);
+    while (simple && !match(p, T_RPAREN)) {
+        simple = match(p, T_SYM) && ++count <= MU_FRAME &&
+                 (next(p, T_RPAREN) || match(p, T_SEP));
+    }
+
+    lex_dec(p->l);
+    p->l = l;
+    return simple;
+}
+
+
 //// Grammar rules ////
+static void p_args(struct mparse *p);
+static void p_regargs(struct mparse *p, struct mparse *a);
 static void p_fn(struct mparse *p, bool weak);
 static void p_if(struct mparse *p, bool expr);
 static void p_while(struct mparse *p);
@@ -818,7 +1489,66 @@ static void p_return(struct mparse *p);
 static void p_stmt(struct mparse *p);
 static void p_block(struct mparse *p, bool root);
 
+static void p_args(struct mparse *p) {
+    expect(p, T_LPAREN);
+    struct mframe f = {.unpack = true, .insert = true};
+    s_frame(p, &f, false);
+    p->sp = f.tabled ? 1 : f.count;
+    p->args = f.tabled ? 0xf : f.count;
+    p_frame(p, &f);
+    expect(p, T_RPAREN);
+}
+
+static void p_regargs(struct mparse *p, struct mparse *a) {
+    // Arguments are left in the registers they are passed in,
+    // other uncaptured locals are assigned the following registers
+    mu_t args[MU_FRAME];
+    expect(p, T_LPAREN);
+    while (!match(p, T_RPAREN)) {
+        expect(p, T_SYM);
+        args[p->args] = mu_inc(p->m.val);
+        if (!mu_tbl_lookup(a->captures, mu_inc(p->m.val))) {
+            mu_tbl_insert(p->alloc, mu_inc(p->m.val),
+                    mu_num_fromuint(p->args+1));
+        }
+
+        p->args++;
+        match(p, T_SEP);
+    }
+
+    p->base = p->args;
+    mu_t k, v;
+    for (muint_t i = 0; mu_tbl_next(a->locals, &i, &k, &v);) {
+        if (p->base + a->regs < MU_REGS &&
+            !mu_tbl_lookup(p->alloc, mu_inc(k)) &&
+            !mu_tbl_lookup(a->captures, mu_inc(k))) {
+            p->base++;
+            mu_tbl_insert(p->alloc, k, mu_num_fromuint(p->base));
+        } else {
+            mu_dec(k);
+        }
+    }
+
+    p->sp = p->base;
+    p->regs = p->base+1;
+
+    // Captured arguments still need to be moved into the scope
+    for (muint_t i = 0; i < p->args; i++) {
+        if (!scopecheck(p, args[i], true)) {
+            encode(p, MU_OP_IMM, p->sp+1, imm(p, mu_inc(args[i])), 0, +1);
+            encode(p, MU_OP_INSERT, i+1, 0, p->sp, -1);
+        }
+
+        mu_dec(args[i]);
+    }
+}
+
 static void p_fn(struct mparse *p, bool weak) {
+    // Functions are parsed in two passes. The first pass compiles all
+    // locals into the scope and finds which locals are captured by nested
+    // functions. If the enclosing function is not being analyzed, the
+    // second pass stores the uncaptured locals in registers, so a scope
+    // only needs to be created if a local is actually captured.
     struct mparse q = {
         .bcode = mu_buf_create(0),
         .bcount = 0,
@@ -829,20 +1559,55 @@ static void p_fn(struct mparse *p, bool weak) {
         .cchain = -1,
         .regs = 1,
 
-        .l = p->l,
-    };
+        .locals = mu_tbl_create(0),
+        .captures = mu_tbl_create(0),
+        .parent = p,
+        .analysis = true,
 
-    expect(&q, T_LPAREN);
-    struct mframe f = {.unpack = true, .insert = true};
-    s_frame(&q, &f, false);
-    q.sp = f.tabled ? 1 : f.count;
-    q.args = f.tabled ? 0xf : f.count;
-    p_frame(&q, &f);
-    expect(&q, T_RPAREN);
+        .l = lex_inc(p->l),
+    };
 
+    bool regargs = s_args(&q);
+    p_args(&q);
     p_stmt(&q);
     encode(&q, MU_OP_RET, 0, 0, 0, 0);
 
+    if (!p->analysis) {
+        struct mparse r = {
+            .bcode = mu_buf_create(0),
+            .bcount = 0,
+
+            .scope = mu_tbl_createtail(0, mu_inc(p->scope)),
+            .imms = mu_tbl_create(0),
+            .bchain = -1,
+            .cchain = -1,
+            .regs = 1,
+
+            .locals = mu_tbl_create(0),
+            .captures = mu_tbl_create(0),
+            .alloc = mu_tbl_create(0),
+            .parent = p,
+
+            .l = p->l,
+        };
+
+        if (regargs && q.args + q.regs <= MU_REGS) {
+            p_regargs(&r, &q);
+        } else {
+            p_args(&r);
+        }
+
+        p_stmt(&r);
+        encdrop(&r);
+        encode(&r, MU_OP_RET, 0, 0, 0, 0);
+
+        lex_dec(q.l);
+        mu_dec(compile(&q, weak));
+        q = r;
+    } else {
+        lex_dec(p->l);
+    }
+
     p->l = q.l;
 
     mu_t c = compile(&q, weak);
@@ -918,8 +1683,7 @@ static void p_for(struct mparse *p) {
     expect(p, T_ASSIGN);
     mu_checkassign(f.count != 0 || f.tabled, &p->l);
 
-    encode(p, MU_OP_IMM, p->sp+1, imm(p, MU_ITER_KEY), 0, +1);
-    encode(p, MU_OP_LOOKUP, p->sp, 0, p->sp, 0);
+    encname(p, p->sp+1, MU_ITER_KEY, +1);
     p_expr(p);
     encode(p, MU_OP_CALL, p->sp-1, 0x11, 0, -1);
 
@@ -994,14 +1758,21 @@ static void p_subexpr(struct mparse *p, struct mexpr *e) {
 
     } else if (lookahead(p, T_ANY_OP, T_EXPR)) {
         scopecheck(p, p->m.val, false);
-        encode(p, MU_OP_IMM, p->sp+1, imm(p, mu_inc(p->m.val)), 0, +1);
-        encode(p, MU_OP_LOOKUP, p->sp, 0, p->sp, 0);
+        mop_t op = arith(p, p->m.val, 1);
+        if (!op) {
+            encname(p, p->sp+1, mu_inc(p->m.val), +1);
+        }
         muintq_t prec = e->prec; e->prec = p->m.prec;
         p_subexpr(p, e);
         e->prec = prec;
         encload(p, e, 0);
-        e->state = P_CALLED;
-        e->params = 1;
+        if (op) {
+            encode(p, op, p->sp, 0, 0, 0);
+            e->state = P_DIRECT;
+        } else {
+            e->state = P_CALLED;
+            e->params = 1;
+        }
         p_postexpr(p, e);
 
     } else if (match(p, T_FN)) {
@@ -1024,9 +1795,7 @@ static void p_subexpr(struct mparse *p, struct mexpr *e) {
         p_postexpr(p, e);
 
     } else if (match(p, T_SYM | T_ANY_OP)) {
-        scopecheck(p, p->m.val, e->insert);
-        encode(p, MU_OP_IMM, p->sp+1, imm(p, mu_inc(p->m.val)), 0, +1);
-        e->state = P_SCOPED;
+        encsym(p, e, p->m.val);
         p_postexpr(p, e);
 
     } else {
@@ -1084,23 +1853,31 @@ static void p_postexpr(struct mparse *p, struct mexpr *e) {
         encload(p, e, 2);
         encode(p, MU_OP_IMM, p->sp-1, imm(p, sym), 0, 0);
         encode(p, MU_OP_LOOKUP, p->sp-1, p->sp, p->sp-1, 0);
-        encode(p, MU_OP_IMM, p->sp-2, imm(p, MU_BIND_KEY), 0, 0);
-        encode(p, MU_OP_LOOKUP, p->sp-2, 0, p->sp-2, 0);
+        encname(p, p->sp-2, MU_BIND_KEY, 0);
         encode(p, MU_OP_CALL, p->sp-2, 0x21, 0, -2);
         e->state = P_DIRECT;
         p_postexpr(p, e);
 
     } else if (e->prec > p->l.prec && match(p, T_ANY_OP)) {
-        encload(p, e, 1);
         scopecheck(p, p->m.val, false);
-        encode(p, MU_OP_IMM, p->sp-1, imm(p, mu_inc(p->m.val)), 0, 0);
-        encode(p, MU_OP_LOOKUP, p->sp-1, 0, p->sp-1, 0);
+        mop_t op = arith(p, p->m.val, 2);
+        if (op) {
+            encload(p, e, 0);
+        } else {
+            encload(p, e, 1);
+            encname(p, p->sp-1, mu_inc(p->m.val), 0);
+        }
         muintq_t prec = e->prec; e->prec = p->m.prec;
         p_subexpr(p, e);
         encload(p, e, 0);
         e->prec = prec;
-        e->state = P_CALLED;
-        e->params = 2;
+        if (op) {
+            encode(p, op, p->sp-1, p->sp, 0, -1);
+            e->state = P_DIRECT;
+        } else {
+            e->state = P_CALLED;
+            e->params = 2;
+        }
         p_postexpr(p, e);
 
     } else if (e->prec > p->l.prec && match(p, T_AND)) {
@@ -1118,8 +1895,11 @@ static void p_postexpr(struct mparse *p, struct mexpr *e) {
 
     } else if (e->prec > p->l.prec && match(p, T_OR)) {
         encload(p, e, 0);
+        mlen_t falsy = p->bcount;
+        encode(p, MU_OP_JFALSE, p->sp, 0, 0, 0);
         mlen_t offset = p->bcount;
-        encode(p, MU_OP_JTRUE, p->sp, 0, 0, -1);
+        encode(p, MU_OP_JUMP, 0, 0, 0, -1);
+        patch(p, falsy, p->bcount - falsy);
         muintq_t prec = e->prec; e->prec = p->m.prec;
         p_subexpr(p, e);
         encload(p, e, 0);
@@ -1158,15 +1938,15 @@ static void p_entry(struct mparse *p, struct mframe *f) {
         } else if (f->unpack) {
             encload(p, &e, 0);
             encode(p, f->count == f->target-1 ? MU_OP_LOOKDN : MU_OP_LOOKUP,
-                    p->sp, p->sp-1, p->sp,
+                    f->count == f->target-1 ? p->sp-1 : p->sp,
+                    p->sp-1, p->sp,
                     f->count == f->target-1 ? -1 : 0);
         } else {
             encload(p, &e, 0);
         }
 
         if (f->key && !next(p, T_EXPR)) {
-            encode(p, MU_OP_IMM, p->sp+1, imm(p, mu_inc(p->m.val)), 0, +1);
-            e.state = P_SCOPED;
+            encsym(p, &e, p->m.val);
         } else if (!(f->unpack && next(p, T_LTABLE))) {
             p_subexpr(p, &e);
         }
@@ -1174,8 +1954,7 @@ static void p_entry(struct mparse *p, struct mframe *f) {
         f->key = true;
     } else if (f->tabled) {
         if (f->unpack && f->expand) {
-            encode(p, MU_OP_IMM, p->sp+1, imm(p, MU_POP_KEY), 0, +1);
-            encode(p, MU_OP_LOOKUP, p->sp, 0, p->sp, 0);
+            encname(p, p->sp+1, MU_POP_KEY, +1);
             encode(p, MU_OP_DUP, p->sp+1, p->sp-1-offset(&e), 0, +1);
             encode(p, MU_OP_IMM, p->sp+1,
                     imm(p, mu_num_fromuint(f->index)), 0, +1);
@@ -1264,8 +2043,7 @@ static void p_frame(struct mparse *p, struct mframe *f) {
             p->sp -= 1;
         } else if (f->count > 0) {
             encode(p, MU_OP_MOVE, p->sp+1, p->sp, 0, +1);
-            encode(p, MU_OP_IMM, p->sp-1, imm(p, MU_CONCAT_KEY), 0, 0);
-            encode(p, MU_OP_LOOKUP, p->sp-1, 0, p->sp-1, 0);
+            encname(p, p->sp-1, MU_CONCAT_KEY, 0);
             p_expr(p);
             encode(p, MU_OP_IMM, p->sp+1,
                     imm(p, mu_num_fromuint(f->index)), 0, +1);
@@ -1346,7 +2124,7 @@ static void p_assign(struct mparse *p, bool insert) {
 static void p_return(struct mparse *p) {
     // Remove any leftover iterators
     muintq_t sp = p->sp;
-    while (p->sp != 0) {
+    while (p->sp != p->base) {
         encode(p, MU_OP_DROP, p->sp, 0, 0, -1);
     }
 
@@ -1356,12 +2134,14 @@ static void p_return(struct mparse *p) {
     if (f.call) {
         struct mexpr e = {.prec = -1};
         p_subexpr(p, &e);
+        encdrop(p);
         encode(p, MU_OP_TCALL,
                p->sp - (e.params == 0xf ? 1 : e.params),
                e.params, 0,
                -(e.params == 0xf ? 1 : e.params)-1);
     } else {
         p_frame(p, &f);
+        encdrop(p);
         encode(p, MU_OP_RET,
                p->sp - (f.tabled ? 0 : f.count-1),
                f.tabled ? 0xf : f.count, 0,
@@ -1378,10 +2158,17 @@ static void p_stmt(struct mparse *p) {
     } else if (lookahead(p, T_FN, T_ANY_SYM | T_ANY_OP)) {
         expect(p, T_ANY_SYM | T_ANY_OP);
         mu_t sym = mu_inc(p->m.val);
-        scopecheck(p, sym, true);
-        p_fn(p, true);
-        encode(p, MU_OP_IMM, p->sp+1, imm(p, sym), 0, +1);
-        encode(p, MU_OP_INSERT, p->sp-1, 0, p->sp, -2);
+        muintq_t reg = scopecheck(p, sym, true);
+        p_fn(p, !reg);
+
+        if (reg) {
+            mu_dec(sym);
+            encode(p, MU_OP_DROP, reg, 0, 0, 0);
+            encode(p, MU_OP_MOVE, reg, p->sp, 0, -1);
+        } else {
+            encode(p, MU_OP_IMM, p->sp+1, imm(p, sym), 0, +1);
+            encode(p, MU_OP_INSERT, p->sp-1, 0, p->sp, -2);
+        }
 
     } else if (match(p, T_IF)) {
         p_if(p, false);
@@ -1535,6 +2322,9 @@ mu_t mu_compilen(const mbyte_t **pos, const mbyte_t *end, mu_t scope) {
         .bchain = -1,
         .cchain = -1,
         .regs = 1,
+
+        .locals = mu_tbl_create(0),
+        .captures = mu_tbl_create(0),
     };
 
     lex_init(&p.l, *pos, end);
@@ -1554,6 +2344,9 @@ mu_t mu_compile(const char *s, muint_t n, mu_t scope) {
         .bchain = -1,
         .cchain = -1,
         .regs = 1,
+
+        .locals = mu_tbl_create(0),
+        .captures = mu_tbl_create(0),
     };
 
     lex_init(&p.l, (const mbyte_t *)s, (const mbyte_t *)s+n);
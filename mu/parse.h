@@ -21,6 +21,11 @@ mu_t mu_parse(const char *s, muint_t n);
 mu_t mu_compilen(const mbyte_t **s, const mbyte_t *end, mu_t scope);
 mu_t mu_compile(const char *s, muint_t n, mu_t scope);
 
+// Sets the optimization level of compiled code
+// 0 disables optimization, defaults to 2, and levels
+// past 2 are the same as 2
+void mu_setoptimize(muint_t level);
+
 
 // Language keywords
 #define MU_KEYWORDS     mu_keywords_def()
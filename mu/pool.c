@@ -0,0 +1,507 @@
+/*
+ * Worker pool for parallel map and filter
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license in mu.h
+ */
+#define _POSIX_C_SOURCE 200112L
+#include "mu.h"
+
+// The profiler records into process-wide tables, so
+// profiled builds run everything on the calling thread
+#if !defined(MU_NO_THREADS) && !defined(MU_PROF)
+#define MU_POOL
+#endif
+
+#ifdef MU_POOL
+#include <setjmp.h>
+#include <pthread.h>
+#endif
+
+
+// Copying values between states
+//
+// Values can not be referenced from another state, so values are
+// copied into the current state while the state that owns them is
+// not running. The original is only read, its references are left
+// untouched. Constants are shared by every state and never copied.
+//
+// Copies are recorded in a memo table keyed by the address of the
+// original, which keeps shared structure and cycles intact.
+static mu_t mu_pool_copy(mu_t m, mu_t memo);
+
+static mu_t mu_pool_copytbl(mu_t m, mu_t key, mu_t memo) {
+    struct mtbl *t = (struct mtbl *)(~7 & (muint_t)m);
+    mu_t c = mu_tbl_create(t->len);
+    mu_tbl_insert(memo, key, mu_inc(c));
+
+    if (t->tail) {
+        mu_tbl_settail(c, mu_pool_copy(t->tail, memo));
+    }
+
+    mu_t k, v;
+    for (muint_t i = 0; mu_tbl_peek(m, &i, &k, &v);) {
+        mu_tbl_insert(c, mu_pool_copy(k, memo), mu_pool_copy(v, memo));
+    }
+
+    return c;
+}
+
+// Names used by code, including any nested code and operators
+static void mu_pool_names(mu_t code, mu_t names) {
+    const uint16_t *bcode = mu_code_getbcode(code);
+    muint_t count = mu_code_getbcodelen(code) / 2;
+    for (muint_t pc = 0; pc < count;) {
+        mop_t op;
+        mint_t d, a, b;
+        pc += mu_decode(&bcode[pc], &op, &d, &a, &b);
+        if (op >= MU_OP_ADD && op <= MU_OP_NOT) {
+            mu_tbl_insert(names, mu_arith_key(op), MU_TRUE);
+        }
+    }
+
+    mu_t *imms = mu_code_getimms(code);
+    for (muint_t i = 0; i < mu_code_getimmslen(code); i++) {
+        if (mu_isstr(imms[i])) {
+            mu_tbl_insert(names, mu_inc(imms[i]), MU_TRUE);
+        } else if (mu_iscode(imms[i])) {
+            mu_pool_names(imms[i], names);
+        }
+    }
+}
+
+// Closures are usually the scope a function was declared in, so
+// only variables the function can name are copied along with it.
+// Copied scopes are read-only, since assigning to the copy would
+// be silently lost, and raise an error instead
+static mu_t mu_pool_copyscope(mu_t m, mu_t names, mu_t memo) {
+    if (!m || mu_getref(m) == 0) {
+        return m;
+    }
+
+    struct mtbl *t = (struct mtbl *)(~7 & (muint_t)m);
+    mu_t c = mu_tbl_create(0);
+
+    if (t->tail) {
+        mu_tbl_settail(c, mu_pool_copyscope(t->tail, names, memo));
+    }
+
+    mu_t k, v;
+    for (muint_t i = 0; mu_tbl_peek(m, &i, &k, &v);) {
+        if (!mu_isstr(k)) {
+            continue;
+        }
+
+        k = mu_str_fromdata(mu_str_getdata(k), mu_str_getlen(k));
+        mu_t named = mu_tbl_lookup(names, mu_inc(k));
+        if (named) {
+            mu_tbl_insert(c, k, mu_pool_copy(v, memo));
+        } else {
+            mu_dec(k);
+        }
+    }
+
+    mu_t r = mu_tbl_const(c);
+    mu_dec(c);
+    return r;
+}
+
+static mu_t mu_pool_copyfn(mu_t m, mu_t key, mu_t memo) {
+    struct mfn *f = (struct mfn *)((muint_t)m - MTFN);
+    mu_t c;
+    mu_t closure;
+
+    if (!(f->flags & MU_FN_BUILTIN)) {
+        // the scope is copied along with the function,
+        // so the closure is no longer kept alive elsewhere
+        mu_t code = mu_code_copy(f->fn.code);
+        ((struct mcode *)mu_buf_getdata(code))->flags &= ~MU_FN_WEAK;
+        c = mu_fn_fromcode(code, 0);
+        mu_tbl_insert(memo, key, mu_inc(c));
+
+        mu_t names = mu_tbl_create(0);
+        mu_pool_names(code, names);
+        closure = mu_pool_copyscope(f->closure, names, memo);
+        mu_dec(names);
+    } else if (f->flags & MU_FN_SCOPED) {
+        c = mu_fn_fromsbfn(f->args, f->fn.sbfn, 0);
+        mu_tbl_insert(memo, key, mu_inc(c));
+        closure = mu_pool_copy(f->closure, memo);
+    } else {
+        c = mu_fn_frombfn(f->args, f->fn.bfn);
+        mu_tbl_insert(memo, key, mu_inc(c));
+        return c;
+    }
+
+    ((struct mfn *)((muint_t)c - MTFN))->closure = closure;
+    return c;
+}
+
+static mu_t mu_pool_copy(mu_t m, mu_t memo) {
+    extern void mu_code_destroylazy(mu_t);
+
+    if (!mu_isref(m) || mu_getref(m) == 0) {
+        return m;
+    } else if (mu_isstr(m)) {
+        return mu_str_fromdata(mu_str_getdata(m), mu_str_getlen(m));
+    }
+
+    mu_t key = mu_num_fromuint(~7 & (muint_t)m);
+    mu_t c = mu_tbl_lookup(memo, key);
+    if (!c) {
+        switch (mu_gettype(m)) {
+            case MTBUF:
+                c = mu_buf_fromdata(mu_buf_getdata(m), mu_buf_getlen(m));
+                mu_tbl_insert(memo, key, mu_inc(c));
+                break;
+
+            case MTDBUF:
+                if (!mu_iscode(m) && !mu_isdtor(m, mu_code_destroylazy)) {
+                    mu_errorf("unable to copy buffer between states");
+                }
+
+                c = mu_code_copy(m);
+                mu_tbl_insert(memo, key, mu_inc(c));
+                break;
+
+            case MTTBL:
+            case MTRTBL:
+                c = mu_pool_copytbl(m, key, memo);
+                break;
+
+            case MTFN:
+                c = mu_pool_copyfn(m, key, memo);
+                break;
+
+            default:
+                mu_unreachable;
+        }
+    }
+
+    if (mu_gettype(m) == MTRTBL) {
+        mu_t r = mu_tbl_const(c);
+        mu_dec(c);
+        return r;
+    }
+
+    return c;
+}
+
+
+// Applies a function to the elements of a table between two
+// iteration positions, appending results from index zero.
+// With a memo the table belongs to another state and elements
+// are copied first. Returns the number of results.
+static muint_t mu_pool_apply(mu_t f, mu_t t, muint_t lower, muint_t upper,
+                             bool filter, mu_t result, mu_t memo) {
+    mu_t frame[MU_FRAME];
+    muint_t count = 0;
+    muint_t i = lower;
+    mu_t v;
+
+    while (mu_tbl_peek(t, &i, 0, &v) && i <= upper) {
+        v = memo ? mu_pool_copy(v, memo) : mu_inc(v);
+
+        if (!filter) {
+            frame[0] = v;
+            mu_fn_fcall(f, 0x11, frame);
+            mu_tbl_insert(result, mu_num_fromuint(count++), frame[0]);
+        } else {
+            frame[0] = mu_inc(v);
+            mu_fn_fcall(f, 0x11, frame);
+            if (frame[0]) {
+                mu_dec(frame[0]);
+                mu_tbl_insert(result, mu_num_fromuint(count++), v);
+            } else {
+                mu_dec(v);
+            }
+        }
+    }
+
+    return count;
+}
+
+
+// Worker pool
+//
+// Workers are started on first use and each run in their own state.
+// Calls are serialized, and the elements of the table are split
+// into contiguous chunks, one per worker. Each worker copies the
+// function and its chunk into its state, and once every worker is
+// done the results are copied back in order. Workers release their
+// results afterwards, so nothing is shared while either side runs.
+//
+// Functions called by workers see a read-only copy of their
+// closure, so assigning to variables outside the function is an
+// error rather than a change the caller never sees. Tables too
+// small to split are run by the caller on the same kind of copies.
+#ifdef MU_POOL
+struct mworker {
+    pthread_t thread;
+    struct mstate *state;
+    bool active;
+
+    // job, owned by the calling state
+    mu_t fn;
+    mu_t tbl;
+    muint_t lower;
+    muint_t upper;
+    bool filter;
+
+    // results, owned by the worker's state
+    mu_t memo;
+    mu_t result;
+    muint_t count;
+    mu_t error;
+};
+
+static struct mpool {
+    pthread_mutex_t call;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    muint_t gen;
+    muint_t pending;
+    bool release;
+
+    bool started;
+    muint_t size;
+    struct mworker workers[MU_POOL_SIZE];
+} mu_pool = {
+    .call = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static mu_thread bool mu_pool_isworker = false;
+
+// Errors are caught while values of another state are involved
+static mu_thread jmp_buf *mu_pool_jmp = 0;
+static mu_thread mu_t mu_pool_msg = 0;
+
+static void mu_pool_error(const char *s, muint_t n) {
+    mu_pool_msg = mu_str_fromdata(s, n);
+    longjmp(*mu_pool_jmp, 1);
+}
+
+static void mu_pool_job(struct mworker *w, bool release) {
+    if (release) {
+        mu_dec(w->memo);
+        mu_dec(w->result);
+        mu_dec(w->error);
+        w->memo = 0;
+        w->result = 0;
+        w->error = 0;
+        mu_collect();
+        return;
+    }
+
+    jmp_buf jmp;
+    mu_pool_jmp = &jmp;
+    if (setjmp(jmp)) {
+        w->error = mu_pool_msg;
+        mu_pool_msg = 0;
+        return;
+    }
+
+    w->memo = mu_tbl_create(0);
+    w->result = mu_tbl_create(0);
+
+    // the copied function is kept alive by the memo
+    mu_t f = mu_pool_copy(w->fn, w->memo);
+    mu_dec(f);
+
+    w->count = mu_pool_apply(f, w->tbl, w->lower, w->upper,
+            w->filter, w->result, w->memo);
+}
+
+static void *mu_pool_main(void *p) {
+    struct mworker *w = p;
+    mu_setstate(w->state);
+    mu_state->error = mu_pool_error;
+    mu_pool_isworker = true;
+    muint_t gen = 0;
+
+    pthread_mutex_lock(&mu_pool.lock);
+    while (true) {
+        while (mu_pool.gen == gen) {
+            pthread_cond_wait(&mu_pool.start, &mu_pool.lock);
+        }
+
+        gen = mu_pool.gen;
+        if (!w->active) {
+            continue;
+        }
+
+        bool release = mu_pool.release;
+        pthread_mutex_unlock(&mu_pool.lock);
+        mu_pool_job(w, release);
+        pthread_mutex_lock(&mu_pool.lock);
+
+        mu_pool.pending -= 1;
+        if (mu_pool.pending == 0) {
+            pthread_cond_signal(&mu_pool.done);
+        }
+    }
+
+    return 0;
+}
+
+static void mu_pool_start(void) {
+    mu_pool.started = true;
+
+    for (muint_t i = 0; i < MU_POOL_SIZE; i++) {
+        struct mworker *w = &mu_pool.workers[i];
+        w->state = mu_state_create();
+
+        if (pthread_create(&w->thread, 0, mu_pool_main, w) != 0) {
+            mu_state_destroy(w->state);
+            w->state = 0;
+            break;
+        }
+
+        pthread_detach(w->thread);
+        mu_pool.size += 1;
+    }
+}
+
+// Runs the active workers and waits for them to finish
+static void mu_pool_wait(bool release, muint_t active) {
+    pthread_mutex_lock(&mu_pool.lock);
+    mu_pool.release = release;
+    mu_pool.pending = active;
+    mu_pool.gen += 1;
+    pthread_cond_broadcast(&mu_pool.start);
+
+    while (mu_pool.pending > 0) {
+        pthread_cond_wait(&mu_pool.done, &mu_pool.lock);
+    }
+
+    pthread_mutex_unlock(&mu_pool.lock);
+}
+
+// Returns false if the pool could not be used
+static bool mu_pool_run(mu_t f, mu_t t, muint_t count, muint_t active,
+                        bool filter, mu_t result) {
+    pthread_mutex_lock(&mu_pool.call);
+    if (!mu_pool.started) {
+        mu_pool_start();
+    }
+
+    active = (active < mu_pool.size) ? active : mu_pool.size;
+    if (active < 2) {
+        pthread_mutex_unlock(&mu_pool.call);
+        return false;
+    }
+
+    for (muint_t i = 0; i < mu_pool.size; i++) {
+        struct mworker *w = &mu_pool.workers[i];
+        w->active = i < active;
+        w->fn = f;
+        w->tbl = t;
+        w->lower = count*i / active;
+        w->upper = count*(i+1) / active;
+        w->filter = filter;
+    }
+
+    mu_pool_wait(false, active);
+
+    // errors are caught until the workers have released their results
+    struct mstate *s = mu_state;
+    void (*error)(const char *, muint_t) = s->error;
+    mu_t memo = mu_tbl_create(0);
+    jmp_buf jmp;
+    mu_pool_jmp = &jmp;
+    s->error = mu_pool_error;
+
+    if (!setjmp(jmp)) {
+        muint_t base = 0;
+        for (muint_t i = 0; i < active; i++) {
+            struct mworker *w = &mu_pool.workers[i];
+            if (w->error) {
+                mu_pool_msg = mu_pool_copy(w->error, memo);
+                break;
+            }
+
+            mu_t k, v;
+            for (muint_t j = 0; mu_tbl_peek(w->result, &j, &k, &v);) {
+                mu_tbl_insert(result,
+                        mu_num_fromuint(base + mu_num_getuint(k)),
+                        mu_pool_copy(v, memo));
+            }
+
+            base += w->count;
+        }
+    }
+
+    s->error = error;
+    mu_dec(memo);
+    mu_pool_wait(true, active);
+    pthread_mutex_unlock(&mu_pool.call);
+
+    if (mu_pool_msg) {
+        mu_t message = mu_pool_msg;
+        mu_pool_msg = 0;
+        mu_dec(result);
+        mu_error(mu_str_getdata(message), mu_str_getlen(message));
+    }
+
+    return true;
+}
+#endif
+
+static mu_t mu_pool_map(mu_t f, mu_t t, bool filter) {
+    struct mtbl *tbl = (struct mtbl *)(~7 & (muint_t)t);
+    muint_t count = tbl->alen + tbl->hlen;
+    mu_t result = mu_tbl_create(0);
+
+#ifdef MU_POOL
+    // nested calls from workers run in the worker
+    muint_t active = count / MU_POOL_CHUNK;
+    if (!mu_pool_isworker && active > 1 &&
+            mu_pool_run(f, t, count, active, filter, result)) {
+        return result;
+    }
+#endif
+
+    // the caller runs on the same copies a worker would, so
+    // results do not depend on the size of the table or the build
+    mu_t memo = mu_tbl_create(0);
+    mu_t c = mu_pool_copy(f, memo);
+    mu_pool_apply(c, t, 0, count, filter, result, memo);
+    mu_dec(c);
+    mu_dec(memo);
+    return result;
+}
+
+
+// Parallel map and filter
+static mcnt_t mu_pmap_bfn(mu_t *frame) {
+    mu_t f = frame[0];
+    mu_t t = frame[1];
+    mu_checkargs(mu_isfn(f) && mu_istbl(t), MU_PMAP_KEY, 0x2, frame);
+
+    frame[0] = mu_pool_map(f, t, false);
+    mu_dec(f);
+    mu_dec(t);
+    return 1;
+}
+
+MU_DEF_STR(mu_pmap_key_def, "pmap")
+MU_DEF_BFN(mu_pmap_def, 0x2, mu_pmap_bfn)
+
+static mcnt_t mu_pfilter_bfn(mu_t *frame) {
+    mu_t f = frame[0];
+    mu_t t = frame[1];
+    mu_checkargs(mu_isfn(f) && mu_istbl(t), MU_PFILTER_KEY, 0x2, frame);
+
+    frame[0] = mu_pool_map(f, t, true);
+    mu_dec(f);
+    mu_dec(t);
+    return 1;
+}
+
+MU_DEF_STR(mu_pfilter_key_def, "pfilter")
+MU_DEF_BFN(mu_pfilter_def, 0x2, mu_pfilter_bfn)
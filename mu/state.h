@@ -0,0 +1,118 @@
+/*
+ * Mu states, isolated interpreters
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license in mu.h
+ */
+#ifndef MU_STATE_H
+#define MU_STATE_H
+#include "config.h"
+#include "types.h"
+
+
+// Size limits of the slab allocator, allocations up to MU_SLAB_MAX
+// are served from per size-class free lists owned by each state
+#ifdef MU_SLAB
+#define MU_SLAB_MAX   256
+#define MU_SLAB_CHUNK 4096
+#endif
+
+// Number of possible roots buffered before cycles are collected,
+// a threshold of zero disables automatic collection
+#ifndef MU_GC_THRESHOLD
+#define MU_GC_THRESHOLD 8192
+#endif
+
+// Number of worker threads used by pmap and pfilter, each running
+// in its own state, and the fewest elements worth passing to a worker
+#ifndef MU_POOL_SIZE
+#define MU_POOL_SIZE 4
+#endif
+
+#ifndef MU_POOL_CHUNK
+#define MU_POOL_CHUNK 64
+#endif
+
+
+// Set of interned strings
+struct mstrset {
+    struct mstrentry *table;
+    muint_t npw2;
+    muint_t len;
+};
+
+// Definition of Mu's interpreter state
+//
+// Each state owns the runtime data of an interpreter: interned strings,
+// the free lists of the allocator, cycle collection and imported modules.
+// Values can not be passed between states, except for the constants
+// defined with MU_DEF_*, which are shared by every state.
+//
+// The current state is thread-local. Every thread starts in the default
+// state, so threads running in parallel must each switch to their own.
+struct mstate {
+    // called on errors instead of mu_sys_error if set, must not return
+    void (*error)(const char *message, muint_t len);
+
+    // free for use by the system
+    void *data;
+
+    struct mstrset strs;
+    mu_t imports;
+
+#ifdef MU_SLAB
+    void *slabs[MU_SLAB_MAX / sizeof(muint_t)];
+#endif
+
+    struct mgcstate {
+        muint_t count;
+        muint_t threshold;
+
+        mu_t *roots;
+        muint_t rootsize;
+
+        mu_t *stack;
+        muint_t stacklen;
+        muint_t stacksize;
+
+        mu_t *white;
+        muint_t whitelen;
+        muint_t whitesize;
+
+        bool collecting;
+    } gc;
+
+    // epoch of watched tables, cached lookups from
+    // a previous epoch are invalid
+    muint_t epoch;
+};
+
+extern mu_thread struct mstate *mu_state;
+
+
+// State creation and destruction
+//
+// Destroying a state releases its bookkeeping and hands its free
+// blocks to later states, any values left in the state are invalid.
+struct mstate *mu_state_create(void);
+void mu_state_destroy(struct mstate *s);
+
+// Switches the current thread to a state, returning the previous state
+struct mstate *mu_setstate(struct mstate *s);
+
+// Process-wide lock, serializes initialization of constants and
+// the free blocks shared between states. The lock is recursive.
+void mu_state_lock(void);
+void mu_state_unlock(void);
+
+// Collects garbage cycles if enough possible roots are buffered,
+// called where new tables and functions are created
+mu_inline void mu_gc_poll(void) {
+    if (mu_state->gc.count >= mu_state->gc.threshold) {
+        extern void mu_collect(void);
+        mu_collect();
+    }
+}
+
+
+#endif
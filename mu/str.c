@@ -7,6 +7,10 @@
 #include "str.h"
 #include "mu.h"
 
+#ifdef MU_SIMD
+#include <immintrin.h>
+#endif
+
 
 #define MU_EMPTY_STR mu_empty_str()
 #define MU_SPACE_STR mu_space_str()
@@ -19,81 +23,194 @@ mu_inline struct mstr *mstr(mu_t s) {
     return (struct mstr *)((muint_t)s & ~7);
 }
 
+mu_inline struct mstrslice *mstrslice(mu_t s) {
+    return (struct mstrslice *)((muint_t)s & ~7);
+}
+
+mu_inline muint_t *mstrhash(mu_t s) {
+    return (muint_t *)(mstr(s)->data + mu_align(mstr(s)->len));
+}
+
 
 // String interning
 //
-// Currently interning is implemented using a sorted array with a
-// binary search for insertion. This was chosen for a few reasons:
+// Interning is implemented with an open-addressing hash set using
+// linear probing. This was chosen for a few reasons:
 // - We can't reuse the table's implementation since it relies
 //   on interned strings.
-// - Lower memory overhead/more cache friendly than tree
-//   or trie implementation.
-// - Strings don't need to be hashed, its possible strings won't
-//   even need to be completely scanned during comparisons on
-//   lookup/insertion.
-static mu_t *mu_str_table = 0;
-static muint_t mu_str_table_size = 0;
-static muint_t mu_str_table_len = 0;
-
-static mint_t mu_str_table_find(const mbyte_t *s, mlen_t len) {
-    mint_t min = 0;
-    mint_t max = mu_str_table_len-1;
-
-    // binary search for existing strings
-    // strings are sorted first by length to avoid comparisons
-    while (min <= max) {
-        mint_t mid = (max + min) / 2;
-        mint_t cmp = len > mu_str_getlen(mu_str_table[mid]) ? +1 :
-                     len < mu_str_getlen(mu_str_table[mid]) ? -1 :
-                     memcmp(s, mu_str_getdata(mu_str_table[mid]), len);
-
-        if (cmp == 0) {
-            return mid;
-        } else if (cmp < 0) {
-            max = mid-1;
-        } else {
-            min = mid+1;
+// - Insertion, lookup and removal are O(1) on average, where a
+//   sorted array needs a memmove of the tail for every new string.
+// - Each slot caches the hash of its string next to the reference,
+//   so probes only compare string data when the full hashes match.
+// - Strings also keep their hash after their data, where buffers keep
+//   their destructor, so strings are never rehashed once interned.
+// - Removal uses backward shifting, so no tombstones build up
+//   under the heavy churn of transient strings.
+struct mstrentry {
+    muint_t hash;
+    mu_t s;
+};
+
+// Each state interns its own strings. Constants are shared by every
+// state, so they are interned in a separate set, which is checked
+// before strings are added to the state's set. Constants are only
+// added under the state lock, and are read without it. Entries are
+// published by storing their hash after their string, and the set is
+// replaced by a larger copy instead of growing in place. Replaced
+// copies are never released, since other threads may still read them.
+static struct mstrset *mu_str_consts = 0;
+
+static muint_t mu_str_hash(const mbyte_t *s, mlen_t len) {
+    // FNV-1a, folded to the word size
+    muint_t hash = (muint_t)2166136261u;
+    for (muint_t i = 0; i < len; i++) {
+        hash = (hash ^ s[i]) * (muint_t)16777619u;
+    }
+
+    // zero is reserved for empty slots
+    return hash ? hash : 1;
+}
+
+static muint_t mu_str_table_find(struct mstrset *set,
+                                 const mbyte_t *s, mlen_t len,
+                                 muint_t hash) {
+    muint_t mask = ((muint_t)1 << set->npw2) - 1;
+
+    for (muint_t i = hash & mask;; i = (i+1) & mask) {
+        struct mstrentry *e = &set->table[i];
+
+        if (!e->hash || (e->hash == hash &&
+                         mu_str_getlen(e->s) == len &&
+                         memcmp(s, mu_str_getdata(e->s), len) == 0)) {
+            return i;
         }
     }
+}
+
+// Doubles the size of a set, returning the old table without releasing it
+static struct mstrentry *mu_str_table_grow(struct mstrset *set) {
+    muint_t npw2 = set->npw2 ? set->npw2 + 1 :
+                   mu_npw2(MU_MINALLOC / sizeof(struct mstrentry));
+    struct mstrentry *ntable = mu_alloc(
+            ((muint_t)1 << npw2) * sizeof(struct mstrentry));
+    memset(ntable, 0, ((muint_t)1 << npw2) * sizeof(struct mstrentry));
+
+    struct mstrentry *otable = set->table;
+    muint_t onpw2 = set->npw2;
+    set->table = ntable;
+    set->npw2 = npw2;
+
+    if (otable) {
+        muint_t mask = ((muint_t)1 << npw2) - 1;
+
+        for (muint_t j = 0; j < ((muint_t)1 << onpw2); j++) {
+            if (!otable[j].hash) {
+                continue;
+            }
 
-    // Use inverted values to indicate not found but where to
-    // insert since 0 is valid in both cases
-    return ~min;
+            muint_t i = otable[j].hash & mask;
+            while (ntable[i].hash) {
+                i = (i+1) & mask;
+            }
+
+            ntable[i] = otable[j];
+        }
+    }
+
+    return otable;
 }
 
-static void mu_str_table_insert(mint_t i, mu_t s) {
-    // expand the table if necessary
-    if (mu_str_table_len == mu_str_table_size) {
-        muint_t nsize;
-        mu_t *ntable;
+static void mu_str_table_expand(struct mstrset *set) {
+    muint_t onpw2 = set->npw2;
+    struct mstrentry *otable = mu_str_table_grow(set);
+    if (otable) {
+        mu_dealloc(otable, ((muint_t)1 << onpw2) * sizeof(struct mstrentry));
+    }
+}
 
-        if (mu_str_table_size == 0) {
-            nsize = MU_MINALLOC / sizeof(mu_t);
-        } else {
-            nsize = mu_str_table_size << 1;
+static void mu_str_table_insert(struct mstrset *set,
+                                muint_t i, muint_t hash, mu_t s) {
+    set->table[i].hash = hash;
+    set->table[i].s = s;
+    set->len += 1;
+
+    // keep load factor under 3/4, this invalidates indices
+    if (set->len > 3*((muint_t)1 << set->npw2)/4) {
+        mu_str_table_expand(set);
+    }
+}
+
+static void mu_str_table_remove(struct mstrset *set, muint_t i) {
+    muint_t mask = ((muint_t)1 << set->npw2) - 1;
+    set->len -= 1;
+
+    // shift back any entries that probed past the removed slot
+    for (muint_t j = (i+1) & mask; set->table[j].hash; j = (j+1) & mask) {
+        muint_t k = set->table[j].hash & mask;
+
+        if ((j > i && (k <= i || k > j)) ||
+            (j < i && (k <= i && k > j))) {
+            set->table[i] = set->table[j];
+            i = j;
         }
+    }
 
-        ntable = mu_alloc(nsize * sizeof(mu_t));
-        memcpy(ntable, mu_str_table, i * sizeof(mu_t));
-        memcpy(&ntable[i+1], &mu_str_table[i],
-               (mu_str_table_len-i) * sizeof(mu_t));
-        mu_dealloc(mu_str_table, mu_str_table_size * sizeof(mu_t));
+    set->table[i].hash = 0;
+    set->table[i].s = 0;
+}
 
-        mu_str_table = ntable;
-        mu_str_table_size = nsize;
-    } else {
-        memmove(&mu_str_table[i+1], &mu_str_table[i],
-                (mu_str_table_len-i) * sizeof(mu_t));
+mu_inline muint_t mu_str_table_lookup(struct mstrset *set,
+                                      const mbyte_t *s, mlen_t len,
+                                      muint_t hash) {
+    if (!set->table) {
+        mu_str_table_expand(set);
     }
 
-    mu_str_table[i] = s;
-    mu_str_table_len += 1;
+    return mu_str_table_find(set, s, len, hash);
 }
 
-static void mu_str_table_remove(mint_t i) {
-    mu_str_table_len -= 1;
-    memmove(&mu_str_table[i], &mu_str_table[i+1],
-            (mu_str_table_len-i) * sizeof(mu_t));
+// Finds a constant string, returns nil if none exists
+static mu_t mu_str_const(const mbyte_t *s, mlen_t len, muint_t hash) {
+    struct mstrset *set = mu_atomic_load(&mu_str_consts);
+    if (!set) {
+        return 0;
+    }
+
+    muint_t mask = ((muint_t)1 << set->npw2) - 1;
+    for (muint_t i = hash & mask;; i = (i+1) & mask) {
+        struct mstrentry *e = &set->table[i];
+        muint_t ehash = mu_atomic_load(&e->hash);
+
+        if (!ehash) {
+            return 0;
+        } else if (ehash == hash &&
+                   mu_str_getlen(e->s) == len &&
+                   memcmp(s, mu_str_getdata(e->s), len) == 0) {
+            return e->s;
+        }
+    }
+}
+
+// Adds a constant string, must hold the state lock
+static void mu_str_constinsert(mu_t m, muint_t hash) {
+    struct mstrset *set = mu_str_consts;
+    if (!set || set->len+1 > 3*((muint_t)1 << set->npw2)/4) {
+        struct mstrset *nset = mu_alloc(sizeof(struct mstrset));
+        *nset = set ? *set : (struct mstrset){0};
+        mu_str_table_grow(nset);
+        mu_atomic_store(&mu_str_consts, nset);
+        set = nset;
+    }
+
+    muint_t mask = ((muint_t)1 << set->npw2) - 1;
+    muint_t i = hash & mask;
+    while (set->table[i].hash) {
+        i = (i+1) & mask;
+    }
+
+    set->table[i].s = m;
+    mu_atomic_store(&set->table[i].hash, hash);
+    set->len += 1;
 }
 
 
@@ -102,61 +219,189 @@ static void mu_str_table_remove(mint_t i) {
 // buf's internal structure is reused for interned strings
 mu_t mu_str_intern(mu_t b, muint_t n) {
     mu_assert(mu_isbuf(b));
+    mu_checklen(n < MU_STR_SLICE, "string");
+
+    struct mstrset *set = &mu_state->strs;
+    muint_t hash = mu_str_hash(mu_buf_getdata(b), n);
+    muint_t i = mu_str_table_lookup(set, mu_buf_getdata(b), n, hash);
+    if (set->table[i].hash) {
+        mu_dec(b);
+        return mu_inc(set->table[i].s);
+    }
 
-    mint_t i = mu_str_table_find(mu_buf_getdata(b), n);
-    if (i >= 0) {
+    mu_t c = mu_str_const(mu_buf_getdata(b), n, hash);
+    if (c) {
         mu_dec(b);
-        return mu_inc(mu_str_table[i]);
+        return c;
     }
 
+    // the data now belongs to the string, so no destructor is run
     if (mu_buf_getdtor(b)) {
         mu_buf_setdtor(&b, 0);
     }
 
-    if (mu_buf_getlen(b) != n) {
-        mu_buf_resize(&b, n);
+    if (mu_gettype(b) != MTBUF ||
+        mu_buf_getlen(b) != mu_align(n) + sizeof(muint_t)) {
+        mu_t nb = mu_buf_create(mu_align(n) + sizeof(muint_t));
+        memcpy(mu_buf_getdata(nb), mu_buf_getdata(b), n);
+        mu_dec(b);
+        b = nb;
     }
 
     mu_t s = (mu_t)((muint_t)b - MTBUF + MTSTR);
-    mu_str_table_insert(~i, s);
+    mstr(s)->len = n;
+    *mstrhash(s) = hash;
+    mu_str_table_insert(set, i, hash, s);
     return mu_inc(s);
 }
 
 mu_t mu_str_fromdata(const void *s, muint_t n) {
-    mu_checklen(n <= (mlen_t)-1, "string");
+    mu_checklen(n < MU_STR_SLICE, "string");
+
+    struct mstrset *set = &mu_state->strs;
+    muint_t hash = mu_str_hash(s, n);
+    muint_t i = mu_str_table_lookup(set, s, n, hash);
+    if (set->table[i].hash) {
+        return mu_inc(set->table[i].s);
+    }
 
-    mint_t i = mu_str_table_find(s, n);
-    if (i >= 0) {
-        return mu_inc(mu_str_table[i]);
+    mu_t c = mu_str_const(s, n, hash);
+    if (c) {
+        return c;
     }
 
     // create new string and insert
-    mu_t b = mu_buf_create(n);
+    mu_t b = mu_buf_create(mu_align(n) + sizeof(muint_t));
     memcpy(mu_buf_getdata(b), s, n);
 
     mu_t ns = (mu_t)((muint_t)b - MTBUF + MTSTR);
-    mu_str_table_insert(~i, ns);
+    mstr(ns)->len = n;
+    *mstrhash(ns) = hash;
+    mu_str_table_insert(set, i, hash, ns);
     return mu_inc(ns);
 }
 
 void mu_str_destroy(mu_t s) {
-    mint_t i = mu_str_table_find(mu_str_getdata(s), mu_str_getlen(s));
-    mu_assert(i >= 0);
-    mu_str_table_remove(i);
+    if (mu_str_isslice(s)) {
+        mu_dec(mstrslice(s)->parent);
+        mu_dealloc(mstrslice(s), sizeof(struct mstrslice));
+        return;
+    }
+
+    struct mstrset *set = &mu_state->strs;
+    muint_t i = mu_str_table_find(set,
+            mu_str_getdata(s), mu_str_getlen(s), *mstrhash(s));
+    mu_assert(set->table[i].s == s);
+    mu_str_table_remove(set, i);
+
+    mu_dealloc(mstr(s), mu_offsetof(struct mstr, data) +
+            mu_align(mu_str_getlen(s)) + sizeof(muint_t));
+}
+
+// String slices
+// Slices always reference an interned string or a buffer, so slices of
+// slices share the original parent. Once interned, the interned string
+// becomes the parent, releasing the original and making later
+// interning free.
+static mu_t mu_str_createslice(mu_t p, const mbyte_t *data, muint_t len) {
+    struct mstrslice *v = mu_alloc(sizeof(struct mstrslice));
+    v->ref = 1;
+    v->mark = MU_STR_SLICE;
+    v->len = len;
+    v->append = false;
+    v->parent = p;
+    v->data = data;
+    return (mu_t)((muint_t)v + MTSTR);
+}
+
+static mu_t mu_str_slice(mu_t s, muint_t off, muint_t len) {
+    if (len == 0) {
+        return MU_EMPTY_STR;
+    } else if (len == mu_str_getlen(s)) {
+        return mu_inc(s);
+    }
+
+    return mu_str_createslice(
+            mu_inc(mu_str_isslice(s) ? mstrslice(s)->parent : s),
+            (const mbyte_t *)mu_str_getdata(s) + off, len);
+}
+
+// Creates a string that takes over a buffer without interning it,
+// which is left until the string is used as a table key
+mu_t mu_str_frombuf(mu_t b, muint_t n) {
+    mu_assert(mu_isbuf(b));
+    mu_checklen(n < MU_STR_SLICE, "string");
+
+    if (n == 0) {
+        mu_dec(b);
+        return MU_EMPTY_STR;
+    }
+
+    if (mu_buf_getdtor(b)) {
+        mu_buf_setdtor(&b, 0);
+    }
+
+    return mu_str_createslice(b, mu_buf_getdata(b), n);
+}
+
+mu_t mu_str_internslice(mu_t s) {
+    struct mstrslice *v = mstrslice(s);
+    v->append = false;
+
+    if (mu_isbuf(v->parent) && mu_getref(v->parent) == 1 &&
+        v->data == mu_buf_getdata(v->parent)) {
+        // buffers owned by a single string are reused when interned
+        v->parent = mu_str_intern(v->parent, v->len);
+        v->data = mu_str_getdata(v->parent);
+    } else if (mu_isbuf(v->parent) ||
+               v->len != mu_str_getlen(v->parent) ||
+               v->data != mu_str_getdata(v->parent)) {
+        mu_t p = mu_str_fromdata(v->data, v->len);
+        mu_dec(v->parent);
+        v->parent = p;
+        v->data = mu_str_getdata(p);
+    }
+
+    mu_t p = mu_inc(v->parent);
+    mu_dec(s);
+    return p;
+}
 
-    mu_dealloc((struct mstr *)((muint_t)s - MTSTR),
-            mu_offsetof(struct mstr, data) + mu_str_getlen(s));
+// Releases the strings interned by a state
+void mu_str_release(struct mstrset *set) {
+    mu_dealloc(set->table, ((muint_t)1 << set->npw2) *
+            sizeof(struct mstrentry));
+    set->table = 0;
+    set->npw2 = 0;
+    set->len = 0;
 }
 
 
 // String creating functions
-mu_t mu_str_init(const struct mstr *s) {
-    mu_t m = mu_str_intern((mu_t)((muint_t)s + MTBUF), s->len);
+// A string already interned by the current state is made constant, so
+// it stays equal to the constant. Its memory is never released, since
+// destroyed states only give up blocks on their free lists.
+mu_t mu_str_init(struct mstr *s) {
+    mu_state_lock();
+    muint_t hash = mu_str_hash(s->data, s->len);
+    *(muint_t *)(s->data + mu_align(s->len)) = hash;
+    mu_t m = mu_str_const(s->data, s->len, hash);
+
+    if (!m) {
+        struct mstrset *set = &mu_state->strs;
+        muint_t j = mu_str_table_lookup(set, s->data, s->len, hash);
+        if (set->table[j].hash) {
+            m = set->table[j].s;
+            mu_str_table_remove(set, j);
+            *(mref_t *)((muint_t)m - MTSTR) = 0;
+        } else {
+            m = (mu_t)((muint_t)s + MTSTR);
+        }
 
-    if (*(mref_t *)((muint_t)m - MTSTR) != 0) {
-        *(mref_t *)((muint_t)m - MTSTR) = 0;
+        mu_str_constinsert(m, hash);
     }
 
+    mu_state_unlock();
     return m;
 }
 
@@ -177,7 +422,7 @@ mu_t mu_str_vformat(const char *f, va_list args) {
     mu_t b = mu_buf_create(0);
     muint_t n = 0;
     mu_buf_vpushf(&b, &n, f, args);
-    return mu_str_intern(b, n);
+    return mu_str_frombuf(b, n);
 }
 
 mu_t mu_str_format(const char *f, ...) {
@@ -221,35 +466,102 @@ bool mu_str_next(mu_t s, muint_t *ip, mu_t *cp) {
     return true;
 }
 
-static mcnt_t mu_str_step(mu_t scope, mu_t *frame) {
-    mu_t s = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    muint_t i = mu_num_getuint(mu_tbl_lookup(scope, mu_num_fromuint(1)));
+// State of string iteration and split, the delimiter is nil
+// when iterating over characters. Strings can't form cycles,
+// so the state is never visited by the cycle collector.
+struct mstrstep {
+    mu_t s;
+    mu_t delim;
+    muint_t i;
+};
+
+static void mu_str_stepdestroy(mu_t b) {
+    struct mstrstep *step = mu_buf_getdata(b);
+    mu_dec(step->s);
+    mu_dec(step->delim);
+}
 
-    bool next = mu_str_next(s, &i, &frame[0]);
-    mu_dec(s);
-    mu_tbl_insert(scope, mu_num_fromuint(1), mu_num_fromuint(i));
-    return next ? 1 : 0;
+static mu_t mu_str_stepcreate(mu_t s, mu_t delim) {
+    mu_t b = mu_buf_createdtor(sizeof(struct mstrstep), mu_str_stepdestroy);
+    struct mstrstep *step = mu_buf_getdata(b);
+    step->s = s;
+    step->delim = delim;
+    step->i = 0;
+    return b;
+}
+
+static mcnt_t mu_str_step(mu_t b, mu_t *frame) {
+    struct mstrstep *step = mu_buf_getdata(b);
+    return mu_str_next(step->s, &step->i, &frame[0]) ? 1 : 0;
 }
 
 mu_t mu_str_iter(mu_t s) {
     mu_assert(mu_isstr(s));
     return mu_fn_fromsbfn(0x00, mu_str_step,
-            mu_tbl_fromlist((mu_t[]){mu_inc(s), mu_num_fromuint(0)}, 2));
+            mu_str_stepcreate(mu_inc(s), 0));
 }
 
 
 // String operations
+// Buffers that strings are appended to in place. No string in the
+// buffer extends past the fill, so the string that ends at the fill
+// can be appended to without changing any other string. Only slices
+// created by concatenation are marked as appendable.
+struct mstrappend {
+    muint_t fill;
+    mbyte_t data[];
+};
+
+static mu_t mu_str_createappend(mu_t p, const mbyte_t *data, muint_t len) {
+    mu_t s = mu_str_createslice(p, data, len);
+    mstrslice(s)->append = true;
+    return s;
+}
+
+// Strings built by concatenation are copied into append buffers with
+// room to grow, so repeated appends such as s = s ++ piece only copy
+// each byte a constant number of times
 mu_t mu_str_concat(mu_t a, mu_t b) {
     mu_assert(mu_isstr(a) && mu_isstr(b));
     muint_t an = mu_str_getlen(a);
     muint_t bn = mu_str_getlen(b);
-    mu_t d = mu_buf_create(an + bn);
+    muint_t n = an + bn;
+    mu_checklen(n < MU_STR_SLICE, "string");
+
+    mu_t p = mu_str_isslice(a) ? mstrslice(a)->parent : 0;
+    if (p && mstrslice(a)->append) {
+        struct mstrappend *ap = mu_buf_getdata(p);
+        const mbyte_t *data = mstrslice(a)->data;
+        muint_t end = (data - ap->data) + an;
+
+        if (end == ap->fill && end + bn <=
+                mu_buf_getlen(p) - mu_offsetof(struct mstrappend, data)) {
+            memcpy(&ap->data[end], mu_str_getdata(b), bn);
+            ap->fill = end + bn;
+            mu_dec(b);
+            return mu_str_createappend(mu_inc(p), data, n);
+        }
+    }
+
+    muint_t size = 2*n + mu_offsetof(struct mstrappend, data);
+    if (!p || !mu_isbuf(p) || size > (mlen_t)-1) {
+        // only strings that were already built are given room to grow
+        mu_t d = mu_buf_create(n);
+        memcpy((mbyte_t *)mu_buf_getdata(d), mu_str_getdata(a), an);
+        memcpy((mbyte_t *)mu_buf_getdata(d)+an, mu_str_getdata(b), bn);
+
+        mu_dec(b);
+        return mu_str_frombuf(d, n);
+    }
 
-    memcpy((mbyte_t *)mu_buf_getdata(d), mu_str_getdata(a), an);
-    memcpy((mbyte_t *)mu_buf_getdata(d)+an, mu_str_getdata(b), bn);
+    mu_t d = mu_buf_create(size);
+    struct mstrappend *ap = mu_buf_getdata(d);
+    memcpy(ap->data, mu_str_getdata(a), an);
+    memcpy(ap->data+an, mu_str_getdata(b), bn);
+    ap->fill = n;
 
     mu_dec(b);
-    return mu_str_intern(d, an + bn);
+    return mu_str_createappend(d, ap->data, n);
 }
 
 mu_t mu_str_subset(mu_t s, mint_t lower, mint_t upper) {
@@ -269,9 +581,7 @@ mu_t mu_str_subset(mu_t s, mint_t lower, mint_t upper) {
         return MU_EMPTY_STR;
     }
 
-    return mu_str_fromdata(
-            (const mbyte_t *)mu_str_getdata(s) + lower,
-            upper - lower);
+    return mu_str_slice(s, lower, upper - lower);
 }
 
 
@@ -417,7 +727,255 @@ mu_t mu_str_repr(mu_t m) {
     }
 
     mu_buf_pushc(&b, &n, '\'');
-    return mu_str_intern(b, n);
+    return mu_str_frombuf(b, n);
+}
+
+
+// Substring search
+//
+// Find, replace and split share a single search over the string data.
+// Short needles are matched by filtering a block of positions at a
+// time on the first and last bytes of the needle, so memcmp only runs
+// on the rare positions where both match. On x86 the filter uses SSE2
+// or AVX2, picked at runtime from the features of the CPU.
+//
+// Long needles use the Two-Way algorithm of Crochemore and Perrin,
+// which is linear in the worst case without allocating, with a shift
+// table on the last byte to skip ahead in the common case.
+#define MU_STR_LONGNEEDLE 32
+
+// Returns the offset of the match or -1, expects mlen >= 2
+static muint_t mu_str_search_bytes(const mbyte_t *s, muint_t slen,
+                                   const mbyte_t *m, muint_t mlen,
+                                   muint_t i) {
+    while (i + mlen <= slen) {
+        const mbyte_t *p = memchr(&s[i], m[0], slen-mlen+1 - i);
+        if (!p) {
+            break;
+        }
+
+        i = p - s;
+        if (s[i+mlen-1] == m[mlen-1] &&
+            memcmp(&s[i+1], &m[1], mlen-2) == 0) {
+            return i;
+        }
+
+        i += 1;
+    }
+
+    return (muint_t)-1;
+}
+
+#ifdef MU_SIMD
+__attribute__((target("sse2")))
+static muint_t mu_str_search_sse2(const mbyte_t *s, muint_t slen,
+                                  const mbyte_t *m, muint_t mlen) {
+    __m128i first = _mm_set1_epi8((char)m[0]);
+    __m128i last  = _mm_set1_epi8((char)m[mlen-1]);
+    muint_t i = 0;
+
+    for (; i + mlen-1 + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&s[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&s[i+mlen-1]);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(a, first),
+                _mm_cmpeq_epi8(b, last)));
+
+        for (; mask; mask &= mask-1) {
+            muint_t j = i + __builtin_ctz(mask);
+            if (memcmp(&s[j+1], &m[1], mlen-2) == 0) {
+                return j;
+            }
+        }
+    }
+
+    return mu_str_search_bytes(s, slen, m, mlen, i);
+}
+
+__attribute__((target("avx2")))
+static muint_t mu_str_search_avx2(const mbyte_t *s, muint_t slen,
+                                  const mbyte_t *m, muint_t mlen) {
+    __m256i first = _mm256_set1_epi8((char)m[0]);
+    __m256i last  = _mm256_set1_epi8((char)m[mlen-1]);
+    muint_t i = 0;
+
+    for (; i + mlen-1 + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&s[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&s[i+mlen-1]);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpeq_epi8(a, first),
+                _mm256_cmpeq_epi8(b, last)));
+
+        for (; mask; mask &= mask-1) {
+            muint_t j = i + __builtin_ctz(mask);
+            if (memcmp(&s[j+1], &m[1], mlen-2) == 0) {
+                return j;
+            }
+        }
+    }
+
+    return mu_str_search_bytes(s, slen, m, mlen, i);
+}
+#endif
+
+// Finds the maximal suffix of the needle under the byte order, or
+// under the reversed order, returning its start and period
+static muint_t mu_str_maxsuffix(const mbyte_t *m, muint_t mlen,
+                                muint_t *period, bool rev) {
+    muint_t ms = (muint_t)-1;
+    muint_t j = 0;
+    muint_t k = 1;
+    muint_t p = 1;
+
+    while (j + k < mlen) {
+        mbyte_t a = m[j+k];
+        mbyte_t b = m[ms+k];
+
+        if (rev ? a > b : a < b) {
+            j += k;
+            k = 1;
+            p = j - ms;
+        } else if (a == b) {
+            if (k != p) {
+                k += 1;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            ms = j++;
+            k = p = 1;
+        }
+    }
+
+    *period = p;
+    return ms + 1;
+}
+
+static muint_t mu_str_search_twoway(const mbyte_t *s, muint_t slen,
+                                    const mbyte_t *m, muint_t mlen) {
+    // critical factorization, the later of the two maximal suffixes
+    muint_t period, rperiod;
+    muint_t split = mu_str_maxsuffix(m, mlen, &period, false);
+    muint_t rsplit = mu_str_maxsuffix(m, mlen, &rperiod, true);
+    if (rsplit > split) {
+        split = rsplit;
+        period = rperiod;
+    }
+
+    // distance from each byte's last occurrence to the end of the needle
+    muint_t shifts[256];
+    for (muint_t i = 0; i < 256; i++) {
+        shifts[i] = mlen;
+    }
+
+    for (muint_t i = 0; i < mlen; i++) {
+        shifts[m[i]] = mlen-1 - i;
+    }
+
+    if (memcmp(m, &m[period], split) == 0) {
+        // periodic needle, remember how much of the needle
+        // is known to match after shifting by the period
+        muint_t memory = 0;
+        muint_t j = 0;
+
+        while (j + mlen <= slen) {
+            muint_t shift = shifts[s[j+mlen-1]];
+            if (shift) {
+                if (memory && shift < period) {
+                    shift = mlen - period;
+                }
+
+                memory = 0;
+                j += shift;
+                continue;
+            }
+
+            muint_t i = split > memory ? split : memory;
+            while (i < mlen-1 && m[i] == s[i+j]) {
+                i++;
+            }
+
+            if (i < mlen-1) {
+                j += i - split + 1;
+                memory = 0;
+                continue;
+            }
+
+            i = split;
+            while (i > memory && m[i-1] == s[i-1+j]) {
+                i--;
+            }
+
+            if (i <= memory) {
+                return j;
+            }
+
+            j += period;
+            memory = mlen - period;
+        }
+    } else {
+        // aperiodic needle, any mismatch in the left half
+        // shifts past the larger half
+        period = (split > mlen - split ? split : mlen - split) + 1;
+        muint_t j = 0;
+
+        while (j + mlen <= slen) {
+            muint_t shift = shifts[s[j+mlen-1]];
+            if (shift) {
+                j += shift;
+                continue;
+            }
+
+            muint_t i = split;
+            while (i < mlen-1 && m[i] == s[i+j]) {
+                i++;
+            }
+
+            if (i < mlen-1) {
+                j += i - split + 1;
+                continue;
+            }
+
+            i = split;
+            while (i > 0 && m[i-1] == s[i-1+j]) {
+                i--;
+            }
+
+            if (i == 0) {
+                return j;
+            }
+
+            j += period;
+        }
+    }
+
+    return (muint_t)-1;
+}
+
+// Returns the offset of the first match of m in s, or -1
+static muint_t mu_str_search(const mbyte_t *s, muint_t slen,
+                             const mbyte_t *m, muint_t mlen) {
+    if (mlen == 0) {
+        return 0;
+    } else if (mlen > slen) {
+        return (muint_t)-1;
+    } else if (mlen == 1) {
+        const mbyte_t *p = memchr(s, m[0], slen);
+        return p ? (muint_t)(p - s) : (muint_t)-1;
+    } else if (mlen > MU_STR_LONGNEEDLE) {
+        return mu_str_search_twoway(s, slen, m, mlen);
+    }
+
+#ifdef MU_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return mu_str_search_avx2(s, slen, m, mlen);
+    } else if (__builtin_cpu_supports("sse2")) {
+        return mu_str_search_sse2(s, slen, m, mlen);
+    }
+#endif
+
+    return mu_str_search_bytes(s, slen, m, mlen, 0);
 }
 
 
@@ -444,14 +1002,13 @@ static mcnt_t mu_find_bfn(mu_t *frame) {
     const mbyte_t *mb = mu_str_getdata(m);
     mlen_t mlen = mu_str_getlen(m);
 
-    for (muint_t i = 0; i+mlen <= slen; i++) {
-        if (memcmp(&sb[i], mb, mlen) == 0) {
-            mu_dec(m);
-            mu_dec(s);
-            frame[0] = mu_num_fromuint(i);
-            frame[1] = mu_num_fromuint(i + mlen);
-            return 2;
-        }
+    muint_t i = mu_str_search(sb, slen, mb, mlen);
+    if (i != (muint_t)-1) {
+        mu_dec(m);
+        mu_dec(s);
+        frame[0] = mu_num_fromuint(i);
+        frame[1] = mu_num_fromuint(i + mlen);
+        return 2;
     }
 
     mu_dec(s);
@@ -478,26 +1035,34 @@ static mcnt_t mu_replace_bfn(mu_t *frame) {
     muint_t n = 0;
     muint_t i = 0;
 
-    while (i+mlen <= slen) {
-        bool match = memcmp(&sb[i], mb, mlen) == 0;
-
-        if (match) {
-            mu_buf_pushmu(&d, &n, mu_inc(r));
-            i += mlen;
+    while (i <= slen) {
+        muint_t j = mu_str_search(&sb[i], slen-i, mb, mlen);
+        if (j == (muint_t)-1) {
+            break;
         }
 
-        if (!match || mlen == 0) {
-            mu_buf_pushc(&d, &n, sb[i]);
+        mu_buf_pushdata(&d, &n, &sb[i], j);
+        mu_buf_pushmu(&d, &n, mu_inc(r));
+        i += j + mlen;
+
+        // an empty match is replaced between every character
+        if (mlen == 0) {
+            if (i < slen) {
+                mu_buf_pushc(&d, &n, sb[i]);
+            }
+
             i += 1;
         }
     }
 
-    mu_buf_pushdata(&d, &n, &sb[i], slen-i);
+    if (i < slen) {
+        mu_buf_pushdata(&d, &n, &sb[i], slen-i);
+    }
 
     mu_dec(s);
     mu_dec(m);
     mu_dec(r);
-    frame[0] = mu_str_intern(d, n);
+    frame[0] = mu_str_frombuf(d, n);
     return 1;
 }
 
@@ -505,32 +1070,24 @@ MU_DEF_STR(mu_replace_key_def, "replace")
 MU_DEF_BFN(mu_replace_def, 0x3, mu_replace_bfn)
 
 
-static mcnt_t mu_str_split_step(mu_t scope, mu_t *frame) {
-    mu_t a = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    const mbyte_t *ab = mu_str_getdata(a);
-    mlen_t alen = mu_str_getlen(a);
-    muint_t i = mu_num_getuint(mu_tbl_lookup(scope, mu_num_fromuint(2)));
+static mcnt_t mu_str_split_step(mu_t b, mu_t *frame) {
+    struct mstrstep *step = mu_buf_getdata(b);
+    const mbyte_t *ab = mu_str_getdata(step->s);
+    mlen_t alen = mu_str_getlen(step->s);
+    muint_t i = step->i;
 
     if (i > alen) {
-        mu_dec(a);
         return 0;
     }
 
-    mu_t s = mu_tbl_lookup(scope, mu_num_fromuint(1));
-    const mbyte_t *sb = mu_str_getdata(s);
-    mlen_t slen = mu_str_getlen(s);
+    const mbyte_t *sb = mu_str_getdata(step->delim);
+    mlen_t slen = mu_str_getlen(step->delim);
 
-    muint_t j = i;
-    for (; j < alen; j++) {
-        if (j+slen <= alen && memcmp(&ab[j], sb, slen) == 0) {
-            break;
-        }
-    }
+    muint_t j = mu_str_search(&ab[i], alen-i, sb, slen);
+    j = (j == (muint_t)-1) ? alen : i + j;
 
-    frame[0] = mu_str_fromdata(ab+i, j-i);
-    mu_tbl_insert(scope, mu_num_fromuint(2), mu_num_fromuint(j+slen));
-    mu_dec(a);
-    mu_dec(s);
+    frame[0] = mu_str_slice(step->s, i, j-i);
+    step->i = j+slen;
     return 1;
 }
 
@@ -546,7 +1103,7 @@ static mcnt_t mu_split_bfn(mu_t *frame) {
     }
 
     frame[0] = mu_fn_fromsbfn(0x0, mu_str_split_step,
-            mu_tbl_fromlist((mu_t[]){s, delim, mu_num_fromuint(0)}, 3));
+            mu_str_stepcreate(s, delim));
     return 1;
 }
 
@@ -580,7 +1137,7 @@ static mcnt_t mu_join_bfn(mu_t *frame) {
 
     mu_dec(iter);
     mu_dec(delim);
-    frame[0] = mu_str_intern(b, n);
+    frame[0] = mu_str_frombuf(b, n);
     return 1;
 }
 
@@ -629,7 +1186,7 @@ static mcnt_t mu_pad_bfn(mu_t *frame) {
     }
 
     mu_dec(pad);
-    frame[0] = mu_str_intern(d, n);
+    frame[0] = mu_str_frombuf(d, n);
     return 1;
 }
 
@@ -12,7 +12,8 @@
 
 
 // Definition of Mu's string types
-// Storage follows identical layout of buf type.
+// Storage follows identical layout of buf type, with the hash of
+// interned strings stored after the data.
 // Strings must be interned before use in tables, and once interned,
 // strings cannot be mutated without breaking things.
 struct mstr {
@@ -21,9 +22,26 @@ struct mstr {
     mbyte_t data[]; // data follows
 };
 
+// Slices reference the data of a parent string or buffer without
+// copying it, and are only interned once used as a table key. Slices
+// are marked with a length of MU_STR_SLICE, which interned strings
+// never have. Strings built from buffers are slices of the buffer,
+// so they are only hashed and interned if they are ever needed.
+#define MU_STR_SLICE ((mlen_t)-1)
+
+struct mstrslice {
+    mref_t ref;             // reference count
+    mlen_t mark;            // MU_STR_SLICE
+    mlen_t len;             // length of string
+    bool append;            // parent is an append buffer
+    mu_t parent;            // owner of the data
+    const mbyte_t *data;    // data in parent
+};
+
 
 // String creation functions
 mu_t mu_str_intern(mu_t buf, muint_t n);
+mu_t mu_str_frombuf(mu_t buf, muint_t n);
 
 // Conversion operations
 mu_t mu_str_fromdata(const void *s, muint_t n);
@@ -34,6 +52,14 @@ mu_t mu_str_frommu(mu_t m);
 // String access functions
 mu_inline mlen_t mu_str_getlen(mu_t m);
 mu_inline const void *mu_str_getdata(mu_t m);
+mu_inline bool mu_str_isslice(mu_t m);
+
+// Interns a string if it is a slice, any other value is returned as is.
+// Needed before strings are compared by identity, such as in tables.
+mu_inline mu_t mu_str_internmu(mu_t m);
+
+// Equality of any two values, which is identity except for slices
+mu_inline bool mu_str_equals(mu_t a, mu_t b);
 
 // Formatting
 mu_t mu_str_vformat(const char *f, va_list args);
@@ -68,11 +94,39 @@ mu_inline mu_t mu_str_fromc(char s) {
 // String access functions
 // we don't define a string struct 
 mu_inline mlen_t mu_str_getlen(mu_t m) {
-    return ((struct mstr *)((muint_t)m - MTSTR))->len;
+    struct mstr *s = (struct mstr *)((muint_t)m - MTSTR);
+    return s->len != MU_STR_SLICE ? s->len : ((struct mstrslice *)s)->len;
 }
 
 mu_inline const void *mu_str_getdata(mu_t m) {
-    return ((struct mstr *)((muint_t)m - MTSTR))->data;
+    struct mstr *s = (struct mstr *)((muint_t)m - MTSTR);
+    return s->len != MU_STR_SLICE ? s->data : ((struct mstrslice *)s)->data;
+}
+
+mu_inline bool mu_str_isslice(mu_t m) {
+    return ((struct mstr *)((muint_t)m - MTSTR))->len == MU_STR_SLICE;
+}
+
+mu_inline mu_t mu_str_internmu(mu_t m) {
+    if (mu_isstr(m) && mu_str_isslice(m)) {
+        extern mu_t mu_str_internslice(mu_t s);
+        return mu_str_internslice(m);
+    }
+
+    return m;
+}
+
+mu_inline bool mu_str_equals(mu_t a, mu_t b) {
+    if (a == b) {
+        return true;
+    } else if (!mu_isstr(a) || !mu_isstr(b) ||
+            (!mu_str_isslice(a) && !mu_str_isslice(b))) {
+        return false;
+    }
+
+    return mu_str_getlen(a) == mu_str_getlen(b) &&
+           memcmp(mu_str_getdata(a), mu_str_getdata(b),
+                  mu_str_getlen(a)) == 0;
 }
 
 
@@ -80,16 +134,14 @@ mu_inline const void *mu_str_getdata(mu_t m) {
 #define MU_DEF_STR(name, s)                                                 \
 mu_pure mu_t name(void) {                                                   \
     static mu_t ref = 0;                                                    \
-    static const struct {                                                   \
+    static struct {                                                         \
         mref_t ref;                                                         \
         mlen_t len;                                                         \
-        mbyte_t data[sizeof s > 1 ? (sizeof s)-1 : 1];                      \
+        mbyte_t data[mu_align((sizeof s)-1) + sizeof(muint_t)];             \
     } inst = {0, (sizeof s)-1, s};                                          \
                                                                             \
-    extern mu_t mu_str_init(const struct mstr *);                            \
-    if (!ref) {                                                             \
-        ref = mu_str_init((const struct mstr *)&inst);                       \
-    }                                                                       \
+    extern mu_t mu_str_init(struct mstr *);                                 \
+    MU_DEF_INIT(ref, mu_str_init((struct mstr *)&inst))                     \
                                                                             \
     return ref;                                                             \
 }
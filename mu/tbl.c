@@ -18,6 +18,15 @@ mu_inline bool mu_isrtbl(mu_t t) {
 }
 
 
+// Invalidates cached lookups if the table is watched,
+// must be called before slots in the table move
+mu_inline void mu_tbl_touch(mu_t t) {
+    if (mtbl(t)->watched) {
+        mu_state->epoch += 1;
+    }
+}
+
+
 // General purpose hash for mu types
 mu_inline muint_t mu_tbl_hash(mu_t t, mu_t m) {
     // Mu types have bitwise equality but aren't distributed very well.
@@ -47,8 +56,8 @@ static muintq_t mu_tbl_isize(mlen_t len) {
     }
 }
 
-// Find next power of 2 needed for list or table
-static muintq_t mu_tbl_listnpw2(mlen_t len) {
+// Find next power of 2 needed for array or hash part
+static muintq_t mu_tbl_arraynpw2(mlen_t len) {
     if (len < MU_MINALLOC/sizeof(mu_t)) {
         len = MU_MINALLOC/sizeof(mu_t);
     }
@@ -56,7 +65,7 @@ static muintq_t mu_tbl_listnpw2(mlen_t len) {
     return mu_npw2(len);
 }
 
-static muintq_t mu_tbl_pairsnpw2(mlen_t len, muintq_t *pisize) {
+static muintq_t mu_tbl_hashnpw2(mlen_t len, muintq_t *pisize) {
     const muintq_t psize = 2*sizeof(mu_t);
 
     // Calculate space for indices, order is important for correct rounding
@@ -71,67 +80,110 @@ static muintq_t mu_tbl_pairsnpw2(mlen_t len, muintq_t *pisize) {
 }
 
 // Other calculated attributes of tables
-mu_inline bool mu_tbl_islist(mu_t t) {
-    return mtbl(t)->isize == 0;
-}
-
-mu_inline muint_t mu_tbl_count(mu_t t) {
-    return mtbl(t)->len + mtbl(t)->nils;
+mu_inline muint_t mu_tbl_asize(mu_t t) {
+    return mtbl(t)->array ? (muint_t)1 << mtbl(t)->apw2 : 0;
 }
 
-mu_inline muint_t mu_tbl_size(mu_t t) {
-    return (1 << mtbl(t)->npw2);
+mu_inline muint_t mu_tbl_hsize(mu_t t) {
+    return mtbl(t)->pairs ? (muint_t)1 << mtbl(t)->npw2 : 0;
 }
 
 mu_inline muint_t mu_tbl_off(mu_t t) {
     // This looks complicated but most of these are constants and powers of 2
     const muintq_t psize = 2*sizeof(mu_t);
-    return (mtbl(t)->isize*mu_tbl_size(t) + psize-1) / psize;
+    return (mtbl(t)->isize*mu_tbl_hsize(t) + psize-1) / psize;
+}
+
+// Checks if a key is a non-negative integer less than size,
+// these keys are stored in the array part when it is large enough
+mu_inline bool mu_tbl_isindex(mu_t k, muint_t size, muint_t *i) {
+    if (!mu_num_isint(k) || mu_num_getuint(k) >= size) {
+        return false;
+    }
+
+    *i = mu_num_getuint(k);
+    return true;
+}
+
+// Array part access, indices wrap around the ring buffer
+mu_inline mu_t *mu_tbl_slot(mu_t t, muint_t i) {
+    return &mtbl(t)->array[(mtbl(t)->aoff + i) & (mu_tbl_asize(t)-1)];
 }
 
 // Indirect entry access
 static mu_t *mu_tbl_getpair(mu_t t, muint_t i) {
     muint_t off = 0;
     if (mtbl(t)->isize == 1) {
-        off = ((uint8_t*)mtbl(t)->array)[i];
+        off = ((uint8_t*)mtbl(t)->pairs)[i];
     } else if (mtbl(t)->isize == 2) {
-        off = ((uint16_t*)mtbl(t)->array)[i];
+        off = ((uint16_t*)mtbl(t)->pairs)[i];
     } else if (mtbl(t)->isize == 4) {
-        off = ((uint32_t*)mtbl(t)->array)[i];
+        off = ((uint32_t*)mtbl(t)->pairs)[i];
     } else if (mtbl(t)->isize == 8) {
-        off = ((uint64_t*)mtbl(t)->array)[i];
+        off = ((uint64_t*)mtbl(t)->pairs)[i];
     }
 
-    return off ? &mtbl(t)->array[2*off] : 0;
+    return off ? &mtbl(t)->pairs[2*off] : 0;
 }
 
 static void mu_tbl_setpair(mu_t t, muint_t i, mu_t *p) {
-    muint_t j = (p - mtbl(t)->array)/2;
+    muint_t j = (p - mtbl(t)->pairs)/2;
     if (mtbl(t)->isize == 1) {
-        ((uint8_t*)mtbl(t)->array)[i] = j;
+        ((uint8_t*)mtbl(t)->pairs)[i] = j;
     } else if (mtbl(t)->isize == 2) {
-        ((uint16_t*)mtbl(t)->array)[i] = j;
+        ((uint16_t*)mtbl(t)->pairs)[i] = j;
     } else if (mtbl(t)->isize == 4) {
-        ((uint32_t*)mtbl(t)->array)[i] = j;
+        ((uint32_t*)mtbl(t)->pairs)[i] = j;
     } else if (mtbl(t)->isize == 8) {
-        ((uint64_t*)mtbl(t)->array)[i] = j;
+        ((uint64_t*)mtbl(t)->pairs)[i] = j;
+    }
+}
+
+// Finds the pair a key is stored in the hash part, does not consume
+static mu_t *mu_tbl_hashfind(mu_t t, mu_t k) {
+    if (!mtbl(t)->pairs) {
+        return 0;
+    }
+
+    muint_t mask = mu_tbl_hsize(t) - 1;
+
+    for (muint_t i = mu_tbl_hash(t, k);; i++) {
+        mu_t *p = mu_tbl_getpair(t, i & mask);
+
+        if (!p || p[0] == k) {
+            return p;
+        }
     }
 }
 
 
 // Functions for managing tables
 mu_t mu_tbl_create(muint_t len) {
+    mu_gc_poll();
     struct mtbl *t = mu_alloc(sizeof(struct mtbl));
     t->ref = 1;
-    t->npw2 = mu_tbl_listnpw2(len);
-    t->isize = 0;
+    t->gc = MU_GC_BLACK;
     t->len = 0;
+    t->alen = 0;
+    t->hlen = 0;
     t->nils = 0;
+    t->aoff = 0;
+    t->apw2 = 0;
+    t->npw2 = 0;
+    t->isize = 0;
+    t->hnums = false;
+    t->watched = false;
     t->tail = 0;
-
-    muint_t size = 1 << t->npw2;
-    t->array = mu_alloc(size * sizeof(mu_t));
-    memset(t->array, 0, size * sizeof(mu_t));
+    t->array = 0;
+    t->pairs = 0;
+
+    // The array part is allocated upfront for the expected length,
+    // the hash part is only allocated once a key does not fit
+    if (len > 0) {
+        t->apw2 = mu_tbl_arraynpw2(len);
+        t->array = mu_alloc(((muint_t)1 << t->apw2) * sizeof(mu_t));
+        memset(t->array, 0, ((muint_t)1 << t->apw2) * sizeof(mu_t));
+    }
 
     return (mu_t)((muint_t)t + MTTBL);
 }
@@ -152,22 +204,72 @@ void mu_tbl_settail(mu_t t, mu_t tail) {
         mu_dec(b);
     }
 
+    // constant tables are shared between states and created
+    // watched, so flags are only written when they change
+    if (tail && !mtbl(tail)->watched) {
+        mtbl(tail)->watched = true;
+    }
+
+    mu_tbl_touch(t);
     mtbl(t)->tail = tail;
 }
 
 void mu_tbl_destroy(mu_t t) {
-    muint_t i    = (mu_tbl_islist(t) ? 1 : 2) * mu_tbl_off(t);
-    muint_t len  = (mu_tbl_islist(t) ? 1 : 2) * mu_tbl_count(t);
-    muint_t size = (mu_tbl_islist(t) ? 1 : 2) * mu_tbl_size(t);
-    for (; i < len; i++) {
-        mu_dec(mtbl(t)->array[i]);
+    mu_tbl_touch(t);
+    for (muint_t i = 0; i < mtbl(t)->alen; i++) {
+        mu_dec(*mu_tbl_slot(t, i));
+    }
+
+    muint_t off = mu_tbl_off(t);
+    for (muint_t i = 0; i < 2*mtbl(t)->hlen; i++) {
+        mu_dec(mtbl(t)->pairs[2*off + i]);
     }
 
-    mu_dealloc(mtbl(t)->array, size*sizeof(mu_t));
+    mu_dealloc(mtbl(t)->array, mu_tbl_asize(t)*sizeof(mu_t));
+    mu_dealloc(mtbl(t)->pairs, 2*mu_tbl_hsize(t)*sizeof(mu_t));
     mu_dec(mtbl(t)->tail);
+
+    // buffered tables are freed by the cycle collector
+    if (mtbl(t)->gc & MU_GC_BUFFERED) {
+        mtbl(t)->gc |= MU_GC_DEAD;
+        return;
+    }
+
     mu_dealloc(mtbl(t), sizeof(struct mtbl));
 }
 
+// Called by cycle collector to visit references
+void mu_tbl_gcvisit(mu_t t, void (*visit)(mu_t *)) {
+    for (muint_t i = 0; i < mtbl(t)->alen; i++) {
+        visit(mu_tbl_slot(t, i));
+    }
+
+    muint_t off = mu_tbl_off(t);
+    for (muint_t i = 0; i < 2*mtbl(t)->hlen; i++) {
+        visit(&mtbl(t)->pairs[2*off + i]);
+    }
+
+    visit(&mtbl(t)->tail);
+}
+
+
+// Recursively finds the slot a key is stored in
+// returns 0 if the key is not in the table, does not consume
+static mu_t *mu_tbl_find(mu_t t, mu_t k) {
+    for (; t; t = mtbl(t)->tail) {
+        muint_t i;
+        if (mu_tbl_isindex(k, mu_tbl_asize(t), &i)) {
+            return mu_tbl_slot(t, i);
+        }
+
+        mu_t *p = mu_tbl_hashfind(t, k);
+        if (p) {
+            return &p[1];
+        }
+    }
+
+    return 0;
+}
 
 // Recursively looks up a key in the table
 // returns either that value or nil
@@ -177,71 +279,117 @@ mu_t mu_tbl_lookup(mu_t t, mu_t k) {
         return 0;
     }
 
-    for (; t; t = mtbl(t)->tail) {
-        muint_t mask = (1 << mtbl(t)->npw2) - 1;
+    k = mu_str_internmu(k);
 
-        if (mu_tbl_islist(t)) {
-            muint_t i = mu_num_getuint(k) & mask;
+    mu_t *slot = mu_tbl_find(t, k);
+    mu_dec(k);
+    return slot ? mu_inc(*slot) : 0;
+}
 
-            if (k == mu_num_fromuint(i)) {
-                return mu_inc(mtbl(t)->array[i]);
-            }
-        } else {
-            for (muint_t i = mu_tbl_hash(t, k);; i++) {
-                mu_t *p = mu_tbl_getpair(t, i & mask);
-
-                if (p && p[0] == k) {
-                    mu_dec(k);
-                    return mu_inc(p[1]);
-                } else if (!p) {
-                    break;
-                }
-            }
+// Lookup that missed the cache, only lookups from tables with tails
+// are cached since other tables are not watched for changes
+mu_t mu_tbl_lookupmiss(mu_t t, mu_t k, struct mcache *c) {
+    mu_assert(mu_istbl(t));
+    if (!k) {
+        return 0;
+    }
+
+    k = mu_str_internmu(k);
+    mu_t *slot = mu_tbl_find(t, k);
+    if (slot && (mtbl(t)->tail || mtbl(t)->watched)) {
+        if (!mtbl(t)->watched) {
+            mtbl(t)->watched = true;
         }
+
+        // the key is kept alive so no other string can take its place
+        mu_dec(c->key);
+        c->tbl = t;
+        c->key = mu_inc(k);
+        c->slot = slot;
+        c->epoch = mu_state->epoch;
     }
 
     mu_dec(k);
-    return 0;
+    return slot ? mu_inc(*slot) : 0;
 }
 
 
-// Expands into list/table, possibly converting from a list
-static void mu_tbl_listexpand(mu_t t, mlen_t len) {
+// Drops removed values off the end of the array part, so the
+// array part always ends in a value
+static void mu_tbl_arraytrim(mu_t t) {
+    while (mtbl(t)->alen > 0 && !*mu_tbl_slot(t, mtbl(t)->alen-1)) {
+        mtbl(t)->alen -= 1;
+    }
+}
+
+// Expands the array part, moving any integer keys that
+// now fit out of the hash part
+static void mu_tbl_arrayexpand(mu_t t, mlen_t len) {
+    mu_tbl_touch(t);
     mu_t *oldarray = mtbl(t)->array;
-    muint_t oldcount = mu_tbl_count(t);
-    muint_t oldsize  = mu_tbl_size(t);
+    muint_t oldsize = mu_tbl_asize(t);
+
+    mtbl(t)->apw2 = mu_tbl_arraynpw2(len);
+    muint_t size = (muint_t)1 << mtbl(t)->apw2;
+    mtbl(t)->array = mu_alloc(size*sizeof(mu_t));
+    memset(mtbl(t)->array, 0, size*sizeof(mu_t));
+
+    // unwrap the ring buffer while copying, there is nothing
+    // to copy when the array part is first allocated
+    muint_t alen = mtbl(t)->alen;
+    muint_t aoff = mtbl(t)->aoff;
+    if (alen > 0) {
+        muint_t first = (alen < oldsize - aoff) ? alen : oldsize - aoff;
+        memcpy(mtbl(t)->array, &oldarray[aoff], first*sizeof(mu_t));
+        memcpy(&mtbl(t)->array[first], oldarray, (alen - first)*sizeof(mu_t));
+    }
+    mu_dealloc(oldarray, oldsize*sizeof(mu_t));
+    mtbl(t)->aoff = 0;
 
-    mtbl(t)->npw2 = mu_tbl_listnpw2(len);
-    mtbl(t)->array = mu_alloc(mu_tbl_size(t)*sizeof(mu_t));
-    memset(mtbl(t)->array, 0, mu_tbl_size(t)*sizeof(mu_t));
+    if (!mtbl(t)->hnums) {
+        return;
+    }
 
-    memcpy(mtbl(t)->array, oldarray, oldcount*sizeof(mu_t));
-    mu_dealloc(oldarray, oldsize*sizeof(mu_t));
+    muint_t off = mu_tbl_off(t);
+    for (muint_t j = 0; j < mtbl(t)->hlen; j++) {
+        mu_t *p = &mtbl(t)->pairs[2*(j+off)];
+        muint_t i;
+
+        if (p[1] && mu_tbl_isindex(p[0], mu_tbl_asize(t), &i)) {
+            mtbl(t)->array[i] = p[1];
+            mtbl(t)->alen = (i+1 > mtbl(t)->alen) ? i+1 : mtbl(t)->alen;
+            mtbl(t)->nils += 1;
+            p[1] = 0;
+        }
+    }
 }
 
-static void mu_tbl_pairsexpand(mu_t t, mlen_t len) {
-    bool waslist = mu_tbl_islist(t);
-    mu_t *oldarray = mtbl(t)->array;
+// Rebuilds the hash part, dropping removed entries
+static void mu_tbl_hashexpand(mu_t t, mlen_t len) {
+    mu_tbl_touch(t);
+    mu_t *oldpairs = mtbl(t)->pairs;
     muint_t oldoff   = mu_tbl_off(t);
-    muint_t oldcount = mu_tbl_count(t);
-    muint_t oldsize  = mu_tbl_size(t);
+    muint_t oldcount = mtbl(t)->hlen;
+    muint_t oldsize  = mu_tbl_hsize(t);
 
-    mtbl(t)->npw2 = mu_tbl_pairsnpw2(len, &mtbl(t)->isize);
-    mtbl(t)->len = 0;
+    mtbl(t)->npw2 = mu_tbl_hashnpw2(len, &mtbl(t)->isize);
+    mtbl(t)->len -= oldcount - mtbl(t)->nils;
+    mtbl(t)->hlen = 0;
     mtbl(t)->nils = 0;
-    mtbl(t)->array = mu_alloc(2*mu_tbl_size(t)*sizeof(mu_t));
-    memset(mtbl(t)->array, 0, 2*mu_tbl_off(t)*sizeof(mu_t));
+    mtbl(t)->hnums = false;
+    mtbl(t)->pairs = mu_alloc(2*((muint_t)1 << mtbl(t)->npw2)*sizeof(mu_t));
+    memset(mtbl(t)->pairs, 0, 2*mu_tbl_off(t)*sizeof(mu_t));
 
     for (muint_t i = 0; i < oldcount; i++) {
-        if (waslist) {
-            mu_tbl_insert(t, mu_num_fromuint(i), oldarray[i]);
+        if (oldpairs[2*(i+oldoff)+1]) {
+            mu_tbl_insert(t, oldpairs[2*(i+oldoff)+0],
+                    oldpairs[2*(i+oldoff)+1]);
         } else {
-            mu_tbl_insert(t, oldarray[2*(i+oldoff)+0],
-                    oldarray[2*(i+oldoff)+1]);
+            mu_dec(oldpairs[2*(i+oldoff)+0]);
         }
     }
 
-    mu_dealloc(oldarray, (waslist ? 1 : 2)*oldsize*sizeof(mu_t));
+    mu_dealloc(oldpairs, 2*oldsize*sizeof(mu_t));
 }
 
 // Inserts a value in the table with the given key
@@ -254,81 +402,75 @@ void mu_tbl_insert(mu_t t, mu_t k, mu_t v) {
         return;
     }
 
-    muint_t mask = (1 << mtbl(t)->npw2) - 1;
-
-    if (mu_tbl_islist(t)) {
-        muint_t i = mu_num_getuint(k) & mask;
+    k = mu_str_internmu(k);
 
-        if (k == mu_num_fromuint(i) && mtbl(t)->array[i]) {
-            // replace old value
-            mu_t oldv = mtbl(t)->array[i];
-            mtbl(t)->array[i] = v;
-            mtbl(t)->len += (v ? 1 : 0) - 1;
-            mtbl(t)->nils += (!v ? 1 : 0);
-            mu_dec(oldv);
-            return;
-        } else if (!v) {
+    muint_t i;
+    if (mu_tbl_isindex(k, mu_tbl_asize(t), &i)) {
+        mu_t *slot = mu_tbl_slot(t, i);
+        if (!*slot && !v) {
             // nothing to remove
             return;
-        } else {
+        } else if (v && !*slot) {
             mu_checklen((muint_t)mtbl(t)->len + 1 <= (mlen_t)-1, "table");
+        }
 
-            if (k != mu_num_fromuint(i)) {
-                muint_t i = mu_num_getuint(k) & (2*mask+1);
-                if (k == mu_num_fromuint(i)) {
-                    // just needs bigger list
-                    mu_tbl_listexpand(t, i+1);
-                    mu_tbl_insert(t, k, v);
-                    return;
-                } else {
-                    // needs table
-                    mu_tbl_pairsexpand(t, mtbl(t)->len+1);
-                    mu_tbl_insert(t, k, v);
-                    return;
-                }
-            }
-
-            // new value fits
-            mtbl(t)->array[i] = v;
-            mtbl(t)->len += 1;
-            mtbl(t)->nils += i - (mtbl(t)->len-1);
-            return;
+        // array slots never move, so this is safe for cached lookups
+        mu_t oldv = *slot;
+        *slot = v;
+        mtbl(t)->len += (v ? 1 : 0) - (oldv ? 1 : 0);
+        mtbl(t)->alen = (v && i+1 > mtbl(t)->alen) ? i+1 : mtbl(t)->alen;
+        if (!v) {
+            mu_tbl_arraytrim(t);
         }
-    } else {
-        for (muint_t i = mu_tbl_hash(t, k);; i++) {
-            mu_t *p = mu_tbl_getpair(t, i & mask);
+        mu_dec(oldv);
+        return;
+    } else if (v && mu_tbl_isindex(k,
+            mtbl(t)->array ? 2*mu_tbl_asize(t) : MU_MINALLOC/sizeof(mu_t),
+            &i)) {
+        // just needs bigger array
+        mu_checklen((muint_t)mtbl(t)->len + 1 <= (mlen_t)-1, "table");
+        mu_tbl_arrayexpand(t, i+1);
+        mu_tbl_insert(t, k, v);
+        return;
+    }
 
-            if (p && p[0] == k) {
-                // replace old value
-                mu_t oldv = p[1];
-                p[1] = v;
-                mtbl(t)->len += (v ? 1 : 0) - (oldv ? 1 : 0);
-                mtbl(t)->nils += (!v ? 1 : 0) - (!oldv ? 1 : 0);
-                mu_dec(k);
-                mu_dec(oldv);
-                return;
-            } else if (!p && !v) {
-                // nothing to remove
-                return;
-            } else if (!p) {
-                mu_checklen((muint_t)mtbl(t)->len + 1 <= (mlen_t)-1, "table");
-
-                muint_t j = mu_tbl_off(t) + mu_tbl_count(t);
-                if (j >= mu_tbl_size(t)) {
-                    // needs bigger table
-                    mu_tbl_pairsexpand(t, mtbl(t)->len+1);
-                    mu_tbl_insert(t, k, v);
-                    return;
-                }
+    mu_t *p = mu_tbl_hashfind(t, k);
+    if (p) {
+        // replace old value
+        mu_t oldv = p[1];
+        p[1] = v;
+        mtbl(t)->len += (v ? 1 : 0) - (oldv ? 1 : 0);
+        mtbl(t)->nils += (!v ? 1 : 0) - (!oldv ? 1 : 0);
+        mu_dec(k);
+        mu_dec(oldv);
+        return;
+    } else if (!v) {
+        // nothing to remove
+        mu_dec(k);
+        return;
+    }
 
-                mtbl(t)->array[2*j+0] = k;
-                mtbl(t)->array[2*j+1] = v;
-                mtbl(t)->len += 1;
-                mu_tbl_setpair(t, i & mask, &mtbl(t)->array[2*j]);
-                return;
-            }
-        }
+    mu_checklen((muint_t)mtbl(t)->len + 1 <= (mlen_t)-1, "table");
+
+    muint_t j = mu_tbl_off(t) + mtbl(t)->hlen;
+    if (j >= mu_tbl_hsize(t)) {
+        // needs bigger hash part
+        mu_tbl_hashexpand(t, mtbl(t)->hlen - mtbl(t)->nils + 1);
+        mu_tbl_insert(t, k, v);
+        return;
+    }
+
+    mu_tbl_touch(t);
+    muint_t mask = mu_tbl_hsize(t) - 1;
+    for (i = mu_tbl_hash(t, k); mu_tbl_getpair(t, i & mask); i++) {
     }
+
+    mtbl(t)->pairs[2*j+0] = k;
+    mtbl(t)->pairs[2*j+1] = v;
+    mtbl(t)->len += 1;
+    mtbl(t)->hlen += 1;
+    mtbl(t)->hnums = mtbl(t)->hnums || mu_isnum(k);
+    mu_tbl_setpair(t, i & mask, &mtbl(t)->pairs[2*j]);
 }
 
 // Recursively assigns a value in the table with the given key
@@ -341,42 +483,41 @@ void mu_tbl_assign(mu_t head, mu_t k, mu_t v) {
         return;
     }
 
+    k = mu_str_internmu(k);
+
     for (mu_t t = head; t; t = mtbl(t)->tail) {
         ro = ro || mu_isrtbl(t);
-        muint_t mask = (1 << mtbl(t)->npw2) - 1;
-
-        if (mu_tbl_islist(t)) {
-            muint_t i = mu_num_getuint(k) & mask;
+        muint_t i;
 
-            if (k == mu_num_fromuint(i) && mtbl(t)->array[i]) {
+        if (mu_tbl_isindex(k, mu_tbl_asize(t), &i)) {
+            mu_t *slot = mu_tbl_slot(t, i);
+            if (*slot) {
                 mu_checkconst(!ro, "table");
 
                 // replace old value
-                mu_t oldv = mtbl(t)->array[i];
-                mtbl(t)->array[i] = v;
+                mu_t oldv = *slot;
+                *slot = v;
                 mtbl(t)->len += (v ? 1 : 0) - 1;
-                mtbl(t)->nils += (!v ? 1 : 0);
+                if (!v) {
+                    mu_tbl_arraytrim(t);
+                }
                 mu_dec(oldv);
                 return;
             }
         } else {
-            for (muint_t i = mu_tbl_hash(t, k);; i++) {
-                mu_t *p = mu_tbl_getpair(t, i & mask);
-
-                if (p && p[0] == k && p[1]) {
-                    mu_checkconst(!ro, "table");
-
-                    // replace old value
-                    mu_t oldv = p[1];
-                    p[1] = v;
-                    mtbl(t)->len  += (v ? 1 : 0) - (oldv ? 1 : 0);
-                    mtbl(t)->nils -= (v ? 1 : 0) - (oldv ? 1 : 0);
-                    mu_dec(k);
-                    mu_dec(oldv);
-                    return;
-                } else if (!p) {
-                    break;
-                }
+            mu_t *p = mu_tbl_hashfind(t, k);
+
+            if (p && p[1]) {
+                mu_checkconst(!ro, "table");
+
+                // replace old value
+                mu_t oldv = p[1];
+                p[1] = v;
+                mtbl(t)->len  += (v ? 1 : 0) - 1;
+                mtbl(t)->nils += (!v ? 1 : 0);
+                mu_dec(k);
+                mu_dec(oldv);
+                return;
             }
         }
     }
@@ -390,11 +531,13 @@ void mu_tbl_assign(mu_t head, mu_t k, mu_t v) {
 }
 
 
-// Performs iteration on a table
-bool mu_tbl_next(mu_t t, muint_t *ip, mu_t *kp, mu_t *vp) {
+// Performs iteration on a table, the array part
+// is iterated before the hash part
+bool mu_tbl_peek(mu_t t, muint_t *ip, mu_t *kp, mu_t *vp) {
     mu_assert(mu_istbl(t));
     muint_t off = mu_tbl_off(t);
-    muint_t count = mu_tbl_count(t);
+    muint_t alen = mtbl(t)->alen;
+    muint_t count = alen + mtbl(t)->hlen;
     muint_t i = *ip;
     mu_t k, v;
 
@@ -403,59 +546,83 @@ bool mu_tbl_next(mu_t t, muint_t *ip, mu_t *kp, mu_t *vp) {
             return false;
         }
 
-        if (mu_tbl_islist(t)) {
+        if (i < alen) {
             k = mu_num_fromuint(i);
-            v = mtbl(t)->array[i];
+            v = *mu_tbl_slot(t, i);
         } else {
-            k = mtbl(t)->array[2*(i+off)+0];
-            v = mtbl(t)->array[2*(i+off)+1];
+            k = mtbl(t)->pairs[2*(i-alen+off)+0];
+            v = mtbl(t)->pairs[2*(i-alen+off)+1];
         }
 
         i++;
     } while (!v);
 
-    if (kp) *kp = mu_inc(k);
-    if (vp) *vp = mu_inc(v);
+    if (kp) *kp = k;
+    if (vp) *vp = v;
     *ip = i;
     return true;
 }
 
-static mcnt_t mu_tbl_iter_step(mu_t scope, mu_t *frame) {
-    mu_t t = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    muint_t i = mu_num_getuint(mu_tbl_lookup(scope, mu_num_fromuint(1)));
+bool mu_tbl_next(mu_t t, muint_t *ip, mu_t *kp, mu_t *vp) {
+    if (!mu_tbl_peek(t, ip, kp, vp)) {
+        return false;
+    }
+
+    if (kp) mu_inc(*kp);
+    if (vp) mu_inc(*vp);
+    return true;
+}
+
+// State of table iteration, the table and position
+struct mtblstep {
+    mu_t t;
+    muint_t i;
+};
+
+static void mu_tbl_stepdestroy(mu_t b) {
+    mu_dec(((struct mtblstep *)mu_buf_getdata(b))->t);
+}
+
+static void mu_tbl_stepgcvisit(mu_t b, void (*visit)(mu_t *)) {
+    visit(&((struct mtblstep *)mu_buf_getdata(b))->t);
+}
+
+static mu_t mu_tbl_stepcreate(mu_t t) {
+    mu_t b = mu_buf_createvisit(sizeof(struct mtblstep),
+            mu_tbl_stepdestroy, mu_tbl_stepgcvisit);
+    struct mtblstep *step = mu_buf_getdata(b);
+    step->t = t;
+    step->i = 0;
+    return b;
+}
 
-    bool next = mu_tbl_next(t, &i, 0, &frame[0]);
-    mu_dec(t);
-    mu_tbl_insert(scope, mu_num_fromuint(1), mu_num_fromuint(i));
-    return next ? 1 : 0;
+static mcnt_t mu_tbl_iter_step(mu_t b, mu_t *frame) {
+    struct mtblstep *step = mu_buf_getdata(b);
+    return mu_tbl_next(step->t, &step->i, 0, &frame[0]) ? 1 : 0;
 }
 
 mu_t mu_tbl_iter(mu_t t) {
     mu_assert(mu_istbl(t));
     return mu_fn_fromsbfn(0x0, mu_tbl_iter_step,
-            mu_tbl_fromlist((mu_t[]){mu_inc(t), mu_num_fromuint(0)}, 2));
+            mu_tbl_stepcreate(mu_inc(t)));
 }
 
-static mcnt_t mu_tbl_pairs_step(mu_t scope, mu_t *frame) {
-    mu_t t = mu_tbl_lookup(scope, mu_num_fromuint(0));
-    muint_t i = mu_num_getuint(mu_tbl_lookup(scope, mu_num_fromuint(1)));
-
-    bool next = mu_tbl_next(t, &i, &frame[0], &frame[1]);
-    mu_dec(t);
-    mu_tbl_insert(scope, mu_num_fromuint(1), mu_num_fromuint(i));
-    return next ? 2 : 0;
+static mcnt_t mu_tbl_pairs_step(mu_t b, mu_t *frame) {
+    struct mtblstep *step = mu_buf_getdata(b);
+    return mu_tbl_next(step->t, &step->i, &frame[0], &frame[1]) ? 2 : 0;
 }
 
 mu_t mu_tbl_pairs(mu_t t) {
     mu_assert(mu_istbl(t));
     return mu_fn_fromsbfn(0x0, mu_tbl_pairs_step,
-        mu_tbl_fromlist((mu_t[]){mu_inc(t), mu_num_fromuint(0)}, 2));
+        mu_tbl_stepcreate(mu_inc(t)));
 }
 
 
 // Table creating functions
 mu_t mu_tbl_initlist(struct mtbl *t, mu_t (*const *def)(void), muint_t n) {
     mu_t m = (mu_t)((muint_t)t + MTTBL);
+    t->watched = true;
 
     for (muint_t i = 0; i < n; i++) {
         if (def[i]) {
@@ -469,6 +636,7 @@ mu_t mu_tbl_initlist(struct mtbl *t, mu_t (*const *def)(void), muint_t n) {
 mu_t mu_tbl_initpairs(struct mtbl *t, mu_t (*tail)(void),
             mu_t (*const (*def)[2])(void), muint_t n) {
     mu_t m = (mu_t)((muint_t)t + MTTBL);
+    t->watched = true;
     if (tail) {
         mu_tbl_settail(m, tail());
     }
@@ -544,100 +712,145 @@ mu_t mu_tbl_frommu(mu_t m) {
 }
 
 // Table operations
-void mu_tbl_push(mu_t t, mu_t p, mint_t i) {
-    mu_assert(mu_istbl(t));
-    mu_checkconst(!mu_isrtbl(t), "table");
-    i = (i >= 0) ? i : i + mtbl(t)->len;
-    i = (i > mtbl(t)->len) ? mtbl(t)->len : (i < 0) ? 0 : i;
-
-    if (mu_tbl_count(t) + 1 >= mu_tbl_size(t)) {
-        mu_checklen((muint_t)mtbl(t)->len + 1 <= (mlen_t)-1, "table");
+//
+// Indices are positions in iteration order, so in the array part
+// they are the keys. Numeric keys in the hash part past the index
+// are shifted to make room
+static void mu_tbl_hashshift(mu_t t, muint_t start, mint_t delta) {
+    if (!mtbl(t)->hnums) {
+        return;
+    }
 
-        if (mu_tbl_islist(t)) {
-            mu_tbl_listexpand(t, mu_tbl_count(t)+1);
-        } else {
-            mu_tbl_pairsexpand(t, mu_tbl_count(t)+1);
+    muint_t off = mu_tbl_off(t);
+    muint_t count = mtbl(t)->hlen;
+    bool shift = false;
+    bool nums = false;
+
+    for (muint_t j = 0; j < count; j++) {
+        mu_t *p = &mtbl(t)->pairs[2*(j+off)];
+        if (p[1] && mu_isnum(p[0])) {
+            nums = true;
+            if (mu_num_cmp(p[0], mu_num_fromuint(start)) >= 0) {
+                shift = true;
+                break;
+            }
         }
     }
 
-    if (mu_tbl_islist(t)) {
-        memmove(&mtbl(t)->array[i+1], &mtbl(t)->array[i],
-                (mu_tbl_size(t)-(i+1))*sizeof(mu_t));
-        mtbl(t)->array[i] = p;
-        mtbl(t)->len += (p ? 1 : 0);
-    } else {
-        muint_t off = mu_tbl_off(t);
-        muint_t count = mu_tbl_count(t);
-        mtbl(t)->len = 0;
-        mtbl(t)->nils = 0;
-        memset(mtbl(t)->array, 0, mu_tbl_size(t));
-
-        for (muint_t j = 0; j < i; j++) {
-            if (!mtbl(t)->array[2*(j+off)+1]) {
-                i++;
-            } else {
-                mu_tbl_insert(t, mtbl(t)->array[2*(j+off)+0],
-                        mtbl(t)->array[2*(j+off)+1]);
-            }
+    if (!shift) {
+        mtbl(t)->hnums = nums;
+        return;
+    }
+
+    mu_tbl_touch(t);
+    mu_t *oldpairs = mtbl(t)->pairs;
+    muint_t oldsize = mu_tbl_hsize(t);
+    mtbl(t)->len -= count - mtbl(t)->nils;
+    mtbl(t)->hlen = 0;
+    mtbl(t)->nils = 0;
+    mtbl(t)->hnums = false;
+    mtbl(t)->pairs = mu_alloc(2*oldsize*sizeof(mu_t));
+    memset(mtbl(t)->pairs, 0, 2*mu_tbl_off(t)*sizeof(mu_t));
+
+    for (muint_t j = 0; j < count; j++) {
+        mu_t k = oldpairs[2*(j+off)+0];
+        mu_t v = oldpairs[2*(j+off)+1];
+        if (v && mu_isnum(k) &&
+                mu_num_cmp(k, mu_num_fromuint(start)) >= 0) {
+            k = mu_num_add(k, mu_num_fromint(delta));
         }
 
-        memmove(&mtbl(t)->array[2*(i+1+off)], &mtbl(t)->array[2*(i+off)],
-                2*(mu_tbl_size(t)-(i+1+off))*sizeof(mu_t));
-        mu_tbl_insert(t, mu_num_fromuint(i), p);
+        mu_tbl_insert(t, k, v);
+    }
 
-        for (muint_t j = i; j < count; j++) {
-            mu_t k = mtbl(t)->array[2*(j+1+off)+0];
-            if (mu_isnum(k)) {
-                k = mu_num_add(k, mu_num_fromuint(1));
-            }
+    mu_dealloc(oldpairs, 2*oldsize*sizeof(mu_t));
+}
+
+// Pushing and popping moves whichever side of the array
+// part is shorter, so both ends take constant time
+void mu_tbl_push(mu_t t, mu_t p, mint_t i) {
+    mu_assert(mu_istbl(t));
+    mu_checkconst(!mu_isrtbl(t), "table");
+    mu_tbl_touch(t);
+    muint_t count = mtbl(t)->alen;
+    i = (i >= 0) ? i : i + (mint_t)mtbl(t)->len;
+    i = (i > (mint_t)count) ? (mint_t)count : (i < 0) ? 0 : i;
+
+    if (!p && (muint_t)i == count) {
+        // nothing to push, but later keys still shift
+        mu_tbl_hashshift(t, i, +1);
+        return;
+    }
+
+    mu_checklen((muint_t)mtbl(t)->len + 1 <= (mlen_t)-1, "table");
+    if (count + 1 > mu_tbl_asize(t)) {
+        mu_tbl_arrayexpand(t, count + 1);
+    }
 
-            mu_tbl_insert(t, k, mtbl(t)->array[2*(j+1+off)+1]);
+    if ((muint_t)i < count/2) {
+        mtbl(t)->aoff = (mtbl(t)->aoff - 1) & (mu_tbl_asize(t)-1);
+        for (muint_t j = 0; j < (muint_t)i; j++) {
+            *mu_tbl_slot(t, j) = *mu_tbl_slot(t, j+1);
+        }
+    } else {
+        for (muint_t j = count; j > (muint_t)i; j--) {
+            *mu_tbl_slot(t, j) = *mu_tbl_slot(t, j-1);
         }
     }
+
+    *mu_tbl_slot(t, i) = p;
+    mtbl(t)->len += (p ? 1 : 0);
+    mtbl(t)->alen = count + 1;
+
+    mu_tbl_hashshift(t, i, +1);
 }
 
 mu_t mu_tbl_pop(mu_t t, mint_t i) {
     mu_assert(mu_istbl(t));
     mu_checkconst(!mu_isrtbl(t), "table");
-    i = (i >= 0) ? i : i + mtbl(t)->len;
-    i = (i > mtbl(t)->len) ? mtbl(t)->len : (i < 0) ? 0 : i;
-
-    if (mu_tbl_islist(t)) {
-        mu_t p = mtbl(t)->array[i];
-        memmove(&mtbl(t)->array[i], &mtbl(t)->array[i+1],
-                (mu_tbl_size(t)-(i+1))*sizeof(mu_t));
-        mtbl(t)->len -= (p ? 1 : 0);
-        return p;
-    } else {
-        muint_t off = mu_tbl_off(t);
-        muint_t count = mu_tbl_count(t);
-        mtbl(t)->len = 0;
-        mtbl(t)->nils = 0;
-        memset(mtbl(t)->array, 0, mu_tbl_size(t));
-
-        for (muint_t j = 0; j < i; j++) {
-            if (!mtbl(t)->array[2*(j+off)+1]) {
-                i++;
-            } else {
-                mu_tbl_insert(t, mtbl(t)->array[2*(j+off)+0],
-                        mtbl(t)->array[2*(j+off)+1]);
+    mu_tbl_touch(t);
+    muint_t count = mtbl(t)->alen;
+    i = (i >= 0) ? i : i + (mint_t)mtbl(t)->len;
+    i = (i < 0) ? 0 : i;
+
+    mu_t p = 0;
+    if ((muint_t)i < count) {
+        p = *mu_tbl_slot(t, i);
+
+        if ((muint_t)i < count/2) {
+            for (muint_t j = i; j > 0; j--) {
+                *mu_tbl_slot(t, j) = *mu_tbl_slot(t, j-1);
             }
-        }
-
-        mu_dec(mtbl(t)->array[2*(i+off)+0]);
-        mu_t p = mtbl(t)->array[2*(i+off)+1];
 
-        for (muint_t j = i+1; j < count; j++) {
-            mu_t k = mtbl(t)->array[2*(j+off)+0];
-            if (mu_isnum(k)) {
-                k = mu_num_sub(k, mu_num_fromuint(1));
+            *mu_tbl_slot(t, 0) = 0;
+            mtbl(t)->aoff = (mtbl(t)->aoff + 1) & (mu_tbl_asize(t)-1);
+        } else {
+            for (muint_t j = i; j+1 < count; j++) {
+                *mu_tbl_slot(t, j) = *mu_tbl_slot(t, j+1);
             }
 
-            mu_tbl_insert(t, k, mtbl(t)->array[2*(j+off)+1]);
+            *mu_tbl_slot(t, count-1) = 0;
         }
 
-        return p;
+        mtbl(t)->alen = count - 1;
+        mu_tbl_arraytrim(t);
+    } else {
+        muint_t off = mu_tbl_off(t);
+        muint_t j = i - count;
+        for (muint_t k = 0; k < mtbl(t)->hlen; k++) {
+            mu_t *q = &mtbl(t)->pairs[2*(k+off)];
+            if (q[1] && j-- == 0) {
+                p = q[1];
+                q[1] = 0;
+                mtbl(t)->nils += 1;
+                break;
+            }
+        }
     }
+
+    mtbl(t)->len -= (p ? 1 : 0);
+    mu_tbl_hashshift(t, i+1, -1);
+    return p;
 }
 
 mu_t mu_tbl_concat(mu_t a, mu_t b, mu_t offset) {
@@ -869,12 +1082,9 @@ static void mu_tbl_repr_nested(mu_t t, mu_t *s, muint_t *n, mu_t depth) {
         return;
     }
 
-    bool linear = mu_tbl_islist(t);
-    for (muint_t i = 0; linear && i < mu_tbl_getlen(t); i++) {
-        if (!mtbl(t)->array[i]) {
-            linear = false;
-        }
-    }
+    // linear if every value is in the array part without holes
+    bool linear = mtbl(t)->hlen == mtbl(t)->nils &&
+                  mtbl(t)->len == mtbl(t)->alen;
 
     mu_buf_pushc(s, n, '[');
 
@@ -915,7 +1125,7 @@ mu_t mu_tbl_repr(mu_t t, mu_t depth) {
 
     mu_tbl_repr_nested(t, &s, &n, depth);
 
-    return mu_str_intern(s, n);
+    return mu_str_frombuf(s, n);
 }
 
 
@@ -8,24 +8,53 @@
 #define MU_TBL_H
 #include "config.h"
 #include "types.h"
+#include "state.h"
 
 
 // Definition of Mu's table type
 //
-// Each table is composed of an array of values
-// with a stride for keys/values. If keys/values
-// is not stored in the array it is implicitely
-// stored as a range/offset based on the specified
-// offset and length.
+// Each table is composed of an array part and a hash part.
+// Non-negative integer keys that fit are stored directly
+// in the array part, and any other keys are stored in the
+// hash part as key/value pairs in insertion order behind
+// an array of indices.
+//
+// The array part is a ring buffer starting at aoff, so
+// values can be pushed and popped from either end in place.
+//
+// Tables used as tails or as the start of cached lookups
+// are watched, and increment the epoch of the state when their
+// slots move.
 struct mtbl {
     mref_t ref;
+    uint8_t gc;
     mlen_t len;
+    mlen_t alen;
+    mlen_t hlen;
     mlen_t nils;
+    mlen_t aoff;
+    muintq_t apw2;
     muintq_t npw2;
     muintq_t isize;
+    muintq_t hnums;
+    muintq_t watched;
 
     mu_t tail;
     mu_t *array;
+    mu_t *pairs;
+};
+
+// Definition of lookup caches
+//
+// Caches remember the slot a key was found in when looked up
+// from a given table. The slot is valid as long as no watched
+// table has changed, which is tracked by the epoch of the state.
+// Caches hold a reference to their key, released with the code.
+struct mcache {
+    mu_t tbl;
+    mu_t key;
+    mu_t *slot;
+    muint_t epoch;
 };
 
 
@@ -52,6 +81,9 @@ mu_inline mu_t mu_tbl_const(mu_t t);
 // returns either that value or nil
 mu_t mu_tbl_lookup(mu_t t, mu_t k);
 
+// Recursively looks up a key in the table through a lookup cache
+mu_inline mu_t mu_tbl_lookupcache(mu_t t, mu_t k, struct mcache *c);
+
 // Inserts a value in the table with the given key
 // without decending down the tail chain
 void mu_tbl_insert(mu_t t, mu_t k, mu_t v);
@@ -65,6 +97,10 @@ bool mu_tbl_next(mu_t t, muint_t *i, mu_t *k, mu_t *v);
 mu_t mu_tbl_iter(mu_t t);
 mu_t mu_tbl_pairs(mu_t t);
 
+// Iterates without taking references, for reading tables
+// owned by another state while that state is not running
+bool mu_tbl_peek(mu_t t, muint_t *i, mu_t *k, mu_t *v);
+
 // Table representation
 mu_t mu_tbl_parsen(const mbyte_t **pos, const mbyte_t *end);
 mu_t mu_tbl_parse(const char *s, muint_t n);
@@ -97,6 +133,17 @@ mu_inline mu_t mu_tbl_const(mu_t t) {
     return mu_inc((mu_t)((MTTBL ^ MTRTBL) | (muint_t)t));
 }
 
+// Table lookup through cache
+mu_inline mu_t mu_tbl_lookupcache(mu_t t, mu_t k, struct mcache *c) {
+    extern mu_t mu_tbl_lookupmiss(mu_t t, mu_t k, struct mcache *c);
+    if (c->tbl == t && c->key == k && c->epoch == mu_state->epoch) {
+        mu_dec(k);
+        return mu_inc(*c->slot);
+    }
+
+    return mu_tbl_lookupmiss(t, k, c);
+}
+
 
 // Table constant macros
 #define MU_DEF_LIST(name, ...)                                              \
@@ -107,9 +154,8 @@ mu_pure mu_t name(void) {                                                   \
                                                                             \
     extern mu_t mu_tbl_initlist(struct mtbl *,                              \
             mu_t (*const *)(void), muint_t);                                \
-    if (!ref) {                                                             \
-        ref = mu_tbl_initlist(&inst, def, sizeof(def) / sizeof(def[0]));    \
-    }                                                                       \
+    MU_DEF_INIT(ref, mu_tbl_initlist(&inst,                                 \
+            def, sizeof(def) / sizeof(def[0])))                             \
                                                                             \
     return ref;                                                             \
 }
@@ -122,10 +168,8 @@ mu_pure mu_t name(void) {                                                   \
                                                                             \
     extern mu_t mu_tbl_initpairs(struct mtbl *, mu_t (*)(void),             \
             mu_t (*const (*)[2])(void), muint_t);                           \
-    if (!ref) {                                                             \
-        ref = mu_tbl_initpairs(&inst, 0,                                    \
-                def, sizeof(def) / sizeof(def[0]));                         \
-    }                                                                       \
+    MU_DEF_INIT(ref, mu_tbl_initpairs(&inst, 0,                             \
+            def, sizeof(def) / sizeof(def[0])))                             \
                                                                             \
     return ref;                                                             \
 }
@@ -138,10 +182,8 @@ mu_pure mu_t name(void) {                                                   \
                                                                             \
     extern mu_t mu_tbl_initpairs(struct mtbl *, mu_t (*)(void),             \
             mu_t (*const (*)[2])(void), muint_t);                           \
-    if (!ref) {                                                             \
-        ref = mu_tbl_initpairs(&inst, tail,                                 \
-                def, sizeof(def) / sizeof(def[0]));                         \
-    }                                                                       \
+    MU_DEF_INIT(ref, mu_tbl_initpairs(&inst, tail,                          \
+            def, sizeof(def) / sizeof(def[0])))                             \
                                                                             \
     return ref;                                                             \
 }
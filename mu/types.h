@@ -31,8 +31,8 @@ typedef int64_t  mint_t;
 typedef uint64_t muint_t;
 #endif
 
-// Currently the num type is just based on floats,
-// although an integer implementation may be possible
+// The num type stores integers exactly and falls back to floats,
+// see num.h for the representation
 //
 // Requires sizeof(mfloat_t) <= sizeof(muint_t)
 #ifdef MU32
@@ -90,12 +90,39 @@ mu_inline bool mu_istbl(mu_t m) { return (6 & (muint_t)m) == MTTBL; }
 mu_inline bool mu_isfn(mu_t m)  { return mu_gettype(m) == MTFN;  }
 mu_inline bool mu_isref(mu_t m) { return 6 & (muint_t)m; }
 
+// State for cycle collection
+//
+// Tables and functions are the only types that can form reference
+// cycles. Both store a gc byte directly after their reference count,
+// which is used to buffer possible roots of garbage cycles.
+enum mgc_state {
+    MU_GC_BLACK    = 0x0, // in use
+    MU_GC_GRAY     = 0x1, // possible member of a cycle
+    MU_GC_WHITE    = 0x2, // member of a garbage cycle
+    MU_GC_PURPLE   = 0x3, // possible root of a cycle
+    MU_GC_COLOR    = 0x3,
+    MU_GC_BUFFERED = 0x4, // stored in the buffer of possible roots
+    MU_GC_DEAD     = 0x8, // destroyed while buffered
+};
+
+struct mgc {
+    mref_t ref;
+    uint8_t gc;
+};
+
+mu_inline bool mu_iscyclic(mu_t m) {
+    return (0xb0 >> mu_gettype(m)) & 1;
+}
+
 // Reference counting for mu types
 //
 // Deallocates immediately when reference count hits zero. If a type
 // does have zero, this indicates the variable is constant and may be
 // statically allocated. As a nice side effect, overflow results in
 // constant variables.
+//
+// Decrementing a table or function without destroying it marks
+// it as a possible root of a garbage cycle.
 mu_inline mu_t mu_inc(mu_t m) {
     if (mu_isref(m)) {
         mref_t *ref = (mref_t *)(~7 & (muint_t)m);
@@ -122,12 +149,14 @@ mu_inline void mu_dec(mu_t m) {
             if (count == 0) {
                 extern void mu_destroy(mu_t m);
                 mu_destroy(m);
+            } else if (mu_unlikely(mu_iscyclic(m))) {
+                extern void mu_gc_buffer(mu_t m);
+                mu_gc_buffer(m);
             }
         }
     }
 }
 
-
 // Multiple variables can be passed in a frame,
 // which is a small array of MU_FRAME elements.
 //
@@ -159,5 +188,18 @@ void mu_frameconvert(mcnt_t sc, mcnt_t dc, mu_t *frame);
 #define MU_DEF(name) \
 extern mu_pure mu_t name(void);
 
+// Lazy initialization of constants, which are shared by every state,
+// so initialization is serialized by the process-wide state lock
+#define MU_DEF_INIT(ref, init)                                              \
+    if (!mu_atomic_load(&ref)) {                                            \
+        extern void mu_state_lock(void);                                    \
+        extern void mu_state_unlock(void);                                  \
+        mu_state_lock();                                                    \
+        if (!ref) {                                                         \
+            mu_atomic_store(&ref, init);                                    \
+        }                                                                   \
+        mu_state_unlock();                                                  \
+    }
+
 
 #endif
@@ -16,73 +16,382 @@ static mu_noreturn mu_errorbcode(void) {
 }
 
 
-// Encode the specified opcode and return its size
 // Encode the specified opcode and return its size
 // Note: size of the jump opcodes currently can not change based on argument
-void mu_encode(void (*emit)(void *, mbyte_t), void *p,
-               mop_t op, mint_t d, mint_t a, mint_t b) {
+static void mu_emit16(void (*emit)(void *, mbyte_t), void *p, uint16_t u16) {
     union {
         uint16_t u16;
         uint8_t u8[2];
-    } ins;
+    } ins = {u16};
+
+    emit(p, ins.u8[0]);
+    emit(p, ins.u8[1]);
+}
+
+void mu_encode(void (*emit)(void *, mbyte_t), void *p,
+               mop_t op, mint_t d, mint_t a, mint_t b) {
+    uint16_t ins;
+    mu_checkbcode((op <= 0xf || (op >= MU_OP_ADD && op <= MU_OP_NOT)) &&
+                  d >= 0 && d < MU_REGS);
+
+    // Register operands past r15 need prefixes
+    mint_t ah = 0;
+    mint_t bh = 0;
+    if (op >= MU_OP_LOOKDN && op <= MU_OP_ASSIGN) {
+        mu_checkbcode(a >= 0 && a < MU_REGS && b >= 0 && b < MU_REGS);
+        ah = a >> 4;
+        bh = b >> 4;
+    } else if (op >= MU_OP_ADD && op <= MU_OP_NOT) {
+        mu_checkbcode(a >= 0 && a < MU_REGS);
+        ah = a >> 4;
+    }
 
-    mu_checkbcode(op <= 0xf && d <= 0xf);
-    ins.u16 =  0xf000 & (op << 12);
-    ins.u16 |= 0x0f00 & (d << 8);
+    mint_t prefixes = 0;
+    if ((d >> 4) || ah || bh) {
+        mu_emit16(emit, p, 0xd0f0 | ((d >> 4) << 8) | ah);
+        prefixes += 1;
+    }
+
+    if (bh) {
+        mu_emit16(emit, p, 0xd0f0 | (bh << 8));
+        prefixes += 1;
+    }
+
+    ins =  0xf000 & ((op > 0xf ? MU_OP_ARITH : op) << 12);
+    ins |= 0x0f00 & (d << 8);
 
     if (op >= MU_OP_RET && op <= MU_OP_DROP) {
         mu_checkbcode(a <= 0xff);
-        ins.u16 |= 0x00ff & a;
-        emit(p, ins.u8[0]);
-        emit(p, ins.u8[1]);
+        ins |= 0x00ff & a;
+        mu_emit16(emit, p, ins);
     } else if (op >= MU_OP_LOOKDN && op <= MU_OP_ASSIGN) {
-        mu_checkbcode(a <= 0xf && b <= 0xf);
-        ins.u16 |= 0x00f0 & (a << 4);
-        ins.u16 |= 0x000f & b;
-        emit(p, ins.u8[0]);
-        emit(p, ins.u8[1]);
+        ins |= 0x00f0 & (a << 4);
+        ins |= 0x000f & b;
+        mu_emit16(emit, p, ins);
     } else if (op >= MU_OP_IMM && op <= MU_OP_TBL) {
         mu_checkbcode(a <= 0xffff);
         if (a > 0xfe) {
-            ins.u16 |= 0x00ff;
-            emit(p, ins.u8[0]);
-            emit(p, ins.u8[1]);
-
-            ins.u16 = a;
-            emit(p, ins.u8[0]);
-            emit(p, ins.u8[1]);
+            mu_emit16(emit, p, ins | 0x00ff);
+            mu_emit16(emit, p, a);
         } else {
-            ins.u16 |= 0x00ff & a;
-            emit(p, ins.u8[0]);
-            emit(p, ins.u8[1]);
+            mu_emit16(emit, p, ins | (0x00ff & a));
         }
+    } else if (op >= MU_OP_ADD && op <= MU_OP_NOT) {
+        ins |= 0x00f0 & (op << 4);
+        ins |= 0x000f & a;
+        mu_emit16(emit, p, ins);
     } else if (op >= MU_OP_JFALSE && op <= MU_OP_JUMP) {
-        a = (a / 2) - 2;
+        a = (a / 2) - 2 - prefixes;
         mu_checkbcode(a <= 0x7fff && a >= -0x8000);
 
-        ins.u16 |= 0x00ff;
-        emit(p, ins.u8[0]);
-        emit(p, ins.u8[1]);
+        mu_emit16(emit, p, ins | 0x00ff);
+        mu_emit16(emit, p, a);
+    }
+}
 
-        ins.u16 = a;
-        emit(p, ins.u8[0]);
-        emit(p, ins.u8[1]);
+muint_t mu_decode(const uint16_t *pc,
+                  mop_t *op, mint_t *d, mint_t *a, mint_t *b) {
+    const uint16_t *start = pc;
+    mint_t ext[3] = {0, 0, 0};
+    for (muint_t i = 0; (pc[0] & 0xf0f0) == 0xd0f0 && i < 3; i += 2) {
+        ext[i] = 0xf & (pc[0] >> 8);
+        if (i+1 < 3) {
+            ext[i+1] = 0xf & pc[0];
+        }
+        pc++;
     }
+
+    uint16_t ins = *pc++;
+    *op = ins >> 12;
+    *d = (ext[0] << 4) | (0xf & (ins >> 8));
+    *a = 0;
+    *b = 0;
+
+    if (*op >= MU_OP_RET && *op <= MU_OP_DROP) {
+        *a = 0xff & ins;
+    } else if (*op >= MU_OP_LOOKDN && *op <= MU_OP_ASSIGN) {
+        *a = (ext[1] << 4) | (0xf & (ins >> 4));
+        *b = (ext[2] << 4) | (0xf & ins);
+    } else if (*op >= MU_OP_IMM && *op <= MU_OP_TBL) {
+        *a = 0xff & ins;
+        if (*a == 0xff) {
+            *a = *pc++;
+        }
+    } else if (*op == MU_OP_ARITH) {
+        *op = MU_OP_ADD + (0xf & (ins >> 4));
+        *a = (ext[1] << 4) | (0xf & ins);
+    } else {
+        *a = (int16_t)(ins << 8) >> 8;
+        if (*a == -1) {
+            *a = (int16_t)*pc++;
+        }
+    }
+
+    return pc - start;
 }
 
 mint_t mu_patch(void *p, mint_t nj) {
     uint16_t *c = p;
+    mint_t prefixes = 0;
+    while ((c[0] & 0xf0f0) == 0xd0f0) {
+        c++;
+        prefixes++;
+    }
+
     mu_assert((c[0] >> 12) >= MU_OP_JFALSE && (c[0] >> 12) <= MU_OP_JUMP);
 
-    mint_t pj = c[1];
-    c[1] = (nj / 2) - 2;
+    mint_t pj = 2*((int16_t)c[1] + 2 + prefixes);
+    c[1] = (nj / 2) - 2 - prefixes;
 
     return pj;
 }
 
 
+// Builtin functions implemented by the arithmetic opcodes
+static mu_t (*const mu_arith_def[16])(void) = {
+    [0xf & MU_OP_ADD]  = mu_add_def,
+    [0xf & MU_OP_SUB]  = mu_sub_def,
+    [0xf & MU_OP_MUL]  = mu_mul_def,
+    [0xf & MU_OP_DIV]  = mu_div_def,
+    [0xf & MU_OP_IDIV] = mu_idiv_def,
+    [0xf & MU_OP_MOD]  = mu_mod_def,
+    [0xf & MU_OP_POW]  = mu_pow_def,
+    [0xf & MU_OP_EQ]   = mu_eq_def,
+    [0xf & MU_OP_NEQ]  = mu_neq_def,
+    [0xf & MU_OP_LT]   = mu_lt_def,
+    [0xf & MU_OP_LTE]  = mu_lte_def,
+    [0xf & MU_OP_GT]   = mu_gt_def,
+    [0xf & MU_OP_GTE]  = mu_gte_def,
+    [0xf & MU_OP_NEG]  = mu_sub_def,
+    [0xf & MU_OP_NOT]  = mu_not_def,
+};
+
+// Names the operators are looked up by
+static mu_t (*const mu_arith_keys[16])(void) = {
+    [0xf & MU_OP_ADD]  = mu_add_key_def,
+    [0xf & MU_OP_SUB]  = mu_sub_key_def,
+    [0xf & MU_OP_MUL]  = mu_mul_key_def,
+    [0xf & MU_OP_DIV]  = mu_div_key_def,
+    [0xf & MU_OP_IDIV] = mu_idiv_key_def,
+    [0xf & MU_OP_MOD]  = mu_mod_key_def,
+    [0xf & MU_OP_POW]  = mu_pow_key_def,
+    [0xf & MU_OP_EQ]   = mu_eq_key_def,
+    [0xf & MU_OP_NEQ]  = mu_neq_key_def,
+    [0xf & MU_OP_LT]   = mu_lt_key_def,
+    [0xf & MU_OP_LTE]  = mu_lte_key_def,
+    [0xf & MU_OP_GT]   = mu_gt_key_def,
+    [0xf & MU_OP_GTE]  = mu_gte_key_def,
+    [0xf & MU_OP_NEG]  = mu_sub_key_def,
+    [0xf & MU_OP_NOT]  = mu_not_key_def,
+};
+
+mu_t mu_arith_key(mop_t op) {
+    return mu_arith_keys[0xf & op]();
+}
+
+mop_t mu_arith(mu_t fn, mcnt_t args) {
+    for (mop_t op = MU_OP_ADD; op <= MU_OP_NOT; op++) {
+        mcnt_t opargs = (op == MU_OP_NEG || op == MU_OP_NOT) ? 1 : 2;
+        if (mu_arith_def[0xf & op]() == fn && opargs == args) {
+            return op;
+        }
+    }
+
+    return 0;
+}
+
+
+#ifdef MU_PROF
+// Profiling state
+//
+// Frames of mu_exec are linked on the C stack. Frames abandoned by
+// an error are found by their address, since any live frame must be
+// further up the stack than the frame being pushed.
+struct mprofframe {
+    struct mprofframe *parent;
+    mu_t code;
+    muint_t gen;
+    muint_t index;
+    muint_t node;
+    bool active;
+    muint_t op;
+    muint_t off;
+};
+
+struct mprofcount mu_prof_ops[MU_PROF_OPS];
+struct mprofcode *mu_prof_codes = 0;
+muint_t mu_prof_codecount = 0;
+struct mprofnode *mu_prof_nodes = 0;
+muint_t mu_prof_nodecount = 0;
+
+static muint_t mu_prof_codesize = 0;
+static muint_t mu_prof_nodesize = 0;
+static muint_t mu_prof_gen = 0;
+static struct mprofframe *mu_prof_top = 0;
+static uint64_t mu_prof_last = 0;
+
+mu_inline uint64_t mu_prof_cycles(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#elif defined(__GNUC__) && defined(__aarch64__)
+    uint64_t t;
+    __asm__ volatile ("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    return 0;
+#endif
+}
+
+static void *mu_prof_grow(void *list, muint_t *size, muint_t len,
+                          muint_t elem) {
+    if (len < *size) {
+        return list;
+    }
+
+    muint_t nsize = *size ? 2 * *size : 16;
+    void *nlist = mu_alloc(nsize * elem);
+    memcpy(nlist, list, len * elem);
+    mu_dealloc(list, *size * elem);
+    *size = nsize;
+    return nlist;
+}
+
+static muint_t mu_prof_code(mu_t c) {
+    struct mcode *code = mu_buf_getdata(c);
+    if (code->prof) {
+        return code->prof - 1;
+    }
+
+    mu_prof_codes = mu_prof_grow(mu_prof_codes, &mu_prof_codesize,
+            mu_prof_codecount, sizeof(struct mprofcode));
+
+    muint_t index = mu_prof_codecount++;
+    struct mprofcode *p = &mu_prof_codes[index];
+    p->code = mu_inc(c);
+    p->total.count = 0;
+    p->total.cycles = 0;
+    p->ins = mu_alloc((code->bcount/2) * sizeof(struct mprofcount));
+    memset(p->ins, 0, (code->bcount/2) * sizeof(struct mprofcount));
+
+    code->prof = index + 1;
+    return index;
+}
+
+static muint_t mu_prof_node(muint_t parent, muint_t code) {
+    // call trees are small enough to search linearly
+    for (muint_t i = 1; i < mu_prof_nodecount; i++) {
+        if (mu_prof_nodes[i].parent == parent &&
+                mu_prof_nodes[i].code == code) {
+            return i;
+        }
+    }
+
+    mu_prof_nodes = mu_prof_grow(mu_prof_nodes, &mu_prof_nodesize,
+            mu_prof_nodecount, sizeof(struct mprofnode));
+
+    if (mu_prof_nodecount == 0) {
+        mu_prof_nodes[0] = (struct mprofnode){0};
+        mu_prof_nodecount = 1;
+    }
+
+    muint_t index = mu_prof_nodecount++;
+    mu_prof_nodes[index] = (struct mprofnode){parent, code, {0, 0}};
+    return index;
+}
+
+static void mu_prof_attach(struct mprofframe *f) {
+    f->gen = mu_prof_gen;
+    f->index = mu_prof_code(f->code);
+    f->node = mu_prof_node(f->parent ? f->parent->node : 0, f->index);
+}
+
+// Charges cycles since the last tick to the running instruction
+static void mu_prof_charge(void) {
+    uint64_t now = mu_prof_cycles();
+    struct mprofframe *f = mu_prof_top;
+
+    if (f && f->active && f->gen == mu_prof_gen) {
+        uint64_t delta = now - mu_prof_last;
+        mu_prof_ops[f->op].cycles += delta;
+        mu_prof_codes[f->index].total.cycles += delta;
+        mu_prof_codes[f->index].ins[f->off].cycles += delta;
+        mu_prof_nodes[f->node].self.cycles += delta;
+    }
+
+    mu_prof_last = now;
+}
+
+static void mu_prof_push(struct mprofframe *f) {
+    while (mu_prof_top && (muint_t)mu_prof_top <= (muint_t)f) {
+        mu_prof_top = mu_prof_top->parent;
+    }
+
+    mu_prof_charge();
+    f->parent = mu_prof_top;
+    f->code = 0;
+    f->active = false;
+    mu_prof_top = f;
+}
+
+static void mu_prof_enter(struct mprofframe *f, mu_t c) {
+    mu_prof_charge();
+    f->code = c;
+    f->active = false;
+    mu_prof_attach(f);
+}
+
+static void mu_prof_pop(struct mprofframe *f) {
+    mu_prof_charge();
+    mu_prof_top = f->parent;
+}
+
+static void mu_prof_ins(struct mprofframe *f,
+                        const uint16_t *pc, const uint16_t *bcode) {
+    mu_prof_charge();
+    if (f->gen != mu_prof_gen) {
+        mu_prof_attach(f);
+    }
+
+    f->active = true;
+    f->op = mu_prof_op(*pc);
+    f->off = pc - bcode;
+    mu_prof_ops[f->op].count += 1;
+    mu_prof_codes[f->index].total.count += 1;
+    mu_prof_codes[f->index].ins[f->off].count += 1;
+    mu_prof_nodes[f->node].self.count += 1;
+}
+
+void mu_prof_reset(void) {
+    for (muint_t i = 0; i < mu_prof_codecount; i++) {
+        struct mprofcode *p = &mu_prof_codes[i];
+        ((struct mcode *)mu_buf_getdata(p->code))->prof = 0;
+        mu_dealloc(p->ins,
+                (mu_code_getbcodelen(p->code)/2) * sizeof(struct mprofcount));
+        mu_dec(p->code);
+    }
+
+    memset(mu_prof_ops, 0, sizeof mu_prof_ops);
+    mu_prof_codecount = 0;
+    mu_prof_nodecount = 0;
+
+    // running frames reattach on their next instruction
+    mu_prof_gen += 1;
+}
+
+#define VM_PROF_PUSH(f)         mu_prof_push(f)
+#define VM_PROF_ENTER(f, c)     mu_prof_enter(f, c)
+#define VM_PROF_POP(f)          mu_prof_pop(f)
+#define VM_PROF_INS(f, pc, b)   mu_prof_ins(f, pc, b)
+#else
+#define VM_PROF_PUSH(f)
+#define VM_PROF_ENTER(f, c)
+#define VM_PROF_POP(f)
+#define VM_PROF_INS(f, pc, b)
+#endif
+
+
 // Virtual machine dispatch macros
-#ifdef MU_COMPUTED_GOTO
+#if defined(MU_COMPUTED_GOTO) && !defined(MU_PROF)
 #define VM_DISPATCH(pc)                                                     \
     {   static void *const vm_entry[16] = {                                 \
             [MU_OP_IMM]    = &&VM_ENTRY_MU_OP_IMM,                          \
@@ -95,8 +404,8 @@ mint_t mu_patch(void *p, mint_t nj) {
             [MU_OP_LOOKDN] = &&VM_ENTRY_MU_OP_LOOKDN,                       \
             [MU_OP_INSERT] = &&VM_ENTRY_MU_OP_INSERT,                       \
             [MU_OP_ASSIGN] = &&VM_ENTRY_MU_OP_ASSIGN,                       \
+            [MU_OP_ARITH]  = &&VM_ENTRY_MU_OP_ARITH,                        \
             [MU_OP_JUMP]   = &&VM_ENTRY_MU_OP_JUMP,                         \
-            [MU_OP_JTRUE]  = &&VM_ENTRY_MU_OP_JTRUE,                        \
             [MU_OP_JFALSE] = &&VM_ENTRY_MU_OP_JFALSE,                       \
             [MU_OP_CALL]   = &&VM_ENTRY_MU_OP_CALL,                         \
             [MU_OP_TCALL]  = &&VM_ENTRY_MU_OP_TCALL,                        \
@@ -120,6 +429,7 @@ mint_t mu_patch(void *p, mint_t nj) {
 #define VM_DISPATCH(pc)                                                     \
     {                                                                       \
         while (1) {                                                         \
+            VM_PROF_INS(&prof, pc, bcode);                                  \
             register uint16_t ins = *pc++;                                  \
             switch (ins >> 12) {
 #define VM_DISPATCH_END                                                     \
@@ -165,22 +475,430 @@ mint_t mu_patch(void *p, mint_t nj) {
 
 
 
+// Operations shared by the interpreter and compiled code
+mu_inline void mu_vm_lookup(mu_t *regs, unsigned d, unsigned a, unsigned b,
+                            struct mcache *cache) {
+    if (mu_istbl(regs[a])) {
+        regs[d] = mu_tbl_lookupcache(regs[a], regs[b], cache);
+    } else if (mu_isbuf(regs[a])) {
+        regs[d] = mu_buf_lookup(regs[a], regs[b]);
+    } else {
+        mu_errorf("unable to lookup %r in %r", regs[b], regs[a]);
+    }
+}
+
+mu_inline void mu_vm_lookdn(mu_t *regs, unsigned d, unsigned a, unsigned b,
+                            struct mcache *cache) {
+    mu_t scratch;
+    if (mu_istbl(regs[a])) {
+        scratch = mu_tbl_lookupcache(regs[a], regs[b], cache);
+    } else if (mu_isbuf(regs[a])) {
+        scratch = mu_buf_lookup(regs[a], regs[b]);
+    } else {
+        mu_errorf("unable to lookup %r in %r", regs[b], regs[a]);
+    }
+
+    mu_dec(regs[a]);
+    regs[d] = scratch;
+}
+
+mu_inline void mu_vm_insert(mu_t *regs, unsigned d, unsigned a, unsigned b) {
+    if (!mu_istbl(regs[a])) {
+        mu_errorf("unable to insert %r to %r in %r",
+                regs[d], regs[b], regs[a]);
+    }
+
+    mu_tbl_insert(regs[a], regs[b], regs[d]);
+}
+
+mu_inline void mu_vm_assign(mu_t *regs, unsigned d, unsigned a, unsigned b) {
+    if (!mu_istbl(regs[a])) {
+        mu_errorf("unable to assign %r to %r in %r",
+                regs[d], regs[b], regs[a]);
+    }
+
+    mu_tbl_assign(regs[a], regs[b], regs[d]);
+}
+
+// Operators may be rebound after code is compiled, so the operator is
+// looked up in the scope through a cache. Returns true with what the
+// operator resolves to if it is no longer the builtin
+mu_inline bool mu_vm_shadowed(mu_t *regs, unsigned o,
+                              struct mcache *cache, mu_t *fn) {
+    *fn = mu_tbl_lookupcache(regs[0], mu_arith_keys[o](), cache);
+    return *fn != mu_arith_def[o]();
+}
+
+mu_inline void mu_vm_arith(mu_t *regs, mu_t *frame,
+                           unsigned d, unsigned o, unsigned a,
+                           struct mcache *cache) {
+    mop_t op = MU_OP_ADD + o;
+    mu_t x = regs[d];
+    mu_t y = regs[a];
+
+    mu_t fn;
+    if (mu_unlikely(mu_vm_shadowed(regs, o, cache, &fn))) {
+        if (!mu_isfn(fn)) {
+            mu_errorf("unable to call %r", fn);
+        }
+
+        bool unary = (op == MU_OP_NEG || op == MU_OP_NOT);
+        frame[0] = x;
+        frame[1] = unary ? 0 : y;
+        mu_fn_fcall(fn, unary ? 0x11 : 0x21, frame);
+        mu_dec(fn);
+        regs[d] = frame[0];
+        return;
+    }
+
+    // Numbers are operated on directly, other values are
+    // passed to the builtin, which also reports type errors
+    if (op == MU_OP_NOT) {
+        regs[d] = !x ? MU_TRUE : MU_FALSE;
+        mu_dec(x);
+    } else if (op == MU_OP_EQ || op == MU_OP_NEQ) {
+        bool eq = mu_str_equals(x, y);
+        regs[d] = (eq == (op == MU_OP_EQ)) ? MU_TRUE : MU_FALSE;
+        mu_dec(x);
+        mu_dec(y);
+    } else if (mu_num_isint(x) && (op == MU_OP_NEG || mu_num_isint(y))) {
+        mint_t xi = mu_num_getint(x);
+        mint_t yi = (op != MU_OP_NEG) ? mu_num_getint(y) : 0;
+
+        // sums of integers always fit in mint_t, operations
+        // that may overflow are left to the number type
+        switch (op) {
+            case MU_OP_ADD:
+                regs[d] = mu_num_fromint(xi + yi);
+                break;
+            case MU_OP_SUB:
+                regs[d] = mu_num_fromint(xi - yi);
+                break;
+            case MU_OP_MUL:
+                regs[d] = mu_num_mul(x, y);
+                break;
+            case MU_OP_DIV:
+                regs[d] = mu_num_div(x, y);
+                break;
+            case MU_OP_IDIV:
+                regs[d] = mu_num_idiv(x, y);
+                break;
+            case MU_OP_MOD:
+                regs[d] = mu_num_mod(x, y);
+                break;
+            case MU_OP_POW:
+                regs[d] = mu_num_pow(x, y);
+                break;
+            case MU_OP_LT:
+                regs[d] = (xi < yi) ? MU_TRUE : MU_FALSE;
+                break;
+            case MU_OP_LTE:
+                regs[d] = (xi <= yi) ? MU_TRUE : MU_FALSE;
+                break;
+            case MU_OP_GT:
+                regs[d] = (xi > yi) ? MU_TRUE : MU_FALSE;
+                break;
+            case MU_OP_GTE:
+                regs[d] = (xi >= yi) ? MU_TRUE : MU_FALSE;
+                break;
+            case MU_OP_NEG:
+                regs[d] = mu_num_fromint(-xi);
+                break;
+            default:
+                mu_unreachable;
+        }
+    } else if (mu_isnum(x) && (op == MU_OP_NEG || mu_isnum(y))) {
+        mfloat_t xf = mu_num_getfloat(x);
+        mfloat_t yf = mu_num_getfloat(y);
+
+        switch (op) {
+            case MU_OP_ADD:
+                regs[d] = mu_num_fromfloat(xf + yf);
+                break;
+            case MU_OP_SUB:
+                regs[d] = mu_num_fromfloat(xf - yf);
+                break;
+            case MU_OP_MUL:
+                regs[d] = mu_num_fromfloat(xf * yf);
+                break;
+            case MU_OP_DIV:
+                regs[d] = mu_num_fromfloat(xf / yf);
+                break;
+            case MU_OP_IDIV:
+                regs[d] = mu_num_idiv(x, y);
+                break;
+            case MU_OP_MOD:
+                regs[d] = mu_num_mod(x, y);
+                break;
+            case MU_OP_POW:
+                regs[d] = mu_num_pow(x, y);
+                break;
+            case MU_OP_LT:
+                regs[d] = (mu_num_cmp(x, y) < 0) ? MU_TRUE : MU_FALSE;
+                break;
+            case MU_OP_LTE:
+                regs[d] = (mu_num_cmp(x, y) <= 0) ? MU_TRUE : MU_FALSE;
+                break;
+            case MU_OP_GT:
+                regs[d] = (mu_num_cmp(x, y) > 0) ? MU_TRUE : MU_FALSE;
+                break;
+            case MU_OP_GTE:
+                regs[d] = (mu_num_cmp(x, y) >= 0) ? MU_TRUE : MU_FALSE;
+                break;
+            case MU_OP_NEG:
+                regs[d] = mu_num_neg(x);
+                break;
+            default:
+                mu_unreachable;
+        }
+    } else {
+        frame[0] = x;
+        frame[1] = (op == MU_OP_NEG) ? 0 : y;
+        mu_fn_fcall(mu_arith_def[o](), 0x21, frame);
+        regs[d] = frame[0];
+    }
+}
+
+mu_inline void mu_vm_call(mu_t *regs, mu_t *frame, unsigned d, unsigned a) {
+    if (!mu_isfn(regs[d])) {
+        mu_errorf("unable to call %r", regs[d]);
+    }
+
+    mu_framemove(a >> 4, frame, &regs[d+1]);
+    mu_fn_fcall(regs[d], a, frame);
+    mu_dec(regs[d]);
+    mu_framemove(0xf & a, &regs[d], frame);
+}
+
+// Returns true if the tail call should reenter with the new code
+// and scope, otherwise the results of calling a builtin are in rets
+mu_inline bool mu_vm_tcall(mu_t *regs, mu_t *frame, unsigned d, unsigned a,
+                           mu_t *c, mu_t *scope, mcnt_t *rets) {
+    mu_t scratch = regs[d];
+    mu_framemove(a, frame, &regs[d+1]);
+
+    // The old scope is released after the new scope is created,
+    // since it may hold the only reference to the closure of a
+    // weakly scoped function.
+    mu_t oldscope = *scope;
+    mu_dec(*c);
+
+    if (!mu_isfn(scratch)) {
+        mu_errorf("unable to call %r", scratch);
+    }
+
+    *c = mu_fn_getcode(scratch);
+    if (*c) {
+        mu_frameconvert(a, mu_code_getargs(*c), frame);
+        if (mu_code_getlocals(*c)) {
+            *scope = mu_tbl_create(mu_code_getlocals(*c));
+            mu_tbl_settail(*scope, mu_fn_getclosure(scratch));
+        } else {
+            *scope = mu_fn_getclosure(scratch);
+        }
+        mu_dec(oldscope);
+        mu_dec(scratch);
+        return true;
+    } else {
+        mu_dec(oldscope);
+        *rets = mu_fn_tcall(scratch, a, frame);
+        return false;
+    }
+}
+
+
+// Instructions with wide prefixes are rare, so they are decoded and
+// executed out of the main loop. Returns -2 to continue, -1 to reenter
+// with the new code and scope, otherwise the count of return values
+static mint_t mu_vm_wide(mu_t *regs, mu_t *frame, mu_t *imms,
+                         struct mcache *caches, muint_t cmask,
+                         const uint16_t *bcode, const uint16_t **pc,
+                         mu_t *c, mu_t *scope) {
+    mop_t op;
+    mint_t d, a, b;
+    *pc += mu_decode(*pc - 1, &op, &d, &a, &b) - 1;
+
+    switch (op) {
+        case MU_OP_IMM:
+            regs[d] = mu_inc(imms[a]);
+            return -2;
+        case MU_OP_FN:
+            regs[d] = mu_fn_fromcode(mu_inc(imms[a]), mu_inc(regs[0]));
+            return -2;
+        case MU_OP_TBL:
+            regs[d] = mu_tbl_create(a);
+            return -2;
+        case MU_OP_MOVE:
+            regs[d] = regs[a];
+            return -2;
+        case MU_OP_DUP:
+            regs[d] = mu_inc(regs[a]);
+            return -2;
+        case MU_OP_DROP:
+            mu_dec(regs[d]);
+            return -2;
+        case MU_OP_LOOKUP:
+            mu_vm_lookup(regs, d, a, b, &caches[(*pc - bcode) & cmask]);
+            return -2;
+        case MU_OP_LOOKDN:
+            mu_vm_lookdn(regs, d, a, b, &caches[(*pc - bcode) & cmask]);
+            return -2;
+        case MU_OP_INSERT:
+            mu_vm_insert(regs, d, a, b);
+            return -2;
+        case MU_OP_ASSIGN:
+            mu_vm_assign(regs, d, a, b);
+            return -2;
+        case MU_OP_JUMP:
+            *pc += a;
+            return -2;
+        case MU_OP_JFALSE:
+            if (!regs[d]) {
+                *pc += a;
+            }
+            return -2;
+        case MU_OP_CALL:
+            mu_vm_call(regs, frame, d, a);
+            return -2;
+        case MU_OP_RET:
+            mu_framemove(a, frame, &regs[d]);
+            mu_dec(*scope);
+            mu_dec(*c);
+            return a;
+        case MU_OP_TCALL: {
+            mcnt_t rets;
+            if (mu_vm_tcall(regs, frame, d, a, c, scope, &rets)) {
+                return -1;
+            }
+            return rets;
+        }
+        default:
+            mu_vm_arith(regs, frame, d, op - MU_OP_ADD, a,
+                    &caches[(*pc - bcode) & cmask]);
+            return -2;
+    }
+}
+
+
+#ifdef MU_JIT
+// Entry points for compiled code
+mu_t mu_jit_inc(mu_t m) {
+    return mu_inc(m);
+}
+
+void mu_jit_dec(mu_t m) {
+    mu_dec(m);
+}
+
+void mu_jit_fn(struct mjitstate *s, unsigned d, muint_t i) {
+    s->regs[d] = mu_fn_fromcode(mu_inc(s->imms[i]), mu_inc(s->regs[0]));
+}
+
+void mu_jit_tbl(struct mjitstate *s, unsigned d, muint_t i) {
+    s->regs[d] = mu_tbl_create(i);
+}
+
+void mu_jit_lookup(struct mjitstate *s, unsigned d, unsigned a, unsigned b,
+                   struct mcache *cache) {
+    mu_vm_lookup(s->regs, d, a, b, cache);
+}
+
+void mu_jit_lookdn(struct mjitstate *s, unsigned d, unsigned a, unsigned b,
+                   struct mcache *cache) {
+    mu_vm_lookdn(s->regs, d, a, b, cache);
+}
+
+void mu_jit_insert(struct mjitstate *s, unsigned d, unsigned a, unsigned b) {
+    mu_vm_insert(s->regs, d, a, b);
+}
+
+void mu_jit_assign(struct mjitstate *s, unsigned d, unsigned a, unsigned b) {
+    mu_vm_assign(s->regs, d, a, b);
+}
+
+bool mu_jit_builtin(struct mjitstate *s, unsigned o, struct mcache *cache) {
+    mu_t fn;
+    bool shadowed = mu_vm_shadowed(s->regs, o, cache, &fn);
+    mu_dec(fn);
+    return !shadowed;
+}
+
+void mu_jit_arith(struct mjitstate *s, unsigned d, unsigned o, unsigned a,
+                  struct mcache *cache) {
+    mu_vm_arith(s->regs, s->frame, d, o, a, cache);
+}
+
+void mu_jit_call(struct mjitstate *s, unsigned d, unsigned a) {
+    mu_vm_call(s->regs, s->frame, d, a);
+}
+
+// The code object is released by the interpreter once compiled
+// code has returned, since it owns the memory being executed
+int mu_jit_ret(struct mjitstate *s, unsigned d, unsigned a) {
+    mu_framemove(a, s->frame, &s->regs[d]);
+    mu_dec(s->scope);
+    return a;
+}
+
+int mu_jit_tcall(struct mjitstate *s, unsigned d, unsigned a) {
+    mu_t c = mu_inc(s->code);
+    mcnt_t rets;
+    if (mu_vm_tcall(s->regs, s->frame, d, a, &c, &s->scope, &rets)) {
+        s->code = c;
+        return -1;
+    }
+
+    return rets;
+}
+#endif
+
 mcnt_t mu_exec(mu_t c, mu_t scope, mu_t *frame) {
     mu_assert(mu_iscode(c));
 
     // Allocate temporary variables
     const uint16_t *pc;
+    const uint16_t *bcode;
     mu_t *imms;
+    struct mcache *caches;
+    muint_t cmask;
+
+#ifdef MU_PROF
+    struct mprofframe prof;
+#endif
+    VM_PROF_PUSH(&prof);
 
 reenter:
     {   // Setup the registers and scope
         mu_t regs[mu_code_getregs(c)];
         regs[0] = scope;
         mu_framemove(mu_code_getargs(c), &regs[1], frame);
+        memset(&regs[1 + mu_framecount(mu_code_getargs(c))], 0,
+               sizeof(mu_t) * (mu_code_getregs(c) - 1 -
+                               mu_framecount(mu_code_getargs(c))));
 
         // Setup other state
         imms = mu_code_getimms(c);
-        pc = mu_code_getbcode(c);
+        caches = mu_code_getcaches(c);
+        cmask = mu_code_getcacheslen(c) - 1;
+        bcode = mu_code_getbcode(c);
+        pc = bcode;
+        VM_PROF_ENTER(&prof, c);
+
+#ifdef MU_JIT
+        mjit_t *jit = mu_jit_get(c);
+        if (jit) {
+            struct mjitstate s = {regs, frame, imms, c, scope};
+            int rets = jit(&s);
+            mu_dec(c);
+            if (rets >= 0) {
+                return rets;
+            }
+
+            c = s.code;
+            scope = s.scope;
+            goto reenter;
+        }
+#endif
 
         // Enter main execution loop
         VM_DISPATCH(pc)
@@ -209,55 +927,44 @@ reenter:
             VM_ENTRY_END
 
             VM_ENTRY_DAB(MU_OP_LOOKUP, d, a, b)
-                if (mu_istbl(regs[a])) {
-                    regs[d] = mu_tbl_lookup(regs[a], regs[b]);
-                } else if (mu_isbuf(regs[a])) {
-                    regs[d] = mu_buf_lookup(regs[a], regs[b]);
-                } else {
-                    mu_errorf("unable to lookup %r in %r", regs[b], regs[a]);
-                }
+                mu_vm_lookup(regs, d, a, b, &caches[(pc - bcode) & cmask]);
             VM_ENTRY_END
 
             VM_ENTRY_DAB(MU_OP_LOOKDN, d, a, b)
-                mu_t scratch;
-                if (mu_istbl(regs[a])) {
-                    scratch = mu_tbl_lookup(regs[a], regs[b]);
-                } else if (mu_isbuf(regs[a])) {
-                    scratch = mu_buf_lookup(regs[a], regs[b]);
-                } else {
-                    mu_errorf("unable to lookup %r in %r", regs[b], regs[a]);
-                }
-
-                mu_dec(regs[a]);
-                regs[d] = scratch;
+                mu_vm_lookdn(regs, d, a, b, &caches[(pc - bcode) & cmask]);
             VM_ENTRY_END
 
             VM_ENTRY_DAB(MU_OP_INSERT, d, a, b)
-                if (!mu_istbl(regs[a])) {
-                    mu_errorf("unable to insert %r to %r in %r",
-                            regs[d], regs[b], regs[a]);
-                }
-
-                mu_tbl_insert(regs[a], regs[b], regs[d]);
+                mu_vm_insert(regs, d, a, b);
             VM_ENTRY_END
 
             VM_ENTRY_DAB(MU_OP_ASSIGN, d, a, b)
-                if (!mu_istbl(regs[a])) {
-                    mu_errorf("unable to assign %r to %r in %r",
-                            regs[d], regs[b], regs[a]);
-                }
-
-                mu_tbl_assign(regs[a], regs[b], regs[d]);
+                mu_vm_assign(regs, d, a, b);
             VM_ENTRY_END
 
-            VM_ENTRY_DJ(MU_OP_JUMP, d, j)
-                pc += j;
+            VM_ENTRY_DAB(MU_OP_ARITH, d, o, a)
+                if (o == (0xf & MU_OP_WIDE)) {
+                    mint_t rets = mu_vm_wide(regs, frame, imms,
+                            caches, cmask, bcode, &pc, &c, &scope);
+                    if (rets == -1) {
+                        goto reenter;
+                    } else if (rets >= 0) {
+                        VM_PROF_POP(&prof);
+                        return rets;
+                    }
+                } else {
+                    mu_vm_arith(regs, frame, d, o, a,
+                            &caches[(pc - bcode) & cmask]);
+                }
             VM_ENTRY_END
 
-            VM_ENTRY_DJ(MU_OP_JTRUE, d, j)
-                if (regs[d]) {
-                    pc += j;
+            VM_ENTRY_DJ(MU_OP_JUMP, d, j)
+#ifdef MU_JIT
+                if (j < 0) {
+                    mu_jit_backedge(c);
                 }
+#endif
+                pc += j;
             VM_ENTRY_END
 
             VM_ENTRY_DJ(MU_OP_JFALSE, d, j)
@@ -267,45 +974,27 @@ reenter:
             VM_ENTRY_END
 
             VM_ENTRY_DA(MU_OP_CALL, d, a)
-                if (!mu_isfn(regs[d])) {
-                    mu_errorf("unable to call %r", regs[d]);
-                }
-
-                mu_framemove(a >> 4, frame, &regs[d+1]);
-                mu_fn_fcall(regs[d], a, frame);
-                mu_dec(regs[d]);
-                mu_framemove(0xf & a, &regs[d], frame);
+                mu_vm_call(regs, frame, d, a);
             VM_ENTRY_END
 
             VM_ENTRY_DA(MU_OP_RET, d, a)
                 mu_framemove(a, frame, &regs[d]);
                 mu_dec(scope);
                 mu_dec(c);
+                VM_PROF_POP(&prof);
                 return a;
             VM_ENTRY_END
 
             VM_ENTRY_DA(MU_OP_TCALL, d, a)
-                mu_t scratch = regs[d];
-                mu_framemove(a, frame, &regs[d+1]);
-                mu_dec(scope);
-                mu_dec(c);
-
                 // Use a direct goto to garuntee a tail call when the target
                 // is another mu function. Otherwise, we just try our hardest
                 // to get a tail call emitted.
-                if (!mu_isfn(scratch)) {
-                    mu_errorf("unable to call %r", scratch);
-                }
-
-                c = mu_fn_getcode(scratch);
-                if (c) {
-                    mu_frameconvert(a, mu_code_getargs(c), frame);
-                    scope = mu_tbl_create(mu_code_getlocals(c));
-                    mu_tbl_settail(scope, mu_fn_getclosure(scratch));
-                    mu_dec(scratch);
+                mcnt_t rets;
+                if (mu_vm_tcall(regs, frame, d, a, &c, &scope, &rets)) {
                     goto reenter;
                 } else {
-                    return mu_fn_tcall(scratch, a, frame);
+                    VM_PROF_POP(&prof);
+                    return rets;
                 }
             VM_ENTRY_END
         VM_DISPATCH_END
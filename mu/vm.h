@@ -27,6 +27,9 @@
 // may remain in use after decrementing.
 // 
 // The special register r0 contains the scope of the current function.
+// Functions without locals in a scope use their closure as the scope
+// directly, and registers past the arguments start as nil since the
+// compiler may store locals in them.
 typedef enum mop {
 /*  opcode      encoding  operation                  description                        */
     MU_OP_IMM     = 0x6, /* rd = imms[a]               loads immediate                    */
@@ -42,20 +45,66 @@ typedef enum mop {
     MU_OP_INSERT  = 0xb, /* ra[rb-] = rd-              nonrecursive table insert          */
     MU_OP_ASSIGN  = 0xc, /* ra[rb-] = rd-              recursive table assign             */
 
+    MU_OP_ARITH   = 0xd, /* rd = rd- op ra-            builtin operators listed below     */
+
     MU_OP_JUMP    = 0xf, /* pc = pc + a                jumps to pc offset                 */
-    MU_OP_JTRUE   = 0xe, /* if (rd)  pc = pc + a       conditionally jumps if not nil     */
-    MU_OP_JFALSE  = 0xd, /* if (!rd) pc = pc + a       conditionally jumps if nil         */
+    MU_OP_JFALSE  = 0xe, /* if (!rd) pc = pc + a       conditionally jumps if nil         */
 
     MU_OP_CALL    = 0x2, /* rd..d+b-1 = rd-(rd+1..d+a) performs function call             */
     MU_OP_TCALL   = 0x1, /* return rd-(rd+1..d+a)      performs tail recursive call       */
     MU_OP_RET     = 0x0, /* return rd..d+b-1           returns values                     */
+
+/*  builtin operators are encoded as MU_OP_ARITH with the operator stored before ra        */
+    MU_OP_ADD     = 0xd0, /* rd = rd- + ra-            addition                           */
+    MU_OP_SUB     = 0xd1, /* rd = rd- - ra-            subtraction                        */
+    MU_OP_MUL     = 0xd2, /* rd = rd- * ra-            multiplication                     */
+    MU_OP_DIV     = 0xd3, /* rd = rd- / ra-            division                           */
+    MU_OP_IDIV    = 0xd4, /* rd = rd- // ra-           integer division                   */
+    MU_OP_MOD     = 0xd5, /* rd = rd- % ra-            modulo                             */
+    MU_OP_POW     = 0xd6, /* rd = rd- ^ ra-            exponentiation                     */
+    MU_OP_EQ      = 0xd7, /* rd = rd- == ra-           equality                           */
+    MU_OP_NEQ     = 0xd8, /* rd = rd- != ra-           inequality                         */
+    MU_OP_LT      = 0xd9, /* rd = rd- < ra-            less than                          */
+    MU_OP_LTE     = 0xda, /* rd = rd- <= ra-           less than or equal                 */
+    MU_OP_GT      = 0xdb, /* rd = rd- > ra-            greater than                       */
+    MU_OP_GTE     = 0xdc, /* rd = rd- >= ra-           greater than or equal              */
+    MU_OP_NEG     = 0xdd, /* rd = -rd-                 negation                           */
+    MU_OP_NOT     = 0xde, /* rd = !rd-                 logical not                        */
+
+/*  registers past r15 are encoded with prefixes holding the high bits of the operands     */
+    MU_OP_WIDE    = 0xdf, /* rd:ra of next instruction extends register operands          */
 } mop_t;
 
 
+// Number of registers addressable by encoded operands
+//
+// Instructions are 16 bits with 4-bit register operands. Larger registers
+// are encoded with wide prefixes, each holding the high 4 bits of the next
+// two register operands of the instruction in the order d, a, b.
+#define MU_REGS 255
+
+// Builtin operators are encoded as dedicated opcodes when the operator
+// resolves to the builtin at compile time. Numbers are operated on
+// directly, while other operands fall back to calling the builtin.
+// Each operator is still looked up through a lookup cache when run,
+// and calls whatever it resolves to if it has since been rebound.
+// Returns the opcode for calling fn with the given number of arguments,
+// or 0 if fn is not a builtin operator
+mop_t mu_arith(mu_t fn, mcnt_t args);
+
+// Name an operator opcode is looked up by
+mu_t mu_arith_key(mop_t op);
+
 // Encode opcode
 void mu_encode(void (*emit)(void *, mbyte_t), void *p,
                mop_t op, mint_t d, mint_t a, mint_t b);
 
+// Decode instruction, including any prefixes, into the operands passed
+// to mu_encode. Jump offsets are in words from the end of the instruction.
+// Returns the size of the instruction in words
+muint_t mu_decode(const uint16_t *pc,
+                  mop_t *op, mint_t *d, mint_t *a, mint_t *b);
+
 // Replace jump with actual jump distance and returns previous jump value
 // Note: Currently can not change size of jump instruction
 mint_t mu_patch(void *c, mint_t j);
@@ -64,4 +113,109 @@ mint_t mu_patch(void *c, mint_t j);
 mcnt_t mu_exec(mu_t code, mu_t scope, mu_t *frame);
 
 
+#ifdef MU_JIT
+// Compilation of bytecode to native code, enabled with MU_JIT
+//
+// Code objects are compiled on entry once their calls and backward
+// jumps add up to MU_JIT_THRESHOLD, so both small functions called
+// often and functions containing long loops get compiled. Each
+// instruction is translated to a template of native code that keeps
+// registers in the interpreter's frame, with numeric
+// operators and jumps inlined and other operations calling into
+// the same implementation as the interpreter. Code that fails to
+// compile falls back to the interpreter.
+#ifndef MU_JIT_THRESHOLD
+#define MU_JIT_THRESHOLD 64
+#endif
+
+// State shared between compiled code and the interpreter
+struct mjitstate {
+    mu_t *regs;
+    mu_t *frame;
+    mu_t *imms;
+    mu_t code;
+    mu_t scope;
+};
+
+// Compiled code returns the frame count of returned values, or -1
+// if a tail call should reenter with the code and scope in the state
+typedef int mjit_t(struct mjitstate *s);
+
+// Returns compiled code if the code object is hot
+mu_inline mjit_t *mu_jit_get(mu_t c);
+
+// Counts a backward jump towards compiling a code object
+mu_inline void mu_jit_backedge(mu_t c);
+
+// Releases any compiled code attached to a code object
+void mu_jit_destroy(mu_t c);
+#endif
+
+#ifdef MU_PROF
+// Profiling of bytecode execution, enabled with MU_PROF
+//
+// Each dispatched instruction is counted, and the cycles until the
+// next instruction is dispatched in any function are charged to it.
+// Counts are kept per opcode, with builtin operators separated, per
+// code object and bytecode offset, and per node in a call tree of
+// code objects for producing collapsed stacks.
+struct mprofcount {
+    uint64_t count;
+    uint64_t cycles;
+};
+
+struct mprofcode {
+    mu_t code;                  // profiled code object
+    struct mprofcount total;
+    struct mprofcount *ins;     // indexed by bytecode offset / 2
+};
+
+struct mprofnode {
+    muint_t parent;             // index of caller node, root is 0
+    muint_t code;               // index into mu_prof_codes
+    struct mprofcount self;
+};
+
+#define MU_PROF_OPS 32
+
+extern struct mprofcount mu_prof_ops[MU_PROF_OPS];
+extern struct mprofcode *mu_prof_codes;
+extern muint_t mu_prof_codecount;
+extern struct mprofnode *mu_prof_nodes;
+extern muint_t mu_prof_nodecount;
+
+// Index into mu_prof_ops for an instruction
+mu_inline muint_t mu_prof_op(uint16_t ins) {
+    return (ins >> 12) == MU_OP_ARITH ? 16 + (0xf & (ins >> 4)) : ins >> 12;
+}
+
+// Clears all collected counts
+void mu_prof_reset(void);
+#endif
+
+
+#ifdef MU_JIT
+// Compiled code access
+mu_inline mjit_t *mu_jit_get(mu_t c) {
+    struct mcode *code = mu_buf_getdata(c);
+    if (code->jit) {
+        return (mjit_t *)code->jit;
+    } else if (code->hot > MU_JIT_THRESHOLD ||
+               code->hot++ < MU_JIT_THRESHOLD) {
+        return 0;
+    }
+
+    extern mjit_t *mu_jit_compile(mu_t c);
+    return mu_jit_compile(c);
+}
+
+mu_inline void mu_jit_backedge(mu_t c) {
+    struct mcode *code = mu_buf_getdata(c);
+    if (code->hot < MU_JIT_THRESHOLD) {
+        code->hot++;
+    }
+}
+#endif
+
+
 #endif
@@ -0,0 +1,139 @@
+/*
+ * Mu profiling library for bytecode execution
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license in mu.h
+ */
+#include "prof.h"
+#include "mu/mu.h"
+
+
+// Names of profiled opcodes, indexed by mu_prof_op
+static const char *const op_names[MU_PROF_OPS] = {
+    [MU_OP_IMM]    = "imm",
+    [MU_OP_FN]     = "fn",
+    [MU_OP_TBL]    = "tbl",
+    [MU_OP_MOVE]   = "move",
+    [MU_OP_DUP]    = "dup",
+    [MU_OP_DROP]   = "drop",
+    [MU_OP_LOOKUP] = "lookup",
+    [MU_OP_LOOKDN] = "lookdn",
+    [MU_OP_INSERT] = "insert",
+    [MU_OP_ASSIGN] = "assign",
+    [MU_OP_ARITH]  = "arith",
+    [MU_OP_JUMP]   = "jump",
+    [MU_OP_JFALSE] = "jfalse",
+    [MU_OP_CALL]   = "call",
+    [MU_OP_TCALL]  = "tcall",
+    [MU_OP_RET]    = "ret",
+
+    [16 + (0xf & MU_OP_ADD)]  = "add",
+    [16 + (0xf & MU_OP_SUB)]  = "sub",
+    [16 + (0xf & MU_OP_MUL)]  = "mul",
+    [16 + (0xf & MU_OP_DIV)]  = "div",
+    [16 + (0xf & MU_OP_IDIV)] = "idiv",
+    [16 + (0xf & MU_OP_MOD)]  = "mod",
+    [16 + (0xf & MU_OP_POW)]  = "pow",
+    [16 + (0xf & MU_OP_EQ)]   = "eq",
+    [16 + (0xf & MU_OP_NEQ)]  = "neq",
+    [16 + (0xf & MU_OP_LT)]   = "lt",
+    [16 + (0xf & MU_OP_LTE)]  = "lte",
+    [16 + (0xf & MU_OP_GT)]   = "gt",
+    [16 + (0xf & MU_OP_GTE)]  = "gte",
+    [16 + (0xf & MU_OP_NEG)]  = "neg",
+    [16 + (0xf & MU_OP_NOT)]  = "not",
+    [16 + (0xf & MU_OP_WIDE)] = "wide",
+};
+
+
+// Output as a table, with counts followed by cycles
+void mu_prof_table(void) {
+    mu_printf("ops:");
+    for (muint_t i = 0; i < MU_PROF_OPS; i++) {
+        if (mu_prof_ops[i].count) {
+            mu_printf("%s\t%wu\t%wu", op_names[i],
+                    (muint_t)mu_prof_ops[i].count,
+                    (muint_t)mu_prof_ops[i].cycles);
+        }
+    }
+
+    mu_printf("code:");
+    for (muint_t i = 0; i < mu_prof_codecount; i++) {
+        struct mprofcode *p = &mu_prof_codes[i];
+        const uint16_t *bcode = mu_code_getbcode(p->code);
+        mu_printf("code%wu %t\t%wu\t%wu", i, mu_inc(p->code),
+                (muint_t)p->total.count,
+                (muint_t)p->total.cycles);
+
+        for (muint_t j = 0; j < mu_code_getbcodelen(p->code)/2; j++) {
+            if (p->ins[j].count) {
+                mu_printf("%hx  %s\t%wu\t%wu", j,
+                        op_names[mu_prof_op(bcode[j])],
+                        (muint_t)p->ins[j].count,
+                        (muint_t)p->ins[j].cycles);
+            }
+        }
+    }
+}
+
+// Output as collapsed stacks, weighted by cycles if available
+static void mu_prof_pushpath(mu_t *b, muint_t *n, muint_t node) {
+    if (mu_prof_nodes[node].parent) {
+        mu_prof_pushpath(b, n, mu_prof_nodes[node].parent);
+        mu_buf_pushc(b, n, ';');
+    }
+
+    mu_buf_pushf(b, n, "code%wu", mu_prof_nodes[node].code);
+}
+
+void mu_prof_stacks(void) {
+    bool cycles = false;
+    for (muint_t i = 1; i < mu_prof_nodecount; i++) {
+        cycles = cycles || mu_prof_nodes[i].self.cycles;
+    }
+
+    for (muint_t i = 1; i < mu_prof_nodecount; i++) {
+        uint64_t weight = cycles ? mu_prof_nodes[i].self.cycles
+                                 : mu_prof_nodes[i].self.count;
+        if (!weight) {
+            continue;
+        }
+
+        mu_t b = mu_buf_create(0);
+        muint_t n = 0;
+        mu_prof_pushpath(&b, &n, i);
+        mu_buf_pushf(&b, &n, " %wu", (muint_t)weight);
+        mu_print(mu_buf_getdata(b), n);
+        mu_dec(b);
+    }
+}
+
+
+// Profiler module
+static mcnt_t mu_prof_table_bfn(mu_t *frame) {
+    mu_prof_table();
+    return 0;
+}
+
+static mcnt_t mu_prof_stacks_bfn(mu_t *frame) {
+    mu_prof_stacks();
+    return 0;
+}
+
+static mcnt_t mu_prof_reset_bfn(mu_t *frame) {
+    mu_prof_reset();
+    return 0;
+}
+
+MU_DEF_STR(mu_prof_key_def, "prof")
+MU_DEF_STR(mu_prof_table_key_def, "table")
+MU_DEF_BFN(mu_prof_table_def, 0x0, mu_prof_table_bfn)
+MU_DEF_STR(mu_prof_stacks_key_def, "stacks")
+MU_DEF_BFN(mu_prof_stacks_def, 0x0, mu_prof_stacks_bfn)
+MU_DEF_STR(mu_prof_reset_key_def, "reset")
+MU_DEF_BFN(mu_prof_reset_def, 0x0, mu_prof_reset_bfn)
+MU_DEF_TBL(mu_prof_module_def, {
+    { mu_prof_table_key_def,  mu_prof_table_def },
+    { mu_prof_stacks_key_def, mu_prof_stacks_def },
+    { mu_prof_reset_key_def,  mu_prof_reset_def },
+})
@@ -0,0 +1,29 @@
+/*
+ * Mu profiling library for bytecode execution
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license in mu.h
+ */
+#ifndef MU_PROF_H
+#define MU_PROF_H
+#include "mu/mu.h"
+
+
+// Outputs collected counts to stdout, requires MU_PROF
+// As a table of opcodes, code objects and bytecode offsets
+void mu_prof_table(void);
+
+// As collapsed stacks of code objects for flamegraphs
+void mu_prof_stacks(void);
+
+// Profiler module in Mu
+#define MU_PROF_KEY     mu_prof_key_def()
+#define MU_PROF_MODULE  mu_prof_module_def()
+MU_DEF(mu_prof_key_def)
+MU_DEF(mu_prof_table_def)
+MU_DEF(mu_prof_stacks_def)
+MU_DEF(mu_prof_reset_def)
+MU_DEF(mu_prof_module_def)
+
+
+#endif
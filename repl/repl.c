@@ -181,7 +181,7 @@ static void mu_repl_tab(struct mrepl *r, mu_t scope, bool show) {
     }
 
     mu_t best = MU_NIL;
-    mu_t results;
+    mu_t results = 0;
     if (show) {
         results = mu_tbl_create(0);
     }